@@ -0,0 +1,1101 @@
+#include "analysis.h"
+#include <algorithm>
+BitSet::BitSet() : bits(0) {}
+BitSet::BitSet(size_t n) : bits(0) {
+    resize(n);
+}
+void BitSet::resize(size_t n) {
+    bits = n;
+    words.assign((n + 63) / 64, 0);
+}
+void BitSet::clear() {
+    std::fill(words.begin(), words.end(), 0);
+}
+void BitSet::set(size_t i) {
+    words[i / 64] |= static_cast<uint64_t>(1) << (i % 64);
+}
+void BitSet::reset(size_t i) {
+    words[i / 64] &= ~(static_cast<uint64_t>(1) << (i % 64));
+}
+bool BitSet::test(size_t i) const {
+    return (words[i / 64] >> (i % 64)) & 1;
+}
+size_t BitSet::count() const {
+    size_t n = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        n += static_cast<size_t>(__builtin_popcountll(words[i]));
+    }
+    return n;
+}
+bool BitSet::empty() const {
+    for (size_t i = 0; i < words.size(); i++) {
+        if (words[i]) return false;
+    }
+    return true;
+}
+bool BitSet::assign(const BitSet& other) {
+    bool changed = false;
+    for (size_t i = 0; i < words.size(); i++) {
+        changed |= words[i] != other.words[i];
+        words[i] = other.words[i];
+    }
+    return changed;
+}
+bool BitSet::union_with(const BitSet& other) {
+    uint64_t changed = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        uint64_t w = words[i] | other.words[i];
+        changed |= w ^ words[i];
+        words[i] = w;
+    }
+    return changed != 0;
+}
+bool BitSet::intersect_with(const BitSet& other) {
+    uint64_t changed = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        uint64_t w = words[i] & other.words[i];
+        changed |= w ^ words[i];
+        words[i] = w;
+    }
+    return changed != 0;
+}
+bool BitSet::subtract(const BitSet& other) {
+    uint64_t changed = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        uint64_t w = words[i] & ~other.words[i];
+        changed |= w ^ words[i];
+        words[i] = w;
+    }
+    return changed != 0;
+}
+bool BitSet::operator==(const BitSet& other) const {
+    return bits == other.bits && words == other.words;
+}
+bool BitSet::operator!=(const BitSet& other) const {
+    return !(*this == other);
+}
+bool op_is_jump(const Op& op) {
+    return op.type == OpType::JmpLabel || op.type == OpType::JmpIfNotLabel ||
+           op.type == OpType::CmpJmpIfNotLabel || op.type == OpType::JmpTable;
+}
+bool op_falls_through(const Op& op) {
+    return op.type != OpType::JmpLabel && op.type != OpType::JmpTable && op.type != OpType::Return;
+}
+template <typename OpT, typename LabelT>
+static void collect_jump_labels(OpT& op, std::vector<LabelT*>& labels) {
+    labels.clear();
+    if (!op_is_jump(op)) return;
+    labels.push_back(&op.label);
+    if (op.type != OpType::JmpTable) return;
+    for (size_t i = 0; i < op.labels.size(); i++) {
+        labels.push_back(&op.labels[i]);
+    }
+}
+void op_jump_labels(Op& op, std::vector<size_t*>& labels) {
+    collect_jump_labels(op, labels);
+}
+void op_jump_labels(const Op& op, std::vector<const size_t*>& labels) {
+    collect_jump_labels(op, labels);
+}
+size_t count_slot_uses(const Func& func, size_t slot) {
+    size_t count = 0;
+    std::vector<size_t> uses;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        op_used_slots(func.body[i].opcode, uses);
+        for (size_t u : uses) {
+            if (u == slot) count++;
+        }
+    }
+    return count;
+}
+size_t body_size(const Func& func) {
+    size_t size = 0;
+    for (const OpWithLocation& owl : func.body) {
+        if (owl.opcode.type != OpType::Label) size++;
+    }
+    return size;
+}
+bool direct_callee(const Op& op, const std::map<std::string, size_t>& index, size_t& callee) {
+    if (op.type != OpType::Funcall) return false;
+    if (op.arg.type != ArgType::External && op.arg.type != ArgType::RefExternal) return false;
+    auto it = index.find(op.arg.name);
+    if (it == index.end()) return false;
+    callee = it->second;
+    return true;
+}
+void callees_first(const Compiler& c, const std::map<std::string, size_t>& index, size_t f,
+                          std::vector<bool>& visited, std::vector<size_t>& order) {
+    visited[f] = true;
+    for (const OpWithLocation& owl : c.funcs[f].body) {
+        size_t callee;
+        if (direct_callee(owl.opcode, index, callee) && !visited[callee]) {
+            callees_first(c, index, callee, visited, order);
+        }
+    }
+    order.push_back(f);
+}
+void push_op(std::vector<OpWithLocation>& body, const Op& op, const Loc& loc) {
+    OpWithLocation owl;
+    owl.opcode = op;
+    owl.loc = loc;
+    body.push_back(owl);
+}
+void push_op(std::vector<OpWithLocation>& body, const Op& op, const OpWithLocation& from) {
+    OpWithLocation owl;
+    owl.opcode = op;
+    owl.loc = from.loc;
+    owl.count = from.count;
+    body.push_back(owl);
+}
+bool fold_binop(Binop op, unsigned long long a, unsigned long long b, unsigned long long& out) {
+    long long sa = static_cast<long long>(a);
+    long long sb = static_cast<long long>(b);
+    switch (op) {
+        case Binop::Plus:         out = a + b; return true;
+        case Binop::Minus:        out = a - b; return true;
+        case Binop::Mult:         out = a * b; return true;
+        case Binop::Div:
+        case Binop::Mod:
+            if (sb == 0 || (sb == -1 && sa == static_cast<long long>(1ULL << 63))) return false;
+            out = static_cast<unsigned long long>(op == Binop::Div ? sa / sb : sa % sb);
+            return true;
+        case Binop::Less:         out = sa < sb; return true;
+        case Binop::Greater:      out = sa > sb; return true;
+        case Binop::LessEqual:    out = sa <= sb; return true;
+        case Binop::GreaterEqual: out = sa >= sb; return true;
+        case Binop::Equal:        out = a == b; return true;
+        case Binop::NotEqual:     out = a != b; return true;
+        case Binop::BitOr:        out = a | b; return true;
+        case Binop::BitAnd:       out = a & b; return true;
+        case Binop::BitShl:       out = a << (b & 63); return true;
+        case Binop::BitShr:       out = a >> (b & 63); return true;
+        case Binop::BitSar:       out = static_cast<unsigned long long>(sa >> (b & 63)); return true;
+    }
+    return false;
+}
+bool is_pure_op(const Op& op) {
+    switch (op.type) {
+        case OpType::UnaryNot:
+        case OpType::Negate:
+        case OpType::Binop:
+        case OpType::AutoAssign:
+        case OpType::Select:
+            return true;
+        case OpType::Intrinsic:
+            return !intrinsic_writes_memory(op);
+        default:
+            return false;
+    }
+}
+bool is_slot(const Arg& arg, size_t slot) {
+    return arg.type == ArgType::AutoVar && arg.index == slot;
+}
+bool is_constant_arg(const Arg& arg) {
+    return arg.type == ArgType::Literal || arg.type == ArgType::RefAutoVar ||
+           arg.type == ArgType::RefExternal || arg.type == ArgType::DataOffset;
+}
+bool same_arg(const Arg& a, const Arg& b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case ArgType::AutoVar:
+        case ArgType::Deref:
+        case ArgType::RefAutoVar:
+            return a.index == b.index;
+        case ArgType::RefExternal:
+        case ArgType::External:
+            return a.name == b.name;
+        case ArgType::Literal:
+            return a.value == b.value;
+        case ArgType::DataOffset:
+            return a.offset == b.offset;
+        default:
+            return false;
+    }
+}
+size_t max_label_index(const Func& func) {
+    size_t count = 0;
+    std::vector<const size_t*> labels;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        const Op& op = func.body[i].opcode;
+        if (op.type == OpType::Label) {
+            count = std::max(count, op.label + 1);
+        }
+        op_jump_labels(op, labels);
+        for (const size_t* label : labels) {
+            count = std::max(count, *label + 1);
+        }
+    }
+    return count;
+}
+void build_cfg(const Func& func, Cfg& cfg) {
+    cfg.blocks.clear();
+    cfg.block_of_op.assign(func.body.size(), NO_BLOCK);
+    cfg.block_of_label.assign(max_label_index(func), NO_BLOCK);
+    size_t i = 0;
+    while (i < func.body.size()) {
+        BasicBlock block;
+        block.begin = i;
+        size_t id = cfg.blocks.size();
+        while (i < func.body.size()) {
+            const Op& op = func.body[i].opcode;
+            if (op.type == OpType::Label) {
+                if (i > block.begin) break;
+                cfg.block_of_label[op.label] = id;
+            }
+            cfg.block_of_op[i] = id;
+            i++;
+            if (op_is_jump(op) || op.type == OpType::Return) break;
+        }
+        block.end = i;
+        cfg.blocks.push_back(block);
+    }
+    std::vector<const size_t*> labels;
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        BasicBlock& block = cfg.blocks[b];
+        const Op& last = func.body[block.end - 1].opcode;
+        op_jump_labels(last, labels);
+        for (const size_t* label : labels) {
+            size_t target = cfg.block_of_label[*label];
+            if (target != NO_BLOCK &&
+                std::find(block.succs.begin(), block.succs.end(), target) == block.succs.end()) {
+                block.succs.push_back(target);
+            }
+        }
+        if (op_falls_through(last) && b + 1 < cfg.blocks.size()) {
+            if (std::find(block.succs.begin(), block.succs.end(), b + 1) == block.succs.end()) {
+                block.succs.push_back(b + 1);
+            }
+        }
+    }
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        for (size_t s : cfg.blocks[b].succs) {
+            cfg.blocks[s].preds.push_back(b);
+        }
+    }
+}
+void reverse_postorder(const Cfg& cfg, std::vector<size_t>& order) {
+    order.clear();
+    if (cfg.blocks.empty()) return;
+    std::vector<bool> visited(cfg.blocks.size(), false);
+    std::vector<std::pair<size_t, size_t>> stack;
+    stack.push_back(std::make_pair(static_cast<size_t>(0), static_cast<size_t>(0)));
+    visited[0] = true;
+    while (!stack.empty()) {
+        size_t b = stack.back().first;
+        size_t& next = stack.back().second;
+        if (next < cfg.blocks[b].succs.size()) {
+            size_t s = cfg.blocks[b].succs[next++];
+            if (!visited[s]) {
+                visited[s] = true;
+                stack.push_back(std::make_pair(s, static_cast<size_t>(0)));
+            }
+        } else {
+            order.push_back(b);
+            stack.pop_back();
+        }
+    }
+    std::reverse(order.begin(), order.end());
+}
+void compute_dominators(const Cfg& cfg, DomTree& dom) {
+    size_t n = cfg.blocks.size();
+    dom.idom.assign(n, NO_BLOCK);
+    dom.children.assign(n, std::vector<size_t>());
+    dom.pre.assign(n, 0);
+    dom.post.assign(n, 0);
+    if (n == 0) return;
+    std::vector<size_t> order;
+    reverse_postorder(cfg, order);
+    std::vector<size_t> rpo_index(n, NO_BLOCK);
+    for (size_t i = 0; i < order.size(); i++) {
+        rpo_index[order[i]] = i;
+    }
+    dom.idom[0] = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < order.size(); i++) {
+            size_t b = order[i];
+            size_t new_idom = NO_BLOCK;
+            for (size_t p : cfg.blocks[b].preds) {
+                if (dom.idom[p] == NO_BLOCK) continue;
+                if (new_idom == NO_BLOCK) {
+                    new_idom = p;
+                    continue;
+                }
+                size_t x = p;
+                size_t y = new_idom;
+                while (x != y) {
+                    while (rpo_index[x] > rpo_index[y]) x = dom.idom[x];
+                    while (rpo_index[y] > rpo_index[x]) y = dom.idom[y];
+                }
+                new_idom = x;
+            }
+            if (dom.idom[b] != new_idom) {
+                dom.idom[b] = new_idom;
+                changed = true;
+            }
+        }
+    }
+    for (size_t b = 1; b < n; b++) {
+        if (dom.idom[b] != NO_BLOCK) {
+            dom.children[dom.idom[b]].push_back(b);
+        }
+    }
+    size_t counter = 0;
+    std::vector<std::pair<size_t, size_t>> stack;
+    stack.push_back(std::make_pair(static_cast<size_t>(0), static_cast<size_t>(0)));
+    dom.pre[0] = counter++;
+    while (!stack.empty()) {
+        size_t b = stack.back().first;
+        size_t& next = stack.back().second;
+        if (next < dom.children[b].size()) {
+            size_t c = dom.children[b][next++];
+            dom.pre[c] = counter++;
+            stack.push_back(std::make_pair(c, static_cast<size_t>(0)));
+        } else {
+            dom.post[b] = counter++;
+            stack.pop_back();
+        }
+    }
+}
+bool DomTree::reachable(size_t b) const {
+    return idom[b] != NO_BLOCK;
+}
+bool DomTree::dominates(size_t a, size_t b) const {
+    if (!reachable(a) || !reachable(b)) return false;
+    return pre[a] <= pre[b] && post[b] <= post[a];
+}
+void find_loops(const Cfg& cfg, const DomTree& dom, LoopInfo& info) {
+    size_t n = cfg.blocks.size();
+    info.loops.clear();
+    info.innermost.assign(n, NO_LOOP);
+    std::vector<size_t> loop_of_header(n, NO_LOOP);
+    for (size_t b = 0; b < n; b++) {
+        for (size_t h : cfg.blocks[b].succs) {
+            if (!dom.dominates(h, b)) continue;
+            if (loop_of_header[h] == NO_LOOP) {
+                loop_of_header[h] = info.loops.size();
+                Loop loop;
+                loop.header = h;
+                loop.parent = NO_LOOP;
+                loop.depth = 1;
+                info.loops.push_back(loop);
+            }
+            info.loops[loop_of_header[h]].latches.push_back(b);
+        }
+    }
+    for (Loop& loop : info.loops) {
+        std::vector<bool> in_loop(n, false);
+        in_loop[loop.header] = true;
+        std::vector<size_t> stack(loop.latches.begin(), loop.latches.end());
+        while (!stack.empty()) {
+            size_t b = stack.back();
+            stack.pop_back();
+            if (in_loop[b]) continue;
+            in_loop[b] = true;
+            for (size_t p : cfg.blocks[b].preds) {
+                if (!in_loop[p] && dom.reachable(p)) stack.push_back(p);
+            }
+        }
+        for (size_t b = 0; b < n; b++) {
+            if (in_loop[b]) loop.blocks.push_back(b);
+        }
+    }
+    for (size_t i = 0; i < info.loops.size(); i++) {
+        size_t best = NO_LOOP;
+        for (size_t j = 0; j < info.loops.size(); j++) {
+            if (i == j || info.loops[j].blocks.size() <= info.loops[i].blocks.size()) continue;
+            if (!info.contains(j, info.loops[i].header)) continue;
+            if (best == NO_LOOP || info.loops[j].blocks.size() < info.loops[best].blocks.size()) {
+                best = j;
+            }
+        }
+        info.loops[i].parent = best;
+    }
+    for (size_t i = 0; i < info.loops.size(); i++) {
+        size_t depth = 1;
+        for (size_t p = info.loops[i].parent; p != NO_LOOP; p = info.loops[p].parent) {
+            depth++;
+        }
+        info.loops[i].depth = depth;
+    }
+    for (size_t i = 0; i < info.loops.size(); i++) {
+        for (size_t b : info.loops[i].blocks) {
+            size_t cur = info.innermost[b];
+            if (cur == NO_LOOP || info.loops[cur].depth < info.loops[i].depth) {
+                info.innermost[b] = i;
+            }
+        }
+    }
+}
+bool LoopInfo::contains(size_t loop, size_t block) const {
+    const std::vector<size_t>& blocks = loops[loop].blocks;
+    return std::binary_search(blocks.begin(), blocks.end(), block);
+}
+size_t LoopInfo::depth(size_t block) const {
+    size_t loop = innermost[block];
+    return loop == NO_LOOP ? 0 : loops[loop].depth;
+}
+static const long long COUNTED_LOOP_MAX_VALUE = 1LL << 40;
+static Binop swap_comparison(Binop op) {
+    switch (op) {
+        case Binop::Less: return Binop::Greater;
+        case Binop::Greater: return Binop::Less;
+        case Binop::LessEqual: return Binop::GreaterEqual;
+        case Binop::GreaterEqual: return Binop::LessEqual;
+        default: return op;
+    }
+}
+static bool small_literal(const Arg& arg) {
+    long long value = static_cast<long long>(arg.value);
+    return arg.type == ArgType::Literal && value < COUNTED_LOOP_MAX_VALUE && value > -COUNTED_LOOP_MAX_VALUE;
+}
+// def = iv + c or def = iv - c
+static bool match_step(const Op& op, size_t iv, long long& step) {
+    step = 0;
+    if (op.type != OpType::Binop || !is_slot(op.arg, iv) || !small_literal(op.arg2)) return false;
+    if (op.binop != Binop::Plus && op.binop != Binop::Minus) return false;
+    step = static_cast<long long>(op.arg2.value);
+    if (op.binop == Binop::Minus) step = -step;
+    return true;
+}
+bool match_counted_loop(const Func& func, const Cfg& cfg, const LoopInfo& info, size_t l, const BitSet& escaped,
+                        CountedLoop& loop) {
+    const Loop& lp = info.loops[l];
+    if (lp.blocks.size() != 2 || lp.latches.size() != 1) return false;
+    const BasicBlock& head = cfg.blocks[lp.header];
+    const BasicBlock& body = cfg.blocks[lp.latches[0]];
+    if (head.end - head.begin != 2 || head.end != body.begin) return false;
+    loop.header = head.begin;
+    loop.test = head.begin + 1;
+    loop.latch = body.end - 1;
+    const Op& label = func.body[loop.header].opcode;
+    const Op& test = func.body[loop.test].opcode;
+    const Op& latch = func.body[loop.latch].opcode;
+    if (label.type != OpType::Label || test.type != OpType::CmpJmpIfNotLabel) return false;
+    if (latch.type != OpType::JmpLabel || latch.label != label.label) return false;
+    if (test.arg.type == ArgType::AutoVar && !escaped.test(test.arg.index)) {
+        loop.iv = test.arg.index;
+        loop.cmp = test.binop;
+        loop.bound = test.arg2;
+    } else if (test.arg2.type == ArgType::AutoVar && !escaped.test(test.arg2.index)) {
+        loop.iv = test.arg2.index;
+        loop.cmp = swap_comparison(test.binop);
+        loop.bound = test.arg;
+    } else {
+        return false;
+    }
+    if (loop.bound.type == ArgType::AutoVar) {
+        if (escaped.test(loop.bound.index) || loop.bound.index == loop.iv) return false;
+    } else if (!small_literal(loop.bound)) {
+        return false;
+    }
+    size_t updates = 0;
+    size_t stepped = 0;
+    long long step = 0;
+    for (size_t i = body.begin; i < loop.latch; i++) {
+        const Op& op = func.body[i].opcode;
+        if (op.type == OpType::Asm || op.type == OpType::Label) return false;
+        size_t def;
+        if (!op_defined_slot(op, def)) continue;
+        if (loop.bound.type == ArgType::AutoVar && def == loop.bound.index) return false;
+        long long value;
+        bool steps = match_step(op, loop.iv, value);
+        if (def != loop.iv) {
+            stepped = steps ? def : 0;
+            step = value;
+            continue;
+        }
+        loop.update = i;
+        if (steps) {
+            loop.step = value;
+        } else if (op.type == OpType::AutoAssign && stepped != 0 && is_slot(op.arg, stepped)) {
+            loop.step = step;
+        } else {
+            return false;
+        }
+        updates++;
+    }
+    return updates == 1 && loop.step != 0;
+}
+bool counted_loop_start(const Func& func, const CountedLoop& loop, long long& value) {
+    size_t label = func.body[loop.header].opcode.label;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        std::vector<const size_t*> labels;
+        op_jump_labels(func.body[i].opcode, labels);
+        for (const size_t* target : labels) {
+            if (*target == label && i != loop.latch) return false;
+        }
+    }
+    for (size_t i = loop.header; i-- > 0;) {
+        const Op& op = func.body[i].opcode;
+        if (op.type == OpType::Label || !op_falls_through(op) || op_is_jump(op)) return false;
+        size_t def;
+        if (!op_defined_slot(op, def) || def != loop.iv) continue;
+        if (op.type != OpType::AutoAssign || !small_literal(op.arg)) return false;
+        value = static_cast<long long>(op.arg.value);
+        return true;
+    }
+    return false;
+}
+bool can_insert_preheader(const Func& func, const Cfg& cfg, const LoopInfo& info, size_t loop) {
+    size_t header = info.loops[loop].header;
+    if (func.body[cfg.blocks[header].begin].opcode.type != OpType::Label) return false;
+    if (header > 0 && info.contains(loop, header - 1)) {
+        const Op& last = func.body[cfg.blocks[header - 1].end - 1].opcode;
+        if (op_falls_through(last)) return false;
+    }
+    return true;
+}
+std::vector<OpWithLocation> open_preheader(Func& func, const Cfg& cfg, const LoopInfo& info,
+                                           size_t loop) {
+    const BasicBlock& header = cfg.blocks[info.loops[loop].header];
+    size_t label = func.body[header.begin].opcode.label;
+    size_t preheader_label = max_label_index(func);
+    std::vector<OpWithLocation> ops;
+    std::vector<size_t*> labels;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        if (info.contains(loop, cfg.block_of_op[i])) continue;
+        op_jump_labels(func.body[i].opcode, labels);
+        for (size_t* target : labels) {
+            if (*target != label) continue;
+            *target = preheader_label;
+            if (ops.empty()) {
+                OpWithLocation owl;
+                owl.opcode.type = OpType::Label;
+                owl.opcode.label = preheader_label;
+                owl.loc = func.body[header.begin].loc;
+                ops.push_back(owl);
+            }
+        }
+    }
+    return ops;
+}
+unsigned long long estimated_op_cost(const Func& func) {
+    Cfg cfg;
+    build_cfg(func, cfg);
+    if (cfg.blocks.empty()) return 0;
+    DomTree dom;
+    compute_dominators(cfg, dom);
+    LoopInfo loops;
+    find_loops(cfg, dom, loops);
+    unsigned long long cost = 0;
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        unsigned long long weight = 1;
+        for (size_t d = loops.depth(b); d > 0 && weight < 1000000; d--) {
+            weight *= 10;
+        }
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+            if (func.body[i].opcode.type != OpType::Label) cost += weight;
+        }
+    }
+    return cost;
+}
+bool profile_block_counts(const Func& func, const Cfg& cfg, std::vector<unsigned long long>& counts) {
+    if (!func.profiled || cfg.blocks.empty()) return false;
+    counts.assign(cfg.blocks.size(), NO_COUNT);
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end && counts[b] == NO_COUNT; i++) {
+            counts[b] = func.body[i].count;
+        }
+    }
+    std::vector<size_t> order;
+    reverse_postorder(cfg, order);
+    for (size_t b : order) {
+        if (counts[b] != NO_COUNT) continue;
+        counts[b] = 0;
+        for (size_t p : cfg.blocks[b].preds) {
+            if (counts[p] != NO_COUNT) counts[b] += counts[p] / cfg.blocks[p].succs.size();
+        }
+    }
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        if (counts[b] == NO_COUNT) counts[b] = 0;
+    }
+    return counts[0] > 0;
+}
+bool op_defined_slot(const Op& op, size_t& slot) {
+    switch (op.type) {
+        case OpType::UnaryNot:
+        case OpType::Negate:
+        case OpType::Funcall:
+        case OpType::Intrinsic:
+            slot = op.result;
+            return true;
+        case OpType::Binop:
+        case OpType::AutoAssign:
+        case OpType::Select:
+            slot = op.index;
+            return true;
+        default:
+            return false;
+    }
+}
+void set_op_defined_slot(Op& op, size_t slot) {
+    switch (op.type) {
+        case OpType::UnaryNot:
+        case OpType::Negate:
+        case OpType::Funcall:
+        case OpType::Intrinsic:
+            op.result = slot;
+            break;
+        case OpType::Binop:
+        case OpType::AutoAssign:
+        case OpType::Select:
+            op.index = slot;
+            break;
+        default:
+            break;
+    }
+}
+template <typename OpT, typename ArgT>
+static void collect_op_args(OpT& op, std::vector<ArgT*>& args) {
+    args.clear();
+    switch (op.type) {
+        case OpType::UnaryNot:
+        case OpType::Negate:
+        case OpType::AutoAssign:
+        case OpType::ExternalAssign:
+        case OpType::Store:
+        case OpType::JmpIfNotLabel:
+        case OpType::JmpTable:
+            args.push_back(&op.arg);
+            break;
+        case OpType::Binop:
+        case OpType::CmpJmpIfNotLabel:
+            args.push_back(&op.arg);
+            args.push_back(&op.arg2);
+            break;
+        case OpType::Select:
+            args.push_back(&op.arg);
+            args.push_back(&op.arg2);
+            args.push_back(&op.arg3);
+            break;
+        case OpType::Funcall:
+            args.push_back(&op.arg);
+            for (size_t i = 0; i < op.funcall_args.size(); i++) {
+                args.push_back(&op.funcall_args[i]);
+            }
+            break;
+        case OpType::Intrinsic:
+            for (size_t i = 0; i < op.funcall_args.size(); i++) {
+                args.push_back(&op.funcall_args[i]);
+            }
+            break;
+        case OpType::Return:
+            if (op.has_return_arg) {
+                args.push_back(&op.arg);
+            }
+            break;
+        default:
+            break;
+    }
+}
+void op_args(Op& op, std::vector<Arg*>& args) {
+    collect_op_args(op, args);
+}
+void op_args(const Op& op, std::vector<const Arg*>& args) {
+    collect_op_args(op, args);
+}
+void op_used_slots(const Op& op, std::vector<size_t>& slots) {
+    slots.clear();
+    std::vector<const Arg*> args;
+    op_args(op, args);
+    for (const Arg* arg : args) {
+        if (arg->type == ArgType::AutoVar || arg->type == ArgType::Deref) {
+            slots.push_back(arg->index);
+        }
+    }
+    if (op.type == OpType::Store) {
+        slots.push_back(op.index);
+    }
+}
+void remap_op_slots(Op& op, const std::vector<size_t>& map) {
+    std::vector<Arg*> args;
+    op_args(op, args);
+    for (Arg* arg : args) {
+        if (arg->type == ArgType::AutoVar || arg->type == ArgType::Deref ||
+            arg->type == ArgType::RefAutoVar) {
+            arg->index = map[arg->index];
+        }
+    }
+    size_t def;
+    if (op_defined_slot(op, def)) {
+        set_op_defined_slot(op, map[def]);
+    }
+    if (op.type == OpType::Store) {
+        op.index = map[op.index];
+    }
+}
+bool intrinsic_reads_memory(const Op& op) {
+    return op.type == OpType::Intrinsic && (op.intrinsic == Intrinsic::Char || op.intrinsic == Intrinsic::Memcpy);
+}
+bool intrinsic_writes_memory(const Op& op) {
+    return op.type == OpType::Intrinsic && (op.intrinsic == Intrinsic::Lchar || op.intrinsic == Intrinsic::Memcpy ||
+                                            op.intrinsic == Intrinsic::Memset);
+}
+bool asm_is_barrier(const Op& op) {
+    return op.type == OpType::Asm && !op.asm_declared;
+}
+bool has_asm_barrier(const Func& func) {
+    for (const OpWithLocation& owl : func.body) {
+        if (asm_is_barrier(owl.opcode)) return true;
+    }
+    return false;
+}
+bool asm_clobbers_memory(const Op& op) {
+    if (op.type != OpType::Asm) return false;
+    if (!op.asm_declared) return true;
+    for (const std::string& clobber : op.asm_clobbers) {
+        if (clobber == "memory") return true;
+    }
+    return false;
+}
+bool op_writes_memory(const Op& op) {
+    return op.type == OpType::Store || op.type == OpType::Funcall || op.type == OpType::ExternalAssign ||
+           asm_clobbers_memory(op) || intrinsic_writes_memory(op);
+}
+void solve_dataflow(const Cfg& cfg, const DataflowProblem& problem, DataflowResult& result) {
+    size_t n = cfg.blocks.size();
+    bool forward = problem.direction == DataflowDirection::Forward;
+    bool intersect = problem.meet == DataflowMeet::Intersection;
+    BitSet top(problem.bits);
+    if (intersect) {
+        for (size_t i = 0; i < problem.bits; i++) {
+            top.set(i);
+        }
+    }
+    result.in.assign(n, top);
+    result.out.assign(n, top);
+    std::vector<size_t> order;
+    reverse_postorder(cfg, order);
+    std::vector<bool> reachable(n, false);
+    for (size_t b : order) {
+        reachable[b] = true;
+    }
+    for (size_t b = 0; b < n; b++) {
+        if (!reachable[b]) {
+            order.push_back(b);
+        }
+    }
+    if (!forward) {
+        std::reverse(order.begin(), order.end());
+    }
+    BitSet meet(problem.bits);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b : order) {
+            const BasicBlock& block = cfg.blocks[b];
+            const std::vector<size_t>& edges = forward ? block.preds : block.succs;
+            std::vector<BitSet>& before = forward ? result.in : result.out;
+            std::vector<BitSet>& after = forward ? result.out : result.in;
+            bool boundary = forward ? b == 0 : edges.empty();
+            if (boundary) {
+                meet.assign(problem.boundary);
+            } else {
+                meet.assign(top);
+            }
+            for (size_t e : edges) {
+                if (intersect) {
+                    meet.intersect_with(after[e]);
+                } else {
+                    meet.union_with(after[e]);
+                }
+            }
+            if (intersect && edges.empty() && !boundary) {
+                meet.clear();
+            }
+            before[b].assign(meet);
+            meet.subtract(problem.kill[b]);
+            meet.union_with(problem.gen[b]);
+            changed |= after[b].assign(meet);
+        }
+    }
+}
+void classify_slots(const Func& func, std::vector<SlotClass>& classes) {
+    classes.assign(func.auto_vars_count + 1, SlotClass::Promotable);
+    std::vector<const Arg*> args;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        op_args(func.body[i].opcode, args);
+        for (const Arg* arg : args) {
+            if (arg->type == ArgType::RefAutoVar) classes[arg->index] = SlotClass::AddressTaken;
+        }
+    }
+    for (const AutoVec& vec : func.auto_vecs) {
+        for (size_t i = 0; i < vec.size; i++) {
+            classes[vec.first + i] = SlotClass::AutoVector;
+        }
+    }
+}
+void escaped_slots(const Func& func, BitSet& escaped) {
+    std::vector<SlotClass> classes;
+    classify_slots(func, classes);
+    escaped.resize(classes.size());
+    for (size_t s = 0; s < classes.size(); s++) {
+        if (classes[s] != SlotClass::Promotable) escaped.set(s);
+    }
+}
+void single_def_slots(const Func& func, const Cfg& cfg, const DomTree& dom,
+                      const BitSet& escaped, BitSet& result) {
+    size_t slots = func.auto_vars_count + 1;
+    const size_t NONE = static_cast<size_t>(-1);
+    std::vector<size_t> def_op(slots, NONE);
+    result.resize(slots);
+    for (size_t s = 1; s < slots; s++) {
+        if (!escaped.test(s)) result.set(s);
+    }
+    for (size_t i = 0; i < func.body.size(); i++) {
+        size_t def;
+        if (!op_defined_slot(func.body[i].opcode, def)) continue;
+        if (def_op[def] != NONE || !dom.reachable(cfg.block_of_op[i])) {
+            result.reset(def);
+        }
+        def_op[def] = i;
+    }
+    for (size_t s = 1; s <= func.params_count && s < slots; s++) {
+        if (def_op[s] != NONE) result.reset(s);
+    }
+    std::vector<size_t> uses;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        op_used_slots(func.body[i].opcode, uses);
+        for (size_t u : uses) {
+            if (!result.test(u) || def_op[u] == NONE) continue;
+            size_t db = cfg.block_of_op[def_op[u]];
+            size_t ub = cfg.block_of_op[i];
+            bool ok = db == ub ? def_op[u] < i : dom.dominates(db, ub);
+            if (!ok) result.reset(u);
+        }
+    }
+}
+static AliasResult compare_offsets(long long a, long long b) {
+    if (a == b) return AliasResult::Must;
+    if (a - b >= 8 || b - a >= 8) return AliasResult::No;
+    return AliasResult::May;
+}
+AliasResult alias_locations(const MemoryLocation& a, const MemoryLocation& b) {
+    if (a.base == MemoryBase::Pointer || b.base == MemoryBase::Pointer) {
+        if (a.base == b.base && a.slot == b.slot && a.exact && b.exact) return compare_offsets(a.offset, b.offset);
+        return AliasResult::May;
+    }
+    if ((a.base == MemoryBase::Slot) != (b.base == MemoryBase::Slot)) return AliasResult::No;
+    if (!a.exact || !b.exact) return AliasResult::May;
+    if (a.base != b.base || a.slot != b.slot || a.name != b.name) return AliasResult::No;
+    return compare_offsets(a.offset, b.offset);
+}
+bool location_uses_slot(const MemoryLocation& loc, size_t slot) {
+    return loc.base == MemoryBase::Pointer && loc.slot == slot;
+}
+MemoryModel::MemoryModel(const Func& func, const BitSet& e, const BitSet& s) : escaped(e), ssa(s) {
+    size_t slots = func.auto_vars_count + 1;
+    object_words.assign(slots, 1);
+    for (const AutoVec& vec : func.auto_vecs) {
+        for (size_t i = 0; i < vec.size; i++) object_words[vec.first + i] = 0;
+        object_words[vec.first + vec.size - 1] = vec.size;
+    }
+    for (size_t slot = 0; slot < slots; slot++) points_to.push_back(unknown(slot));
+}
+// Escaped slots may change behind any store, so their value is no anchor
+MemoryLocation MemoryModel::unknown(size_t slot) const {
+    MemoryLocation loc;
+    loc.base = MemoryBase::Pointer;
+    loc.slot = slot;
+    loc.offset = 0;
+    loc.exact = !escaped.test(slot);
+    return loc;
+}
+MemoryLocation MemoryModel::slot_object(size_t slot) const {
+    MemoryLocation loc;
+    loc.base = MemoryBase::Slot;
+    loc.slot = slot;
+    loc.offset = 0;
+    loc.exact = object_words[slot] > 0;
+    return loc;
+}
+MemoryLocation MemoryModel::moved(MemoryLocation loc, long long bytes) const {
+    loc.offset += bytes;
+    switch (loc.base) {
+        case MemoryBase::Slot:
+            loc.exact = loc.exact && loc.offset >= 0 &&
+                        loc.offset < 8 * static_cast<long long>(object_words[loc.slot]);
+            break;
+        case MemoryBase::Global:
+            loc.exact = loc.exact && loc.offset == 0;
+            break;
+        case MemoryBase::Data:
+            loc.exact = loc.exact && loc.offset >= 0;
+            break;
+        case MemoryBase::Pointer:
+            break;
+    }
+    return loc;
+}
+MemoryLocation MemoryModel::value_of(const Arg& arg, size_t def) const {
+    MemoryLocation loc = unknown(def);
+    switch (arg.type) {
+        case ArgType::AutoVar:
+            if (!escaped.test(arg.index)) loc = points_to[arg.index];
+            break;
+        case ArgType::RefAutoVar:
+            loc = slot_object(arg.index);
+            break;
+        case ArgType::RefExternal:
+            loc.base = MemoryBase::Global;
+            loc.slot = 0;
+            loc.name = arg.name;
+            loc.exact = true;
+            break;
+        case ArgType::DataOffset:
+            loc.base = MemoryBase::Data;
+            loc.slot = 0;
+            loc.offset = static_cast<long long>(arg.offset);
+            loc.exact = true;
+            break;
+        default:
+            break;
+    }
+    return loc;
+}
+void MemoryModel::enter_join() {
+    for (size_t slot = 1; slot < points_to.size(); slot++) {
+        const MemoryLocation& loc = points_to[slot];
+        if (!ssa.test(slot) || (loc.base == MemoryBase::Pointer && !ssa.test(loc.slot))) {
+            points_to[slot] = unknown(slot);
+        }
+    }
+}
+bool MemoryModel::read_location(const Arg& arg, MemoryLocation& loc) const {
+    switch (arg.type) {
+        case ArgType::Deref:
+            loc = points_to[arg.index];
+            return true;
+        case ArgType::External:
+            loc = value_of(Arg::make_ref_external(arg.name), 0);
+            return true;
+        case ArgType::AutoVar:
+            if (!escaped.test(arg.index)) return false;
+            loc = slot_object(arg.index);
+            return true;
+        default:
+            return false;
+    }
+}
+bool MemoryModel::write_location(const Op& op, MemoryLocation& loc) const {
+    if (op.type == OpType::Store) {
+        loc = points_to[op.index];
+        return true;
+    }
+    if (op.type == OpType::ExternalAssign) {
+        loc = value_of(Arg::make_ref_external(op.name), 0);
+        return true;
+    }
+    size_t def;
+    if (op.type == OpType::Asm || !op_defined_slot(op, def) || !escaped.test(def)) return false;
+    loc = slot_object(def);
+    return true;
+}
+bool MemoryModel::clobbers_memory(const Op& op) const {
+    return op.type == OpType::Funcall || asm_clobbers_memory(op) || intrinsic_writes_memory(op);
+}
+void MemoryModel::step(const Op& op) {
+    size_t def;
+    if (!op_defined_slot(op, def)) return;
+    MemoryLocation loc = unknown(def);
+    if (op.type == OpType::AutoAssign) {
+        loc = value_of(op.arg, def);
+    } else if (op.type == OpType::Binop && (op.binop == Binop::Plus || op.binop == Binop::Minus)) {
+        bool minus = op.binop == Binop::Minus;
+        if (op.arg2.type == ArgType::Literal) {
+            long long bytes = static_cast<long long>(op.arg2.value);
+            loc = moved(value_of(op.arg, def), minus ? -bytes : bytes);
+        } else if (op.arg.type == ArgType::Literal && !minus) {
+            loc = moved(value_of(op.arg2, def), static_cast<long long>(op.arg.value));
+        } else if (!minus) {
+            MemoryLocation lhs = value_of(op.arg, def);
+            MemoryLocation rhs = value_of(op.arg2, def);
+            if (lhs.base != MemoryBase::Pointer) {
+                loc = lhs;
+                loc.exact = false;
+            } else if (rhs.base != MemoryBase::Pointer) {
+                loc = rhs;
+                loc.exact = false;
+            }
+        }
+    }
+    for (size_t slot = 1; slot < points_to.size(); slot++) {
+        if (location_uses_slot(points_to[slot], def)) points_to[slot] = unknown(slot);
+    }
+    if (location_uses_slot(loc, def) || escaped.test(def)) loc = unknown(def);
+    points_to[def] = loc;
+}
+void compute_liveness(const Func& func, const Cfg& cfg, Liveness& live) {
+    size_t slots = func.auto_vars_count + 1;
+    DataflowProblem problem;
+    problem.direction = DataflowDirection::Backward;
+    problem.meet = DataflowMeet::Union;
+    problem.bits = slots;
+    problem.boundary.resize(slots);
+    problem.gen.assign(cfg.blocks.size(), BitSet(slots));
+    problem.kill.assign(cfg.blocks.size(), BitSet(slots));
+    std::vector<size_t> uses;
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        const BasicBlock& block = cfg.blocks[b];
+        for (size_t i = block.end; i-- > block.begin;) {
+            const Op& op = func.body[i].opcode;
+            size_t def;
+            if (op_defined_slot(op, def)) {
+                problem.gen[b].reset(def);
+                problem.kill[b].set(def);
+            }
+            op_used_slots(op, uses);
+            for (size_t u : uses) {
+                problem.gen[b].set(u);
+            }
+        }
+    }
+    DataflowResult result;
+    solve_dataflow(cfg, problem, result);
+    live.live_in = result.in;
+    live.live_out = result.out;
+}
+void compute_live_intervals(const Func& func, const Cfg& cfg, const Liveness& live,
+                            std::vector<LiveInterval>& intervals) {
+    size_t slots = func.auto_vars_count + 1;
+    const size_t NONE = static_cast<size_t>(-1);
+    std::vector<size_t> start(slots, NONE);
+    std::vector<size_t> end(slots, 0);
+    auto extend = [&](size_t slot, size_t pos) {
+        if (start[slot] == NONE || pos < start[slot]) start[slot] = pos;
+        if (pos > end[slot]) end[slot] = pos;
+    };
+    std::vector<size_t> uses;
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        const BasicBlock& block = cfg.blocks[b];
+        for (size_t s = 0; s < slots; s++) {
+            if (live.live_in[b].test(s)) extend(s, 2 * block.begin);
+            if (live.live_out[b].test(s)) extend(s, 2 * block.end - 1);
+        }
+        for (size_t i = block.begin; i < block.end; i++) {
+            const Op& op = func.body[i].opcode;
+            op_used_slots(op, uses);
+            for (size_t u : uses) {
+                extend(u, 2 * i);
+            }
+            size_t def;
+            if (op_defined_slot(op, def)) {
+                extend(def, 2 * i + 1);
+            }
+        }
+    }
+    intervals.clear();
+    for (size_t s = 1; s < slots; s++) {
+        if (start[s] == NONE) continue;
+        LiveInterval interval;
+        interval.slot = s;
+        interval.start = start[s];
+        interval.end = end[s];
+        intervals.push_back(interval);
+    }
+    std::sort(intervals.begin(), intervals.end(), [](const LiveInterval& a, const LiveInterval& b) {
+        return a.start < b.start || (a.start == b.start && a.slot < b.slot);
+    });
+}
@@ -0,0 +1,306 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "compiler.h"
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Fixed-size bit vector; set operations work a 64-bit word at a time
+class BitSet {
+public:
+    std::vector<uint64_t> words;
+    size_t bits;
+
+    BitSet();
+    explicit BitSet(size_t n);
+
+    void resize(size_t n);
+    void clear();
+    void set(size_t i);
+    void reset(size_t i);
+    bool test(size_t i) const;
+    size_t count() const;
+    bool empty() const;
+
+    // Each returns true if this set changed
+    bool assign(const BitSet& other);
+    bool union_with(const BitSet& other);
+    bool intersect_with(const BitSet& other);
+    bool subtract(const BitSet& other);
+
+    bool operator==(const BitSet& other) const;
+    bool operator!=(const BitSet& other) const;
+};
+
+// Maximal straight-line run of ops, body[begin, end)
+struct BasicBlock {
+    size_t begin;
+    size_t end;
+    std::vector<size_t> succs;
+    std::vector<size_t> preds;
+};
+
+// Control flow graph over a function body; block 0 is the entry
+struct Cfg {
+    std::vector<BasicBlock> blocks;
+    std::vector<size_t> block_of_op;
+    std::vector<size_t> block_of_label;  // NO_BLOCK for labels not defined
+};
+
+static const size_t NO_BLOCK = static_cast<size_t>(-1);
+
+void build_cfg(const Func& func, Cfg& cfg);
+void reverse_postorder(const Cfg& cfg, std::vector<size_t>& order);
+
+// Dominator tree (Cooper, Harvey and Kennedy). idom[0] == 0 and
+// unreachable blocks have idom NO_BLOCK
+struct DomTree {
+    std::vector<size_t> idom;
+    std::vector<std::vector<size_t>> children;
+    std::vector<size_t> pre;
+    std::vector<size_t> post;
+
+    bool dominates(size_t a, size_t b) const;
+    bool reachable(size_t b) const;
+};
+
+void compute_dominators(const Cfg& cfg, DomTree& dom);
+
+// Natural loop, the union of all back edges into one header
+struct Loop {
+    size_t header;
+    std::vector<size_t> blocks;   // Sorted, includes the header
+    std::vector<size_t> latches;
+    size_t parent;                // Enclosing loop or NO_LOOP
+    size_t depth;                 // 1 for outermost loops
+};
+
+struct LoopInfo {
+    std::vector<Loop> loops;
+    std::vector<size_t> innermost;  // Innermost loop of each block or NO_LOOP
+
+    bool contains(size_t loop, size_t block) const;
+    size_t depth(size_t block) const;
+};
+
+static const size_t NO_LOOP = static_cast<size_t>(-1);
+
+void find_loops(const Cfg& cfg, const DomTree& dom, LoopInfo& info);
+
+// Top-tested loop of two blocks: `label H; jmp_if_not E, iv cmp bound`
+// followed by a straight-line body ending in `jmp H`, where the body
+// steps iv by a constant exactly once, directly or through a temporary
+struct CountedLoop {
+    size_t header;  // Index of the header label op
+    size_t test;
+    size_t latch;   // Index of the closing jump
+    size_t update;  // Index of the op assigning iv
+    size_t iv;
+    long long step;
+    Binop cmp;      // With iv on the left
+    Arg bound;
+};
+
+bool match_counted_loop(const Func& func, const Cfg& cfg, const LoopInfo& info, size_t loop, const BitSet& escaped,
+                        CountedLoop& counted);
+
+// Literal value of iv on entry, when the header is only reached by falling
+// into it and by the latch
+bool counted_loop_start(const Func& func, const CountedLoop& loop, long long& value);
+
+// Ops run once before a loop when placed right in front of its header
+// label, as long as no block of the loop falls through into that spot
+bool can_insert_preheader(const Func& func, const Cfg& cfg, const LoopInfo& info, size_t loop);
+
+// Moves jumps from outside the loop onto a fresh label and returns the ops
+// (that label, or nothing) that must open the preheader
+std::vector<OpWithLocation> open_preheader(Func& func, const Cfg& cfg, const LoopInfo& info,
+                                           size_t loop);
+
+// Static estimate of executed ops, weighting each op by 10 per loop level
+unsigned long long estimated_op_cost(const Func& func);
+
+// Profiled executions of each block: the count of its first op that has
+// one, or for blocks added since the profile was read, a share of their
+// predecessors' counts. False without a profile or if the function never ran
+bool profile_block_counts(const Func& func, const Cfg& cfg, std::vector<unsigned long long>& counts);
+
+// Ops of func other than labels
+size_t body_size(const Func& func);
+// The function a call op calls directly, by its index in the program
+bool direct_callee(const Op& op, const std::map<std::string, size_t>& index, size_t& callee);
+// Appends f and the functions it calls, callees before their callers
+void callees_first(const Compiler& c, const std::map<std::string, size_t>& index, size_t f,
+                   std::vector<bool>& visited, std::vector<size_t>& order);
+// Appends op at loc, or at the location and profile count of from
+void push_op(std::vector<OpWithLocation>& body, const Op& op, const Loc& loc);
+void push_op(std::vector<OpWithLocation>& body, const Op& op, const OpWithLocation& from);
+
+// Op operand helpers
+bool op_defined_slot(const Op& op, size_t& slot);
+void set_op_defined_slot(Op& op, size_t slot);
+void op_used_slots(const Op& op, std::vector<size_t>& slots);
+void op_args(Op& op, std::vector<Arg*>& args);
+void op_args(const Op& op, std::vector<const Arg*>& args);
+void remap_op_slots(Op& op, const std::vector<size_t>& map);
+bool op_is_jump(const Op& op);
+bool op_falls_through(const Op& op);
+// Labels a jump may transfer control to
+void op_jump_labels(Op& op, std::vector<size_t*>& labels);
+void op_jump_labels(const Op& op, std::vector<const size_t*>& labels);
+size_t count_slot_uses(const Func& func, size_t slot);
+// Value of a binop on two literals, false for a division by zero or one
+// that overflows
+bool fold_binop(Binop op, unsigned long long a, unsigned long long b, unsigned long long& out);
+// Ops whose only effect is assigning their slot
+bool is_pure_op(const Op& op);
+bool is_slot(const Arg& arg, size_t slot);
+// Args whose value is the same everywhere in the function
+bool is_constant_arg(const Arg& arg);
+// Args naming the same value or memory word
+bool same_arg(const Arg& a, const Arg& b);
+size_t max_label_index(const Func& func);
+// Intrinsic ops that access bytes through their pointer arguments
+bool intrinsic_reads_memory(const Op& op);
+bool intrinsic_writes_memory(const Op& op);
+// Inline assembly without a clobber list may touch the frame, any register
+// and any memory, so passes leave its function alone. With a list it only
+// changes the registers named and touches memory only if "memory" is named
+bool asm_is_barrier(const Op& op);
+bool has_asm_barrier(const Func& func);
+bool asm_clobbers_memory(const Op& op);
+// Stores, calls, and the intrinsics and inline assembly that write memory
+bool op_writes_memory(const Op& op);
+
+// Generic gen/kill bit-vector dataflow over a CFG
+enum class DataflowDirection {
+    Forward,
+    Backward
+};
+
+enum class DataflowMeet {
+    Union,
+    Intersection
+};
+
+struct DataflowProblem {
+    DataflowDirection direction;
+    DataflowMeet meet;
+    size_t bits;
+    std::vector<BitSet> gen;
+    std::vector<BitSet> kill;
+    BitSet boundary;  // Value at entry (forward) or at exits (backward)
+};
+
+struct DataflowResult {
+    std::vector<BitSet> in;
+    std::vector<BitSet> out;
+};
+
+void solve_dataflow(const Cfg& cfg, const DataflowProblem& problem, DataflowResult& result);
+
+// Where an auto slot has to live. Promotable slots are never reached
+// through a pointer, so passes may rename them and backends may keep them
+// in registers
+enum class SlotClass {
+    Promotable,
+    AddressTaken,  // Target of `&x`
+    AutoVector     // Storage of `auto v N`
+};
+
+void classify_slots(const Func& func, std::vector<SlotClass>& classes);
+
+// Slots that may be reached through a pointer: `&x` targets and auto vector
+// storage. These must keep an exclusive stack slot for the whole function
+void escaped_slots(const Func& func, BitSet& escaped);
+
+// Non-escaped slots whose definitions (if any) are a single op that
+// dominates every read, so each read sees the value of that one op
+void single_def_slots(const Func& func, const Cfg& cfg, const DomTree& dom,
+                      const BitSet& escaped, BitSet& result);
+
+// Memory word an access reaches: inside an escaped auto (the whole vector
+// for the slot an auto vector's name points at), a global's own word, the
+// string literal data, or at an offset from the value a slot holds.
+// Slots that do not escape are not memory
+enum class MemoryBase {
+    Slot,
+    Global,
+    Data,
+    Pointer
+};
+
+struct MemoryLocation {
+    MemoryBase base;
+    size_t slot;        // Slot and Pointer bases
+    std::string name;   // Global base
+    long long offset;   // Bytes
+    bool exact;         // Offset known and, for the first three, inside the object
+};
+
+enum class AliasResult {
+    No,
+    May,
+    Must
+};
+
+// Objects are disjoint, and offsets from them stay within the frame, or
+// within globals and data. Word accesses at known offsets from one object
+// or one pointer value compare exactly. Other pointers may reach anything
+AliasResult alias_locations(const MemoryLocation& a, const MemoryLocation& b);
+bool location_uses_slot(const MemoryLocation& loc, size_t slot);
+
+// Where slots point at the current op of a forward walk. A slot assigned
+// once keeps its target wherever its definition dominates; other slots
+// keep theirs along the straight-line path after the assignment
+class MemoryModel {
+public:
+    std::vector<MemoryLocation> points_to;
+
+    MemoryModel(const Func& func, const BitSet& escaped, const BitSet& ssa);
+    // Forgets what the value of slots assigned more than once points to,
+    // at a block entered from several paths
+    void enter_join();
+    // The word arg reads, false if arg is not a memory read
+    bool read_location(const Arg& arg, MemoryLocation& loc) const;
+    // The word op writes, false if it writes no single word
+    bool write_location(const Op& op, MemoryLocation& loc) const;
+    // Calls and inline assembly that clobbers memory may read and write any
+    // memory, and the storing intrinsics may write any byte
+    bool clobbers_memory(const Op& op) const;
+    // Moves past op, updating the slot it assigns
+    void step(const Op& op);
+
+private:
+    const BitSet& escaped;
+    const BitSet& ssa;
+    std::vector<size_t> object_words;  // Words of the object a slot starts, 0 inside a vector
+
+    MemoryLocation unknown(size_t slot) const;
+    MemoryLocation slot_object(size_t slot) const;
+    MemoryLocation value_of(const Arg& arg, size_t def) const;
+    MemoryLocation moved(MemoryLocation loc, long long bytes) const;
+};
+
+// Backward liveness of auto slots
+struct Liveness {
+    std::vector<BitSet> live_in;
+    std::vector<BitSet> live_out;
+};
+
+void compute_liveness(const Func& func, const Cfg& cfg, Liveness& live);
+
+// Hull of the program points at which a slot is live. Ops sit at even
+// positions 2*i (reads) and 2*i+1 (writes)
+struct LiveInterval {
+    size_t slot;
+    size_t start;
+    size_t end;
+};
+
+void compute_live_intervals(const Func& func, const Cfg& cfg, const Liveness& live,
+                            std::vector<LiveInterval>& intervals);
+
+#endif // ANALYSIS_H
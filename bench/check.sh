@@ -0,0 +1,40 @@
+#!/bin/sh
+# Builds every program here and hello.b for both x86_64 Linux targets, with
+# and without -O, and compares each run against the -O0 elf executable.
+# Usage: bench/check.sh [path/to/bong]   (FASM=... picks the assembler)
+dir=$(cd "$(dirname "$0")" && pwd)
+bong=${1:-./bong}
+fasm=${FASM:-$dir/fasm_standin.py}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+fail=0
+
+run() {
+    "$1" > "$1.out"
+    echo "exit $?" >> "$1.out"
+}
+
+for src in "$dir"/*.b "$dir"/../hello.b; do
+    name=$(basename "$src" .b)
+    "$bong" -t elf-x86_64-linux "$src" -o "$tmp/$name.ref" > /dev/null || { echo "FAIL $name: -O0 elf build"; fail=1; continue; }
+    run "$tmp/$name.ref"
+    for target in elf fasm; do
+        for opt in "" -O; do
+            exe=$tmp/$name.$target$opt
+            if [ $target = fasm ]; then
+                set -- -t fasm-x86_64-linux -fasm "$fasm"
+            else
+                set -- -t elf-x86_64-linux
+            fi
+            "$bong" $opt "$@" "$src" -o "$exe" > /dev/null || { echo "FAIL $name: $target $opt build"; fail=1; continue; }
+            run "$exe"
+            if cmp -s "$tmp/$name.ref.out" "$exe.out"; then
+                echo "ok   $name: $target $opt"
+            else
+                echo "FAIL $name: $target $opt output differs from -O0 elf"
+                fail=1
+            fi
+        done
+    done
+done
+exit $fail
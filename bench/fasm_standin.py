@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+# Stand-in for fasm on machines without it: translates the subset bong emits
+# to GNU as and assembles it. Usage: fasm_standin.py <input.asm> <output.o>
+import sys, re, subprocess
+src, obj = sys.argv[1], sys.argv[2]
+out = ['.intel_syntax noprefix']
+scope = ''
+regs = set('rax rcx rdx rbx rsp rbp rsi rdi r8 r9 r10 r11 r12 r13 r14 r15'.split())
+def mem(m):
+    inner = m.group(2)
+    base = re.split(r'[+-]', inner)[0]
+    if base not in regs:
+        inner = 'rip + ' + inner
+    return (m.group(1) or '') + '[' + inner + ']'
+for line in open(src):
+    line = line.rstrip('\n')
+    s = line.strip()
+    if not s or s.startswith(';'): continue
+    if s.startswith('format'): continue
+    m = re.match(r"public (\S+) as '(.*)'", s)
+    if m:
+        out.append('.globl %s' % m.group(2)); out.append('.set %s, %s' % (m.group(2), m.group(1))); continue
+    m = re.match(r"extrn '(.*)' as (\S+)", s)
+    if m:
+        out.append('.set %s, %s' % (m.group(2), m.group(1))); continue
+    m = re.match(r"section '([^']*)'(.*)", s)
+    if m:
+        name = m.group(1); flags = m.group(2)
+        if 'executable' in flags: out.append('.section %s,"ax",@progbits' % name)
+        elif name == '.note.GNU-stack': out.append('.section .note.GNU-stack,"",@progbits')
+        elif 'writeable' in flags: out.append('.section %s,"aw",@progbits' % name); out.append('.balign 8')
+        else: out.append('.section %s,"a",@progbits' % name)
+        continue
+    m = re.match(r'dq (\d+) dup 0$', s)
+    if m:
+        out.append('.zero %d' % (8 * int(m.group(1)))); continue
+    m = re.match(r'rq (\d+)$', s)
+    if m:
+        out.append('.zero %d' % (8 * int(m.group(1)))); continue
+    if s.startswith('dq '):
+        out.append('.quad ' + re.sub(r'\b(\w+)\.L(\d+)\b', lambda m: '.L' + m.group(1) + '_' + m.group(2), s[3:])); continue
+    if s.startswith('db '):
+        out.append('.byte ' + s[3:]); continue
+    if s.startswith('align '):
+        out.append('.balign ' + s[6:]); continue
+    if s.endswith(':') and '.' not in s:
+        scope = s[:-1]
+    s = re.sub(r'\b(\w+)\.L(\d+)\b', lambda m: '.L' + m.group(1) + '_' + m.group(2), s)
+    s = re.sub(r'(?<![\w.])\.(L\d+)', lambda m: '.L' + scope + '_' + m.group(1)[1:], s)
+    if s.endswith(':'):
+        out.append(s); continue
+    s = re.sub(r'(qword |byte |dword )?\[([^\]]*)\]', lambda m: mem(m).replace('qword [', 'qword ptr [').replace('byte [', 'byte ptr [').replace('dword [', 'dword ptr ['), s)
+    out.append('    ' + s)
+asm = '\n'.join(out) + '\n'
+open(obj + '.s', 'w').write(asm)
+r = subprocess.run(['as', '--64', '-o', obj, obj + '.s'])
+sys.exit(r.returncode)
@@ -0,0 +1,55 @@
+// Loop-heavy kernels for comparing optimizer output: compile with
+// `-O -stats` and compare the estimated cost, or time the native build.
+table[4096];
+
+fill(n, scale, bias) {
+    auto i;
+    i = 0;
+    while (i < n) {
+        table[i] = i * (scale * 3 + bias) + (scale << 2);
+        i++;
+    }
+}
+
+checksum(n, seed) {
+    auto i, j, s, t;
+    s = seed;
+    i = 0;
+    while (i < n) {
+        j = 0;
+        while (j < 64) {
+            t = (seed * 31 + n) & 1023;
+            s = s + table[(i + j + t) % n] * (n - seed);
+            j++;
+        }
+        i += 64;
+    }
+    return (s);
+}
+
+scan(n, key) {
+    auto i, hits, lo, hi;
+    i = 0;
+    hits = 0;
+    while (i < n) {
+        lo = key - n / 4;
+        hi = key + n / 4;
+        if (table[i] > lo & table[i] < hi) hits++;
+        i++;
+    }
+    return (hits);
+}
+
+main() {
+    extrn printf;
+    auto round, total;
+    round = 0;
+    total = 0;
+    while (round < 200) {
+        fill(4096, round, 7);
+        total = total + checksum(4096, round) + scan(4096, round * 100);
+        round++;
+    }
+    printf("%d\n", total);
+    return (0);
+}
@@ -0,0 +1,203 @@
+// Switch dispatch kernels: dense opcode-style switches of growing size
+// and a sparse one, driven by a pseudo-random case stream. Time the native
+// build to compare the dispatch cost per case count.
+
+dense2(x) {
+    switch (x) {
+    case 0: return (3);
+    case 1: return (10);
+    }
+    return (0);
+}
+
+dense4(x) {
+    switch (x) {
+    case 0: return (3);
+    case 1: return (10);
+    case 2: return (17);
+    case 3: return (24);
+    }
+    return (0);
+}
+
+dense8(x) {
+    switch (x) {
+    case 0: return (3);
+    case 1: return (10);
+    case 2: return (17);
+    case 3: return (24);
+    case 4: return (31);
+    case 5: return (38);
+    case 6: return (45);
+    case 7: return (52);
+    }
+    return (0);
+}
+
+dense16(x) {
+    switch (x) {
+    case 0: return (3);
+    case 1: return (10);
+    case 2: return (17);
+    case 3: return (24);
+    case 4: return (31);
+    case 5: return (38);
+    case 6: return (45);
+    case 7: return (52);
+    case 8: return (59);
+    case 9: return (66);
+    case 10: return (73);
+    case 11: return (80);
+    case 12: return (87);
+    case 13: return (94);
+    case 14: return (101);
+    case 15: return (108);
+    }
+    return (0);
+}
+
+dense32(x) {
+    switch (x) {
+    case 0: return (3);
+    case 1: return (10);
+    case 2: return (17);
+    case 3: return (24);
+    case 4: return (31);
+    case 5: return (38);
+    case 6: return (45);
+    case 7: return (52);
+    case 8: return (59);
+    case 9: return (66);
+    case 10: return (73);
+    case 11: return (80);
+    case 12: return (87);
+    case 13: return (94);
+    case 14: return (101);
+    case 15: return (108);
+    case 16: return (115);
+    case 17: return (122);
+    case 18: return (129);
+    case 19: return (136);
+    case 20: return (143);
+    case 21: return (150);
+    case 22: return (157);
+    case 23: return (164);
+    case 24: return (171);
+    case 25: return (178);
+    case 26: return (185);
+    case 27: return (192);
+    case 28: return (199);
+    case 29: return (206);
+    case 30: return (213);
+    case 31: return (220);
+    }
+    return (0);
+}
+
+dense64(x) {
+    switch (x) {
+    case 0: return (3);
+    case 1: return (10);
+    case 2: return (17);
+    case 3: return (24);
+    case 4: return (31);
+    case 5: return (38);
+    case 6: return (45);
+    case 7: return (52);
+    case 8: return (59);
+    case 9: return (66);
+    case 10: return (73);
+    case 11: return (80);
+    case 12: return (87);
+    case 13: return (94);
+    case 14: return (101);
+    case 15: return (108);
+    case 16: return (115);
+    case 17: return (122);
+    case 18: return (129);
+    case 19: return (136);
+    case 20: return (143);
+    case 21: return (150);
+    case 22: return (157);
+    case 23: return (164);
+    case 24: return (171);
+    case 25: return (178);
+    case 26: return (185);
+    case 27: return (192);
+    case 28: return (199);
+    case 29: return (206);
+    case 30: return (213);
+    case 31: return (220);
+    case 32: return (227);
+    case 33: return (234);
+    case 34: return (241);
+    case 35: return (248);
+    case 36: return (255);
+    case 37: return (262);
+    case 38: return (269);
+    case 39: return (276);
+    case 40: return (283);
+    case 41: return (290);
+    case 42: return (297);
+    case 43: return (304);
+    case 44: return (311);
+    case 45: return (318);
+    case 46: return (325);
+    case 47: return (332);
+    case 48: return (339);
+    case 49: return (346);
+    case 50: return (353);
+    case 51: return (360);
+    case 52: return (367);
+    case 53: return (374);
+    case 54: return (381);
+    case 55: return (388);
+    case 56: return (395);
+    case 57: return (402);
+    case 58: return (409);
+    case 59: return (416);
+    case 60: return (423);
+    case 61: return (430);
+    case 62: return (437);
+    case 63: return (444);
+    }
+    return (0);
+}
+
+sparse16(x) {
+    switch (x) {
+    case 5: return (3);
+    case 42: return (10);
+    case 153: return (17);
+    case 338: return (24);
+    case 597: return (31);
+    case 930: return (38);
+    case 1337: return (45);
+    case 1818: return (52);
+    case 2373: return (59);
+    case 3002: return (66);
+    case 3705: return (73);
+    case 4482: return (80);
+    case 5333: return (87);
+    case 6258: return (94);
+    case 7257: return (101);
+    case 8330: return (108);
+    }
+    return (0);
+}
+
+main() {
+    extrn printf;
+    auto i, x, total;
+    i = 0;
+    x = 12345;
+    total = 0;
+    while (i < 20000000) {
+        x = (x * 1103515245 + 12345) & 2147483647;
+        total = total + dense2(x & 1) + dense4(x & 3) + dense8(x & 7) + dense16(x & 15);
+        total = total + dense32(x & 31) + dense64(x & 63) + sparse16((x & 15) * (x & 15) * 37 + 5);
+        i++;
+    }
+    printf("%d\n", total);
+    return (0);
+}
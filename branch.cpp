@@ -0,0 +1,163 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+static bool is_select_arg(const Arg& arg) {
+    return arg.type != ArgType::Deref && arg.type != ArgType::Bogus;
+}
+static bool is_copy(const Op& op) {
+    return op.type == OpType::AutoAssign && is_select_arg(op.arg);
+}
+static bool is_label(const Func& func, size_t i, size_t label) {
+    return i < func.body.size() && func.body[i].opcode.type == OpType::Label &&
+           func.body[i].opcode.label == label;
+}
+// Replaces a branch at body[i] that only picks the value of one slot
+//   jmp_if_not L1, c; x = a; jmp L2; label L1; x = b; label L2
+//   jmp_if_not L1, c; x = a; label L1
+// with a Select and returns the number of ops consumed
+static size_t form_select(Func& func, size_t i, const std::vector<size_t>& refs,
+                          std::vector<OpWithLocation>& body) {
+    const Op& branch = func.body[i].opcode;
+    if (branch.type != OpType::JmpIfNotLabel && branch.type != OpType::CmpJmpIfNotLabel) return 0;
+    if (branch.type == OpType::JmpIfNotLabel && !is_select_arg(branch.arg)) return 0;
+    const Op& if_true = func.body[i + 1].opcode;
+    if (!is_copy(if_true)) return 0;
+    size_t x = if_true.index;
+    Op select;
+    select.type = OpType::Select;
+    select.index = x;
+    select.arg2 = if_true.arg;
+    size_t consumed;
+    size_t keep_label = 0;
+    bool keep = false;
+    if (is_label(func, i + 2, branch.label)) {
+        select.arg3 = Arg::make_auto_var(x);
+        consumed = 3;
+        keep = refs[branch.label] > 1;
+        keep_label = branch.label;
+    } else {
+        if (i + 5 >= func.body.size() || func.body[i + 2].opcode.type != OpType::JmpLabel) return 0;
+        size_t out = func.body[i + 2].opcode.label;
+        if (!is_label(func, i + 3, branch.label) || refs[branch.label] != 1) return 0;
+        const Op& if_false = func.body[i + 4].opcode;
+        if (!is_copy(if_false) || if_false.index != x || !is_label(func, i + 5, out)) return 0;
+        select.arg3 = if_false.arg;
+        consumed = 6;
+        keep = refs[out] > 1;
+        keep_label = out;
+    }
+    Loc loc = func.body[i].loc;
+    if (branch.type == OpType::CmpJmpIfNotLabel) {
+        Op cmp = branch;
+        cmp.type = OpType::Binop;
+        cmp.index = ++func.auto_vars_count;
+        push_op(body, cmp, loc);
+        select.arg = Arg::make_auto_var(cmp.index);
+    } else {
+        select.arg = branch.arg;
+    }
+    push_op(body, select, loc);
+    if (keep) {
+        Op label;
+        label.type = OpType::Label;
+        label.label = keep_label;
+        push_op(body, label, func.body[i + consumed - 1].loc);
+    }
+    return consumed;
+}
+static size_t form_selects(Func& func) {
+    std::vector<size_t> refs(max_label_index(func), 0);
+    std::vector<const size_t*> labels;
+    for (const OpWithLocation& owl : func.body) {
+        op_jump_labels(owl.opcode, labels);
+        for (const size_t* label : labels) refs[*label]++;
+    }
+    std::vector<OpWithLocation> body;
+    size_t formed = 0;
+    size_t i = 0;
+    while (i < func.body.size()) {
+        size_t consumed = i + 2 < func.body.size() ? form_select(func, i, refs, body) : 0;
+        if (consumed > 0) {
+            formed++;
+            i += consumed;
+        } else {
+            body.push_back(func.body[i++]);
+        }
+    }
+    func.body.swap(body);
+    return formed;
+}
+// t = a < b; jmp_if_not L, t becomes jmp_if_not L, a < b when t dies at the
+// branch
+static size_t fuse_compare_branches(Func& func) {
+    Cfg cfg;
+    build_cfg(func, cfg);
+    Liveness live;
+    compute_liveness(func, cfg, live);
+    BitSet escaped;
+    escaped_slots(func, escaped);
+    std::vector<bool> removed(func.body.size(), false);
+    size_t fused = 0;
+    for (size_t i = 0; i + 1 < func.body.size(); i++) {
+        Op& cmp = func.body[i].opcode;
+        const Op& branch = func.body[i + 1].opcode;
+        if (cmp.type != OpType::Binop || !is_comparison(cmp.binop)) continue;
+        if (branch.type != OpType::JmpIfNotLabel || branch.arg.type != ArgType::AutoVar ||
+            branch.arg.index != cmp.index) {
+            continue;
+        }
+        if (escaped.test(cmp.index) || live.live_out[cfg.block_of_op[i + 1]].test(cmp.index)) continue;
+        cmp.type = OpType::CmpJmpIfNotLabel;
+        cmp.index = 0;
+        cmp.label = branch.label;
+        removed[i + 1] = true;
+        fused++;
+    }
+    std::vector<OpWithLocation> body;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        if (!removed[i]) body.push_back(func.body[i]);
+    }
+    func.body.swap(body);
+    return fused;
+}
+// Branches on literals, such as the exit tests full unrolling leaves in
+// its copies, become jumps when they are taken and go when they are not
+static size_t fold_constant_branches(Func& func) {
+    size_t folded = 0;
+    std::vector<OpWithLocation> body;
+    for (const OpWithLocation& owl : func.body) {
+        const Op& op = owl.opcode;
+        unsigned long long value;
+        bool known = false;
+        if (op.type == OpType::JmpIfNotLabel && op.arg.type == ArgType::Literal) {
+            value = op.arg.value;
+            known = true;
+        } else if (op.type == OpType::CmpJmpIfNotLabel && op.arg.type == ArgType::Literal &&
+                   op.arg2.type == ArgType::Literal) {
+            known = fold_binop(op.binop, op.arg.value, op.arg2.value, value);
+        }
+        if (!known) {
+            body.push_back(owl);
+            continue;
+        }
+        folded++;
+        if (value != 0) continue;
+        OpWithLocation jmp = owl;
+        jmp.opcode = Op();
+        jmp.opcode.type = OpType::JmpLabel;
+        jmp.opcode.label = op.label;
+        body.push_back(jmp);
+    }
+    func.body.swap(body);
+    return folded;
+}
+bool canonicalize_branches(Func& func, const OptOptions& options) {
+    size_t constant = fold_constant_branches(func);
+    size_t selects = form_selects(func);
+    size_t fused = func.body.empty() ? 0 : fuse_compare_branches(func);
+    if (options.report) {
+        printf("INFO: %s: folded %zu constant branches, formed %zu selects, fused %zu compare-and-branches\n",
+               func.name.c_str(), constant, selects, fused);
+    }
+    return constant > 0 || selects > 0 || fused > 0;
+}
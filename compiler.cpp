@@ -58,7 +58,7 @@ static bool try_binop_from_assign(Token token, Binop& result, bool& has_binop) {
         default: return false;
     }
 }
-Compiler::Compiler() : op_label_count(0), target(Target::IR), error_count(0) {
+Compiler::Compiler() : op_label_count(0), reused_string_bytes(0), target(Target::IR), error_count(0) {
     vars.push_back(std::vector<Var>());
 }
 void Compiler::scope_push() {
@@ -127,11 +127,15 @@ void Compiler::push_opcode(const Op& opcode, Loc loc) {
     func_body.push_back(owl);
 }
 size_t Compiler::compile_string(const std::string& str) {
-    size_t offset = data.size();
-    for (size_t i = 0; i < str.size(); i++) {
-        data.push_back(static_cast<unsigned char>(str[i]));
+    auto it = strings.find(str);
+    if (it != strings.end()) {
+        reused_string_bytes += str.size() + 1;
+        return it->second;
     }
-    data.push_back(0);  
+    size_t offset = data.size();
+    strings[str] = offset;
+    data.insert(data.end(), str.begin(), str.end());
+    data.push_back(0);
     return offset;
 }
 bool Compiler::bump_error_count() {
@@ -291,6 +295,13 @@ bool compile_primary_expression(Lexer& l, Compiler& c, Arg& result, bool& is_lva
         case Token::ID: {
             std::string name = l.string_value;
             Var* var = c.find_var_deep(name);
+            Intrinsic kind;
+            if (!var && find_intrinsic(name, kind)) {
+                if (std::find(c.extrns.begin(), c.extrns.end(), name) == c.extrns.end()) c.extrns.push_back(name);
+                result = Arg::make_external(name);
+                is_lvalue = true;
+                return true;
+            }
             if (!var) {
                 fprintf(stderr, "%s:%d:%d: ERROR: could not find name `%s`\n",
                         loc.input_path, loc.line_number, loc.line_offset, name.c_str());
@@ -401,6 +412,48 @@ bool compile_primary_expression_postfix(Lexer& l, Compiler& c, Arg& result, bool
     }
     return true;
 }
+bool is_comparison(Binop binop) {
+    return binop == Binop::Less || binop == Binop::Greater || binop == Binop::Equal ||
+           binop == Binop::NotEqual || binop == Binop::GreaterEqual || binop == Binop::LessEqual;
+}
+struct IntrinsicDesc {
+    const char* name;
+    size_t arity;
+    Intrinsic kind;
+};
+static const IntrinsicDesc INTRINSICS[] = {
+    {"char",     2, Intrinsic::Char},
+    {"lchar",    3, Intrinsic::Lchar},
+    {"memcpy",   3, Intrinsic::Memcpy},
+    {"memset",   3, Intrinsic::Memset},
+    {"popcount", 1, Intrinsic::Popcount},
+    {"clz",      1, Intrinsic::Clz},
+    {"ctz",      1, Intrinsic::Ctz},
+    {"bswap",    1, Intrinsic::Bswap},
+    {"rotl",     2, Intrinsic::Rotl},
+    {"rotr",     2, Intrinsic::Rotr},
+};
+const char* intrinsic_name(Intrinsic kind) {
+    for (const IntrinsicDesc& desc : INTRINSICS) {
+        if (desc.kind == kind) return desc.name;
+    }
+    return "";
+}
+size_t intrinsic_arity(Intrinsic kind) {
+    for (const IntrinsicDesc& desc : INTRINSICS) {
+        if (desc.kind == kind) return desc.arity;
+    }
+    return 0;
+}
+bool find_intrinsic(const std::string& name, Intrinsic& kind) {
+    for (const IntrinsicDesc& desc : INTRINSICS) {
+        if (name == desc.name) {
+            kind = desc.kind;
+            return true;
+        }
+    }
+    return false;
+}
 bool compile_function_call(Lexer& l, Compiler& c, const Arg& fun, Arg& result) {
     std::vector<Arg> args;
     ParsePoint saved = l.parse_point;
@@ -427,6 +480,11 @@ bool compile_function_call(Lexer& l, Compiler& c, const Arg& fun, Arg& result) {
     op.result = res;
     op.arg = fun;
     op.funcall_args = args;
+    if (fun.type == ArgType::External && find_intrinsic(fun.name, op.intrinsic) &&
+        intrinsic_arity(op.intrinsic) == args.size()) {
+        op.type = OpType::Intrinsic;
+        op.arg = Arg();
+    }
     c.push_opcode(op, l.loc);
     result = Arg::make_auto_var(res);
     return true;
@@ -509,7 +567,24 @@ bool compile_binop_expression(Lexer& l, Compiler& c, size_t precedence, Arg& res
     }
     return true;
 }
+// Merges the JmpIfNotLabel at body[jmp] with the comparison right before
+// it when the compared value is a temporary above temps that nothing else
+// reads
+static void fuse_compare_branch(Compiler& c, size_t jmp, size_t temps) {
+    const Op& branch = c.func_body[jmp].opcode;
+    if (jmp == 0 || branch.arg.type != ArgType::AutoVar || branch.arg.index <= temps) return;
+    Op& cmp = c.func_body[jmp - 1].opcode;
+    if (cmp.type != OpType::Binop || cmp.index != branch.arg.index || !is_comparison(cmp.binop)) return;
+    cmp.type = OpType::CmpJmpIfNotLabel;
+    cmp.index = 0;
+    cmp.label = branch.label;
+    c.func_body.erase(c.func_body.begin() + jmp);
+}
+static bool is_select_arg(const Arg& arg) {
+    return arg.type != ArgType::Deref && arg.type != ArgType::Bogus;
+}
 bool compile_assign_expression(Lexer& l, Compiler& c, Arg& result, bool& is_lvalue) {
+    size_t temps = c.auto_vars_ator.count;
     if (!compile_binop_expression(l, c, 0, result, is_lvalue)) {
         return false;
     }
@@ -573,6 +648,7 @@ bool compile_assign_expression(Lexer& l, Compiler& c, Arg& result, bool& is_lval
     if (l.token == Token::Question) {
         size_t res = c.allocate_auto_var();
         size_t else_label = c.allocate_label_index();
+        size_t jmp = c.func_body.size();
         Op jmp_op;
         jmp_op.type = OpType::JmpIfNotLabel;
         jmp_op.label = else_label;
@@ -607,6 +683,19 @@ bool compile_assign_expression(Lexer& l, Compiler& c, Arg& result, bool& is_lval
         out_lbl.type = OpType::Label;
         out_lbl.label = out_label;
         c.push_opcode(out_lbl, l.loc);
+        if (c.func_body.size() == jmp + 6 && is_select_arg(if_true) && is_select_arg(if_false)) {
+            Loc loc = c.func_body[jmp].loc;
+            Op select;
+            select.type = OpType::Select;
+            select.index = res;
+            select.arg = c.func_body[jmp].opcode.arg;
+            select.arg2 = if_true;
+            select.arg3 = if_false;
+            c.func_body.resize(jmp);
+            c.push_opcode(select, loc);
+        } else {
+            fuse_compare_branch(c, jmp, temps);
+        }
         result = Arg::make_auto_var(res);
         is_lvalue = false;
     } else {
@@ -617,13 +706,106 @@ bool compile_assign_expression(Lexer& l, Compiler& c, Arg& result, bool& is_lval
 bool compile_expression(Lexer& l, Compiler& c, Arg& result, bool& is_lvalue) {
     return compile_assign_expression(l, c, result, is_lvalue);
 }
+// Switch dispatch shapes, picked per range of sorted cases: up to
+// SWITCH_LINEAR_MAX cases are tested one after another, a range whose
+// values span at most SWITCH_TABLE_SPREAD times its case count gets a jump
+// table, and anything else is halved by a signed compare
+static const size_t SWITCH_LINEAR_MAX = 3;
+static const unsigned long long SWITCH_TABLE_SPREAD = 3;
+static const unsigned long long SWITCH_TABLE_MAX = 4096;
+static bool case_less(const SwitchCase& a, const SwitchCase& b) {
+    return a.value < b.value;
+}
+static bool dense_cases(const std::vector<SwitchCase>& cases, size_t lo, size_t hi) {
+    unsigned long long span = static_cast<unsigned long long>(cases[hi - 1].value) -
+                              static_cast<unsigned long long>(cases[lo].value);
+    return span < SWITCH_TABLE_MAX && span < SWITCH_TABLE_SPREAD * (hi - lo);
+}
+static void compile_case_jump(Compiler& c, const Arg& value, Binop binop, long long k, size_t label,
+                              Loc loc) {
+    Op op;
+    op.type = OpType::CmpJmpIfNotLabel;
+    op.binop = binop;
+    op.arg = value;
+    op.arg2 = Arg::make_literal(static_cast<unsigned long long>(k));
+    op.label = label;
+    c.push_opcode(op, loc);
+}
+static void compile_switch_dispatch(Compiler& c, const Switch& sw, size_t lo, size_t hi, Loc loc) {
+    const std::vector<SwitchCase>& cases = sw.cases;
+    if (hi - lo > SWITCH_LINEAR_MAX && dense_cases(cases, lo, hi)) {
+        long long first = cases[lo].value;
+        Op table;
+        table.type = OpType::JmpTable;
+        table.label = sw.label;
+        table.labels.assign(static_cast<size_t>(cases[hi - 1].value - first) + 1, sw.label);
+        for (size_t i = lo; i < hi; i++) {
+            table.labels[static_cast<size_t>(cases[i].value - first)] = cases[i].label;
+        }
+        table.arg = sw.value;
+        if (first != 0) {
+            Op bias;
+            bias.type = OpType::Binop;
+            bias.binop = Binop::Minus;
+            bias.index = c.allocate_auto_var();
+            bias.arg = sw.value;
+            bias.arg2 = Arg::make_literal(static_cast<unsigned long long>(first));
+            c.push_opcode(bias, loc);
+            table.arg = Arg::make_auto_var(bias.index);
+        }
+        c.push_opcode(table, loc);
+        return;
+    }
+    if (hi - lo > SWITCH_LINEAR_MAX) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t upper = c.allocate_label_index();
+        compile_case_jump(c, sw.value, Binop::Less, cases[mid].value, upper, loc);
+        compile_switch_dispatch(c, sw, lo, mid, loc);
+        Op label;
+        label.type = OpType::Label;
+        label.label = upper;
+        c.push_opcode(label, loc);
+        compile_switch_dispatch(c, sw, mid, hi, loc);
+        return;
+    }
+    for (size_t i = lo; i < hi; i++) {
+        compile_case_jump(c, sw.value, Binop::NotEqual, cases[i].value, cases[i].label, loc);
+    }
+    Op jmp;
+    jmp.type = OpType::JmpLabel;
+    jmp.label = sw.label;
+    c.push_opcode(jmp, loc);
+}
+// Emits the dispatch of a finished switch and moves it in front of the body
+// that starts at body[at]
+static void compile_switch(Compiler& c, Switch& sw, size_t at, Loc loc) {
+    std::sort(sw.cases.begin(), sw.cases.end(), case_less);
+    size_t body_end = c.func_body.size();
+    if (sw.cases.empty()) {
+        Op jmp;
+        jmp.type = OpType::JmpLabel;
+        jmp.label = sw.label;
+        c.push_opcode(jmp, loc);
+    } else {
+        compile_switch_dispatch(c, sw, 0, sw.cases.size(), loc);
+    }
+    size_t count = c.func_body.size() - body_end;
+    std::rotate(c.func_body.begin() + at, c.func_body.begin() + body_end, c.func_body.end());
+    for (Goto& g : c.func_gotos) {
+        if (g.addr >= at) g.addr += count;
+    }
+    Op out;
+    out.type = OpType::Label;
+    out.label = sw.label;
+    c.push_opcode(out, loc);
+}
 bool compile_block(Lexer& l, Compiler& c) {
     while (true) {
+        ParsePoint saved = l.parse_point;
         if (!l.get_token()) return false;
         if (l.token == Token::CCurly) {
             return true;
         }
-        ParsePoint saved = l.parse_point;
         l.parse_point = saved;
         if (!compile_statement(l, c)) return false;
     }
@@ -692,6 +874,10 @@ bool compile_statement(Lexer& l, Compiler& c) {
                     for (size_t i = 0; i < size; i++) {
                         c.allocate_auto_var();
                     }
+                    AutoVec vec;
+                    vec.first = index + 1;
+                    vec.size = size;
+                    c.func_auto_vecs.push_back(vec);
                     Arg arg = Arg::make_ref_auto_var(index + size);
                     Op op;
                     op.type = OpType::AutoAssign;
@@ -725,6 +911,7 @@ bool compile_statement(Lexer& l, Compiler& c) {
             jmp_op.label = else_label;
             jmp_op.arg = cond;
             c.push_opcode(jmp_op, loc);
+            fuse_compare_branch(c, c.func_body.size() - 1, saved_auto);
             if (!compile_statement(l, c)) return false;
             saved = l.parse_point;
             if (!l.get_token()) return false;
@@ -771,6 +958,7 @@ bool compile_statement(Lexer& l, Compiler& c) {
             jmp_op.label = out_label;
             jmp_op.arg = arg;
             c.push_opcode(jmp_op, loc);
+            fuse_compare_branch(c, c.func_body.size() - 1, saved_auto);
             if (!compile_statement(l, c)) return false;
             Op jmp_back;
             jmp_back.type = OpType::JmpLabel;
@@ -807,6 +995,95 @@ bool compile_statement(Lexer& l, Compiler& c) {
             }
             return true;
         }
+        case Token::Switch: {
+            size_t saved_auto = c.auto_vars_ator.count;
+            Arg value;
+            bool dummy;
+            if (!compile_expression(l, c, value, dummy)) return false;
+            if (value.type != ArgType::AutoVar) {
+                Op copy;
+                copy.type = OpType::AutoAssign;
+                copy.index = c.allocate_auto_var();
+                copy.arg = value;
+                c.push_opcode(copy, loc);
+                value = Arg::make_auto_var(copy.index);
+            }
+            Switch sw;
+            sw.label = c.allocate_label_index();
+            sw.value = value;
+            c.switch_stack.push_back(sw);
+            size_t body = c.func_body.size();
+            if (!compile_statement(l, c)) return false;
+            sw = c.switch_stack.back();
+            c.switch_stack.pop_back();
+            compile_switch(c, sw, body, loc);
+            c.auto_vars_ator.count = saved_auto;
+            return true;
+        }
+        case Token::Case: {
+            if (!l.get_token()) return false;
+            bool negative = l.token == Token::Minus;
+            if (negative && !l.get_token()) return false;
+            if (l.token != Token::IntLit && l.token != Token::CharLit) {
+                fprintf(stderr, "%s:%d:%d: ERROR: expected an integer constant after `case`\n",
+                        l.loc.input_path, l.loc.line_number, l.loc.line_offset);
+                return false;
+            }
+            SwitchCase sc;
+            sc.value = static_cast<long long>(l.int_number);
+            if (negative) sc.value = -sc.value;
+            sc.loc = loc;
+            if (!get_and_expect_token(l, Token::Colon)) return false;
+            if (c.switch_stack.empty()) {
+                fprintf(stderr, "%s:%d:%d: ERROR: `case` outside of a switch\n",
+                        loc.input_path, loc.line_number, loc.line_offset);
+                return c.bump_error_count();
+            }
+            Switch& sw = c.switch_stack.back();
+            for (const SwitchCase& existing : sw.cases) {
+                if (existing.value == sc.value) {
+                    fprintf(stderr, "%s:%d:%d: ERROR: duplicate case value %lld\n",
+                            loc.input_path, loc.line_number, loc.line_offset, sc.value);
+                    fprintf(stderr, "%s:%d:%d: NOTE: the first case is located here\n",
+                            existing.loc.input_path, existing.loc.line_number, existing.loc.line_offset);
+                    return c.bump_error_count();
+                }
+            }
+            sc.label = c.allocate_label_index();
+            sw.cases.push_back(sc);
+            Op label;
+            label.type = OpType::Label;
+            label.label = sc.label;
+            c.push_opcode(label, loc);
+            return compile_statement(l, c);
+        }
+        case Token::Asm: {
+            if (!get_and_expect_token(l, Token::OParen)) return false;
+            Op op;
+            op.type = OpType::Asm;
+            if (!get_and_expect_token(l, Token::String)) return false;
+            op.asm_args.push_back(l.string_value);
+            if (!l.get_token()) return false;
+            while (l.token == Token::Comma) {
+                if (!get_and_expect_token(l, Token::String)) return false;
+                op.asm_args.push_back(l.string_value);
+                if (!l.get_token()) return false;
+            }
+            if (l.token == Token::Colon) {
+                op.asm_declared = true;
+                if (!l.get_token()) return false;
+                while (l.token == Token::String) {
+                    op.asm_clobbers.push_back(l.string_value);
+                    if (!l.get_token()) return false;
+                    if (l.token != Token::Comma) break;
+                    if (!get_and_expect_token(l, Token::String)) return false;
+                }
+            }
+            if (!expect_token(l, Token::CParen)) return false;
+            if (!get_and_expect_token(l, Token::SemiColon)) return false;
+            c.push_opcode(op, loc);
+            return true;
+        }
         case Token::Goto: {
             if (!get_and_expect_token(l, Token::ID)) return false;
             std::string name = l.string_value;
@@ -862,6 +1139,23 @@ bool compile_statement(Lexer& l, Compiler& c) {
         }
     }
 }
+// A program that defines a function or global named like a builtin calls
+// its own definition
+static void call_shadowed_intrinsics(Compiler& c) {
+    std::vector<std::string> defined;
+    for (const Func& func : c.funcs) defined.push_back(func.name);
+    for (const Global& global : c.globals) defined.push_back(global.name);
+    for (Func& func : c.funcs) {
+        for (OpWithLocation& owl : func.body) {
+            Op& op = owl.opcode;
+            if (op.type != OpType::Intrinsic) continue;
+            std::string name = intrinsic_name(op.intrinsic);
+            if (std::find(defined.begin(), defined.end(), name) == defined.end()) continue;
+            op.type = OpType::Funcall;
+            op.arg = Arg::make_external(name);
+        }
+    }
+}
 bool compile_program(Lexer& l, Compiler& c) {
     c.scope_push(); 
     while (true) {
@@ -925,10 +1219,15 @@ bool compile_program(Lexer& l, Compiler& c) {
             func.body = c.func_body;
             func.params_count = params_count;
             func.auto_vars_count = c.auto_vars_ator.max;
+            func.auto_vecs = c.func_auto_vecs;
+            func.cold_ops = 0;
+            func.profiled = false;
+            func.local = false;
             c.funcs.push_back(func);
             c.func_body.clear();
             c.func_goto_labels.clear();
             c.func_gotos.clear();
+            c.func_auto_vecs.clear();
             c.auto_vars_ator.count = 0;
             c.auto_vars_ator.max = 0;
             c.op_label_count = 0;
@@ -989,5 +1288,6 @@ bool compile_program(Lexer& l, Compiler& c) {
         }
     }
     c.scope_pop(); 
+    call_shadowed_intrinsics(c);
     return c.error_count == 0;
 }
@@ -3,6 +3,7 @@
 
 #include "lexer.h"
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <cstddef>
 
@@ -47,6 +48,8 @@ struct Arg {
     unsigned long long value;  // For Literal
     size_t offset;  // For DataOffset
     
+    Arg() : type(ArgType::Bogus), index(0), value(0), offset(0) {}
+    
     static Arg make_bogus() {
         Arg a;
         a.type = ArgType::Bogus;
@@ -108,9 +111,13 @@ enum class Binop {
     Plus, Minus, Mult, Mod, Div,
     Less, Greater, Equal, NotEqual,
     GreaterEqual, LessEqual,
-    BitOr, BitAnd, BitShl, BitShr
+    BitOr, BitAnd, BitShl, BitShr,
+    BitSar  // Arithmetic shift right, only produced by the optimizer
 };
 
+// The six binops that yield 0 or 1
+bool is_comparison(Binop binop);
+
 // Operation types
 enum class OpType {
     Bogus,
@@ -125,28 +132,66 @@ enum class OpType {
     Label,
     JmpLabel,
     JmpIfNotLabel,
+    CmpJmpIfNotLabel,  // Jumps unless arg binop arg2 holds
+    Select,            // auto[index] = arg ? arg2 : arg3, both sides evaluated
+    JmpTable,          // Jumps to labels[arg], or to label unless arg < labels.size()
+    Intrinsic,         // auto[result] = the builtin named by intrinsic, applied to funcall_args
     Return
 };
 
+// Builtin functions the front end compiles to Intrinsic ops instead of calls
+enum class Intrinsic {
+    Char,      // char(s, i): byte i of s, zero-extended
+    Lchar,     // lchar(s, i, c): stores the low byte of c as byte i of s, returns c
+    Memcpy,    // memcpy(dst, src, n): copies n bytes, returns dst
+    Memset,    // memset(dst, c, n): fills n bytes with the low byte of c, returns dst
+    Popcount,
+    Clz,       // Leading zero bits, 64 for 0
+    Ctz,       // Trailing zero bits, 64 for 0
+    Bswap,
+    Rotl,      // rotl(x, n): rotates left by n mod 64
+    Rotr
+};
+
+const char* intrinsic_name(Intrinsic kind);
+size_t intrinsic_arity(Intrinsic kind);
+// Builtins need no extrn declaration; a call with another argument count
+// stays a call
+bool find_intrinsic(const std::string& name, Intrinsic& kind);
+
 // Operation structure
 struct Op {
     OpType type;
-    size_t result;  // For UnaryNot, Negate
-    size_t index;   // For Binop, AutoAssign, Store
+    size_t result;  // For UnaryNot, Negate, Funcall, Intrinsic
+    size_t index;   // For Binop, AutoAssign, Store, Select
     std::string name;  // For ExternalAssign, Asm
-    Binop binop;    // For Binop
+    Binop binop;    // For Binop, CmpJmpIfNotLabel
     Arg arg;        // General purpose arg
     Arg arg2;       // Second arg (for Binop rhs, etc)
+    Arg arg3;       // Third arg (for the Select false value)
     std::vector<std::string> asm_args;  // For Asm
-    std::vector<Arg> funcall_args;  // For Funcall
-    size_t label;   // For Label, JmpLabel, JmpIfNotLabel
+    std::vector<std::string> asm_clobbers;  // For Asm, the registers and "memory" it may change
+    bool asm_declared;  // For Asm, whether it came with a clobber list
+    std::vector<Arg> funcall_args;  // For Funcall, Intrinsic
+    Intrinsic intrinsic;  // For Intrinsic
+    size_t label;   // For Label, JmpLabel, JmpIfNotLabel, CmpJmpIfNotLabel, JmpTable
+    std::vector<size_t> labels;  // For JmpTable
     bool has_return_arg;  // For Return
+    
+    Op() : type(OpType::Bogus), result(0), index(0), binop(Binop::Plus), asm_declared(false),
+           intrinsic(Intrinsic::Char), label(0), has_return_arg(false) {}
 };
 
+// Execution count of an op without a profile
+static const unsigned long long NO_COUNT = static_cast<unsigned long long>(-1);
+
 // Operation with location
 struct OpWithLocation {
     Op opcode;
     Loc loc;
+    unsigned long long count;  // Profiled executions or NO_COUNT
+
+    OpWithLocation() : count(NO_COUNT) {}
 };
 
 // Goto label
@@ -163,11 +208,18 @@ struct Goto {
     size_t addr;
 };
 
+// `case` label of a switch
+struct SwitchCase {
+    long long value;
+    size_t label;
+    Loc loc;
+};
+
 // Switch frame
 struct Switch {
-    size_t label;
+    size_t label;  // Past the switch body, where unmatched values go
     Arg value;
-    size_t cond;
+    std::vector<SwitchCase> cases;
 };
 
 // Immediate value for globals
@@ -213,6 +265,12 @@ struct Global {
     size_t minimum_size;
 };
 
+// Automatic vector storage: `auto v N` backs v with slots [first, first + size)
+struct AutoVec {
+    size_t first;
+    size_t size;
+};
+
 // Function
 struct Func {
     std::string name;
@@ -220,6 +278,10 @@ struct Func {
     std::vector<OpWithLocation> body;
     size_t params_count;
     size_t auto_vars_count;
+    std::vector<AutoVec> auto_vecs;
+    size_t cold_ops;  // Trailing ops of body placed apart as rarely run code
+    bool profiled;    // Ops carry counts read from a profile
+    bool local;       // Made by the optimizer, not visible outside the object file
 };
 
 // Auto vars allocator
@@ -234,6 +296,7 @@ struct AutoVarsAtor {
 enum class Target {
     IR,
     Fasm_x86_64_Linux,
+    Elf_x86_64_Linux,
     Fasm_x86_64_Windows,
     Gas_AArch64_Linux,
     Uxn,
@@ -254,6 +317,7 @@ public:
     std::vector<OpWithLocation> func_body;
     std::vector<GotoLabel> func_goto_labels;
     std::vector<Goto> func_gotos;
+    std::vector<AutoVec> func_auto_vecs;
     size_t op_label_count;
     
     // Switch stack
@@ -261,6 +325,8 @@ public:
     
     // Data section
     std::vector<unsigned char> data;
+    std::unordered_map<std::string, size_t> strings;  // Offset in data of each literal, by content
+    size_t reused_string_bytes;  // Bytes of repeated literals that share an earlier copy
     
     // External symbols
     std::vector<std::string> extrns;
@@ -291,7 +357,8 @@ public:
     // Opcode management
     void push_opcode(const Op& opcode, Loc loc);
     
-    // String compilation
+    // String compilation. Literals are pooled: a repeated one returns the
+    // offset of its first copy
     size_t compile_string(const std::string& str);
     
     // Error handling
@@ -0,0 +1,58 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+bool eliminate_dead_code(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    size_t removed = 0;
+    while (true) {
+        Cfg cfg;
+        build_cfg(func, cfg);
+        if (cfg.blocks.empty()) break;
+        DomTree dom;
+        compute_dominators(cfg, dom);
+        Liveness live;
+        compute_liveness(func, cfg, live);
+        BitSet escaped;
+        escaped_slots(func, escaped);
+        std::vector<bool> dead(func.body.size(), false);
+        size_t count = 0;
+        std::vector<size_t> uses;
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            const BasicBlock& block = cfg.blocks[b];
+            if (!dom.reachable(b)) {
+                for (size_t i = block.begin; i < block.end; i++) {
+                    dead[i] = true;
+                    count++;
+                }
+                continue;
+            }
+            BitSet cur = live.live_out[b];
+            for (size_t i = block.end; i-- > block.begin;) {
+                const Op& op = func.body[i].opcode;
+                size_t def;
+                bool has_def = op_defined_slot(op, def);
+                if (has_def && is_pure_op(op) && !escaped.test(def) && !cur.test(def)) {
+                    dead[i] = true;
+                    count++;
+                    continue;
+                }
+                if (has_def) cur.reset(def);
+                op_used_slots(op, uses);
+                for (size_t u : uses) {
+                    cur.set(u);
+                }
+            }
+        }
+        if (count == 0) break;
+        std::vector<OpWithLocation> body;
+        for (size_t i = 0; i < func.body.size(); i++) {
+            if (!dead[i]) body.push_back(func.body[i]);
+        }
+        func.body.swap(body);
+        removed += count;
+    }
+    if (options.report) {
+        printf("INFO: %s: removed %zu dead ops\n", func.name.c_str(), removed);
+    }
+    return removed > 0;
+}
@@ -0,0 +1,265 @@
+#include "elf64.h"
+#include <elf.h>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+static const Elf64_Addr EXEC_BASE = 0x400000;
+static const size_t PAGE_SIZE = 0x1000;
+static void append(std::string& out, const void* bytes, size_t size) {
+    out.append(static_cast<const char*>(bytes), size);
+}
+static void pad_to(std::string& out, size_t alignment) {
+    while (out.size() % alignment != 0) out.push_back('\0');
+}
+static size_t align_up(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+static size_t add_string(std::string& table, const std::string& name) {
+    size_t offset = table.size();
+    table += name;
+    table.push_back('\0');
+    return offset;
+}
+static Elf64_Half section_index(ObjSection section) {
+    switch (section) {
+        case ObjSection::Text: return 1;
+        case ObjSection::Data: return 2;
+        case ObjSection::Bss:  return 3;
+        default:               return SHN_UNDEF;
+    }
+}
+static unsigned int reloc_type(ObjRelocType type) {
+    switch (type) {
+        case ObjRelocType::Abs64: return R_X86_64_64;
+        case ObjRelocType::Pc32:  return R_X86_64_PC32;
+        case ObjRelocType::Plt32: return R_X86_64_PLT32;
+    }
+    return R_X86_64_NONE;
+}
+static void init_ehdr(Elf64_Ehdr& ehdr, Elf64_Half type) {
+    memset(&ehdr, 0, sizeof(ehdr));
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = type;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+}
+static Elf64_Shdr make_shdr(size_t name, Elf64_Word type, Elf64_Xword flags, size_t offset,
+                            size_t size, size_t align) {
+    Elf64_Shdr shdr;
+    memset(&shdr, 0, sizeof(shdr));
+    shdr.sh_name = name;
+    shdr.sh_type = type;
+    shdr.sh_flags = flags;
+    shdr.sh_offset = offset;
+    shdr.sh_size = size;
+    shdr.sh_addralign = align;
+    return shdr;
+}
+void write_elf_object(const ObjectFile& obj, std::string& output) {
+    std::string strtab(1, '\0');
+    std::vector<Elf64_Sym> symbols(4);
+    memset(symbols.data(), 0, sizeof(Elf64_Sym) * symbols.size());
+    for (int i = 1; i <= 3; i++) {
+        symbols[i].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+        symbols[i].st_shndx = i;
+    }
+    // Local symbols have to come before all global ones
+    std::vector<const ObjSymbol*> order;
+    for (const ObjSymbol& s : obj.symbols) {
+        if (s.is_local) order.push_back(&s);
+    }
+    size_t first_global = symbols.size() + order.size();
+    for (const ObjSymbol& s : obj.symbols) {
+        if (!s.is_local) order.push_back(&s);
+    }
+    std::map<std::string, size_t> symbol_index;
+    for (const ObjSymbol* s : order) {
+        Elf64_Sym sym;
+        memset(&sym, 0, sizeof(sym));
+        sym.st_name = add_string(strtab, s->name);
+        sym.st_info = ELF64_ST_INFO(s->is_local ? STB_LOCAL : STB_GLOBAL, s->is_func ? STT_FUNC : STT_OBJECT);
+        sym.st_shndx = section_index(s->section);
+        sym.st_value = s->offset;
+        sym.st_size = s->size;
+        symbol_index[s->name] = symbols.size();
+        symbols.push_back(sym);
+    }
+    for (const ObjReloc& r : obj.relocs) {
+        if (r.symbol.empty() || symbol_index.count(r.symbol)) continue;
+        Elf64_Sym sym;
+        memset(&sym, 0, sizeof(sym));
+        sym.st_name = add_string(strtab, r.symbol);
+        sym.st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+        sym.st_shndx = SHN_UNDEF;
+        symbol_index[r.symbol] = symbols.size();
+        symbols.push_back(sym);
+    }
+    std::vector<Elf64_Rela> rela_text;
+    std::vector<Elf64_Rela> rela_data;
+    for (const ObjReloc& r : obj.relocs) {
+        Elf64_Rela rela;
+        size_t sym = r.symbol.empty() ? section_index(r.target_section) : symbol_index[r.symbol];
+        rela.r_offset = r.offset;
+        rela.r_info = ELF64_R_INFO(sym, reloc_type(r.type));
+        rela.r_addend = r.addend;
+        if (r.section == ObjSection::Text) {
+            rela_text.push_back(rela);
+        } else {
+            rela_data.push_back(rela);
+        }
+    }
+    std::string shstrtab(1, '\0');
+    std::vector<Elf64_Shdr> sections(1);
+    memset(&sections[0], 0, sizeof(Elf64_Shdr));
+    output.clear();
+    Elf64_Ehdr ehdr;
+    init_ehdr(ehdr, ET_REL);
+    append(output, &ehdr, sizeof(ehdr));
+    pad_to(output, 16);
+    sections.push_back(make_shdr(add_string(shstrtab, ".text"), SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR,
+                                 output.size(), obj.text.size(), 16));
+    append(output, obj.text.data(), obj.text.size());
+    pad_to(output, 8);
+    sections.push_back(make_shdr(add_string(shstrtab, ".data"), SHT_PROGBITS, SHF_ALLOC | SHF_WRITE,
+                                 output.size(), obj.data.size(), 8));
+    append(output, obj.data.data(), obj.data.size());
+    sections.push_back(make_shdr(add_string(shstrtab, ".bss"), SHT_NOBITS, SHF_ALLOC | SHF_WRITE,
+                                 output.size(), obj.bss_size, 8));
+    pad_to(output, 8);
+    Elf64_Shdr text_rela = make_shdr(add_string(shstrtab, ".rela.text"), SHT_RELA, SHF_INFO_LINK,
+                                     output.size(), rela_text.size() * sizeof(Elf64_Rela), 8);
+    text_rela.sh_link = 6;
+    text_rela.sh_info = 1;
+    text_rela.sh_entsize = sizeof(Elf64_Rela);
+    sections.push_back(text_rela);
+    append(output, rela_text.data(), rela_text.size() * sizeof(Elf64_Rela));
+    Elf64_Shdr data_rela = make_shdr(add_string(shstrtab, ".rela.data"), SHT_RELA, SHF_INFO_LINK,
+                                     output.size(), rela_data.size() * sizeof(Elf64_Rela), 8);
+    data_rela.sh_link = 6;
+    data_rela.sh_info = 2;
+    data_rela.sh_entsize = sizeof(Elf64_Rela);
+    sections.push_back(data_rela);
+    append(output, rela_data.data(), rela_data.size() * sizeof(Elf64_Rela));
+    Elf64_Shdr symtab = make_shdr(add_string(shstrtab, ".symtab"), SHT_SYMTAB, 0,
+                                  output.size(), symbols.size() * sizeof(Elf64_Sym), 8);
+    symtab.sh_link = 7;
+    symtab.sh_info = first_global;
+    symtab.sh_entsize = sizeof(Elf64_Sym);
+    sections.push_back(symtab);
+    append(output, symbols.data(), symbols.size() * sizeof(Elf64_Sym));
+    sections.push_back(make_shdr(add_string(shstrtab, ".strtab"), SHT_STRTAB, 0,
+                                 output.size(), strtab.size(), 1));
+    output += strtab;
+    size_t shstrtab_name = add_string(shstrtab, ".shstrtab");
+    size_t note_name = add_string(shstrtab, ".note.GNU-stack");
+    sections.push_back(make_shdr(shstrtab_name, SHT_STRTAB, 0, output.size(), shstrtab.size(), 1));
+    output += shstrtab;
+    sections.push_back(make_shdr(note_name, SHT_PROGBITS, 0, output.size(), 0, 1));
+    pad_to(output, 8);
+    Elf64_Ehdr* header = reinterpret_cast<Elf64_Ehdr*>(&output[0]);
+    header->e_shoff = output.size();
+    header->e_shentsize = sizeof(Elf64_Shdr);
+    header->e_shnum = sections.size();
+    header->e_shstrndx = 8;
+    append(output, sections.data(), sections.size() * sizeof(Elf64_Shdr));
+}
+// _start: xor ebp, ebp; mov rdi, [rsp]; lea rsi, [rsp+8]; call main;
+//         mov rdi, rax; mov eax, 60; syscall
+static const unsigned char START_STUB[] = {
+    0x31, 0xED,
+    0x48, 0x8B, 0x3C, 0x24,
+    0x48, 0x8D, 0x74, 0x24, 0x08,
+    0xE8, 0x00, 0x00, 0x00, 0x00,
+    0x48, 0x89, 0xC7,
+    0xB8, 0x3C, 0x00, 0x00, 0x00,
+    0x0F, 0x05
+};
+static const size_t START_CALL_OFFSET = 12;
+// Text, data and the PT_GNU_STACK header that keeps the stack non-executable
+static const size_t EXEC_PHDRS = 3;
+static void patch(std::string& output, size_t at, unsigned long long value, size_t size) {
+    for (size_t i = 0; i < size; i++) output[at + i] = static_cast<char>(value >> (8 * i));
+}
+bool write_elf_executable(const ObjectFile& obj, std::string& output) {
+    size_t headers = sizeof(Elf64_Ehdr) + EXEC_PHDRS * sizeof(Elf64_Phdr);
+    size_t stub_offset = align_up(headers, 16);
+    size_t text_offset = align_up(stub_offset + sizeof(START_STUB), 16);
+    size_t text_end = text_offset + obj.text.size();
+    size_t data_offset = align_up(text_end, PAGE_SIZE);
+    size_t bss_offset = data_offset + align_up(obj.data.size(), 8);
+    Elf64_Addr section_base[4] = {0, EXEC_BASE + text_offset, EXEC_BASE + data_offset, EXEC_BASE + bss_offset};
+    size_t file_offset[4] = {0, text_offset, data_offset, 0};
+    std::map<std::string, Elf64_Addr> addresses;
+    for (const ObjSymbol& s : obj.symbols) {
+        addresses[s.name] = section_base[static_cast<int>(s.section)] + s.offset;
+    }
+    std::set<std::string> undefined;
+    if (!addresses.count("main")) undefined.insert("main");
+    for (const ObjReloc& r : obj.relocs) {
+        if (!r.symbol.empty() && !addresses.count(r.symbol)) undefined.insert(r.symbol);
+    }
+    if (!undefined.empty()) {
+        for (const std::string& name : undefined) {
+            fprintf(stderr, "ERROR: undefined symbol '%s' in a static executable\n", name.c_str());
+        }
+        return false;
+    }
+    output.assign(data_offset + obj.data.size(), '\0');
+    memcpy(&output[stub_offset], START_STUB, sizeof(START_STUB));
+    memcpy(&output[text_offset], obj.text.data(), obj.text.size());
+    memcpy(&output[data_offset], obj.data.data(), obj.data.size());
+    Elf64_Addr call_next = EXEC_BASE + stub_offset + START_CALL_OFFSET + 4;
+    patch(output, stub_offset + START_CALL_OFFSET, addresses["main"] - call_next, 4);
+    for (const ObjReloc& r : obj.relocs) {
+        Elf64_Addr target = r.symbol.empty() ? section_base[static_cast<int>(r.target_section)]
+                                             : addresses[r.symbol];
+        Elf64_Addr place = section_base[static_cast<int>(r.section)] + r.offset;
+        size_t at = file_offset[static_cast<int>(r.section)] + r.offset;
+        if (r.type == ObjRelocType::Abs64) {
+            patch(output, at, target + r.addend, 8);
+            continue;
+        }
+        long long rel = static_cast<long long>(target + r.addend - place);
+        if (rel < -2147483648LL || rel > 2147483647LL) {
+            fprintf(stderr, "ERROR: relocation against '%s' is out of range\n", r.symbol.c_str());
+            return false;
+        }
+        patch(output, at, static_cast<unsigned long long>(rel), 4);
+    }
+    Elf64_Ehdr ehdr;
+    init_ehdr(ehdr, ET_EXEC);
+    ehdr.e_entry = EXEC_BASE + stub_offset;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = EXEC_PHDRS;
+    memcpy(&output[0], &ehdr, sizeof(ehdr));
+    Elf64_Phdr phdrs[EXEC_PHDRS];
+    memset(phdrs, 0, sizeof(phdrs));
+    phdrs[0].p_type = PT_LOAD;
+    phdrs[0].p_flags = PF_R | PF_X;
+    phdrs[0].p_offset = 0;
+    phdrs[0].p_vaddr = EXEC_BASE;
+    phdrs[0].p_paddr = EXEC_BASE;
+    phdrs[0].p_filesz = text_end;
+    phdrs[0].p_memsz = text_end;
+    phdrs[0].p_align = PAGE_SIZE;
+    phdrs[1].p_type = PT_LOAD;
+    phdrs[1].p_flags = PF_R | PF_W;
+    phdrs[1].p_offset = data_offset;
+    phdrs[1].p_vaddr = EXEC_BASE + data_offset;
+    phdrs[1].p_paddr = EXEC_BASE + data_offset;
+    phdrs[1].p_filesz = obj.data.size();
+    phdrs[1].p_memsz = bss_offset - data_offset + obj.bss_size;
+    phdrs[1].p_align = PAGE_SIZE;
+    phdrs[2].p_type = PT_GNU_STACK;
+    phdrs[2].p_flags = PF_R | PF_W;
+    phdrs[2].p_align = 16;
+    memcpy(&output[sizeof(Elf64_Ehdr)], phdrs, sizeof(phdrs));
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef ELF64_H
+#define ELF64_H
+
+#include <string>
+#include <vector>
+
+// Sections of a generated object, in their ELF section header order
+enum class ObjSection {
+    Undefined,
+    Text,
+    Data,
+    Bss
+};
+
+struct ObjSymbol {
+    std::string name;
+    ObjSection section;
+    size_t offset;
+    size_t size;
+    bool is_func;
+    bool is_local;
+};
+
+enum class ObjRelocType {
+    Abs64,  // R_X86_64_64
+    Pc32,   // R_X86_64_PC32
+    Plt32   // R_X86_64_PLT32
+};
+
+// Patch at section+offset. An empty symbol name refers to the start of
+// target_section instead of a named symbol
+struct ObjReloc {
+    ObjSection section;
+    size_t offset;
+    ObjRelocType type;
+    std::string symbol;
+    ObjSection target_section;
+    long long addend;
+};
+
+// Machine code and data of one translation unit, ready to be written as a
+// relocatable object or linked into an executable
+struct ObjectFile {
+    std::vector<unsigned char> text;
+    std::vector<unsigned char> data;
+    size_t bss_size;
+    std::vector<ObjSymbol> symbols;  // Defined symbols
+    std::vector<ObjReloc> relocs;
+
+    ObjectFile() : bss_size(0) {}
+};
+
+// ELF64 relocatable object for x86-64
+void write_elf_object(const ObjectFile& obj, std::string& output);
+
+// Static x86-64 Linux executable that enters at a small _start stub
+// calling main and passing its result to exit. Fails on undefined symbols
+bool write_elf_executable(const ObjectFile& obj, std::string& output);
+
+#endif // ELF64_H
@@ -0,0 +1,288 @@
+#include "fasm.h"
+#include <cstdio>
+#include <set>
+static const char* const REG_NAMES[16] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+};
+static const char* const BYTE_REG_NAMES[16] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+};
+static const char* cond_suffix(Cond cond) {
+    switch (cond) {
+        case Cond::B:  return "b";
+        case Cond::AE: return "ae";
+        case Cond::E:  return "e";
+        case Cond::NE: return "ne";
+        case Cond::L:  return "l";
+        case Cond::GE: return "ge";
+        case Cond::LE: return "le";
+        case Cond::G:  return "g";
+    }
+    return "e";
+}
+static const char* mnemonic(X86Opcode opcode) {
+    switch (opcode) {
+        case X86Opcode::Mov:   return "mov";
+        case X86Opcode::Lea:   return "lea";
+        case X86Opcode::Add:   return "add";
+        case X86Opcode::Sub:   return "sub";
+        case X86Opcode::Imul:  return "imul";
+        case X86Opcode::And:   return "and";
+        case X86Opcode::Or:    return "or";
+        case X86Opcode::Shl:   return "shl";
+        case X86Opcode::Shr:   return "shr";
+        case X86Opcode::Sar:   return "sar";
+        case X86Opcode::Neg:   return "neg";
+        case X86Opcode::Cmp:   return "cmp";
+        case X86Opcode::Test:  return "test";
+        case X86Opcode::Cqo:   return "cqo";
+        case X86Opcode::Idiv:  return "idiv";
+        case X86Opcode::Movzx: return "movzx";
+        case X86Opcode::Jmp:   return "jmp";
+        case X86Opcode::Call:  return "call";
+        case X86Opcode::Ret:   return "ret";
+        case X86Opcode::Push:  return "push";
+        case X86Opcode::Pop:   return "pop";
+        case X86Opcode::MovByte: return "mov";
+        case X86Opcode::Bsf:   return "bsf";
+        case X86Opcode::Bsr:   return "bsr";
+        case X86Opcode::Bswap: return "bswap";
+        case X86Opcode::Rol:   return "rol";
+        case X86Opcode::Ror:   return "ror";
+        case X86Opcode::Leave: return "leave";
+        case X86Opcode::RepMovsb: return "rep movsb";
+        case X86Opcode::RepStosb: return "rep stosb";
+        default:               return "";
+    }
+}
+void FasmGenerator::dump_operand(const Operand& operand, bool sized) {
+    char buf[64];
+    switch (operand.kind) {
+        case OperandKind::None:
+            break;
+        case OperandKind::Reg:
+            output += REG_NAMES[static_cast<int>(operand.reg)];
+            break;
+        case OperandKind::Imm:
+            snprintf(buf, sizeof(buf), "%lld", operand.value);
+            output += buf;
+            break;
+        case OperandKind::Mem:
+            if (sized) output += "qword ";
+            output += "[";
+            if (operand.symbol.empty()) {
+                output += REG_NAMES[static_cast<int>(operand.reg)];
+                if (operand.scale != 0) {
+                    output += "+";
+                    output += REG_NAMES[static_cast<int>(operand.index)];
+                }
+                if (operand.scale > 1) {
+                    snprintf(buf, sizeof(buf), "*%u", operand.scale);
+                    output += buf;
+                }
+            } else {
+                output += operand.symbol;
+            }
+            if (operand.value != 0) {
+                snprintf(buf, sizeof(buf), "%+lld", operand.value);
+                output += buf;
+            }
+            output += "]";
+            break;
+        case OperandKind::Label:
+            snprintf(buf, sizeof(buf), ".L%zu", operand.label);
+            output += label_scope;
+            output += buf;
+            break;
+        case OperandKind::Symbol:
+            output += operand.symbol;
+            break;
+    }
+}
+void FasmGenerator::generate_inst(const X86Inst& inst) {
+    switch (inst.opcode) {
+        case X86Opcode::Label:
+            dump_operand(inst.dst, false);
+            output += ":\n";
+            return;
+        case X86Opcode::Raw:
+            output += "    ";
+            output += inst.text;
+            output += "\n";
+            return;
+        case X86Opcode::Setcc:
+            output += "    set";
+            output += cond_suffix(inst.cond);
+            output += " ";
+            output += BYTE_REG_NAMES[static_cast<int>(inst.dst.reg)];
+            output += "\n";
+            return;
+        case X86Opcode::Jcc:
+            output += "    j";
+            output += cond_suffix(inst.cond);
+            output += " ";
+            dump_operand(inst.dst, false);
+            output += "\n";
+            return;
+        case X86Opcode::Cmovcc:
+            output += "    cmov";
+            output += cond_suffix(inst.cond);
+            output += " ";
+            dump_operand(inst.dst, false);
+            output += ", ";
+            dump_operand(inst.src, true);
+            output += "\n";
+            return;
+        default:
+            break;
+    }
+    output += "    ";
+    output += mnemonic(inst.opcode);
+    if (inst.dst.kind == OperandKind::None) {
+        output += "\n";
+        return;
+    }
+    bool bytes = inst.opcode == X86Opcode::Movzx || inst.opcode == X86Opcode::MovByte;
+    bool sized = inst.opcode != X86Opcode::Lea && !bytes;
+    output += " ";
+    if (inst.dst.kind == OperandKind::Mem && bytes) output += "byte ";
+    dump_operand(inst.dst, sized);
+    if (inst.src.kind != OperandKind::None) {
+        output += ", ";
+        bool shift = inst.opcode == X86Opcode::Shl || inst.opcode == X86Opcode::Shr ||
+                     inst.opcode == X86Opcode::Sar || inst.opcode == X86Opcode::Rol ||
+                     inst.opcode == X86Opcode::Ror;
+        if (inst.src.kind == OperandKind::Reg && (bytes || shift)) {
+            output += BYTE_REG_NAMES[static_cast<int>(inst.src.reg)];
+        } else if (inst.src.kind == OperandKind::Mem && bytes) {
+            output += "byte ";
+            dump_operand(inst.src, false);
+        } else {
+            dump_operand(inst.src, sized);
+        }
+    }
+    output += "\n";
+}
+void FasmGenerator::generate_func(const X86Func& func) {
+    output += x86_symbol(func.name);
+    output += ":\n";
+    for (size_t i = 0; i < func.cold_begin; i++) {
+        generate_inst(func.code[i]);
+    }
+}
+void FasmGenerator::generate_cold_code(const X86Func& func) {
+    label_scope = x86_symbol(func.name);
+    for (size_t i = func.cold_begin; i < func.code.size(); i++) {
+        generate_inst(func.code[i]);
+    }
+    label_scope.clear();
+}
+void FasmGenerator::generate_globals(const std::vector<Global>& globals) {
+    char buf[128];
+    for (size_t i = 0; i < globals.size(); i++) {
+        const Global& global = globals[i];
+        std::string sym = x86_symbol(global.name);
+        output += sym;
+        output += ":\n";
+        if (global.is_vec) {
+            output += "    dq ";
+            output += sym;
+            output += "+8\n";
+        }
+        for (size_t j = 0; j < global.values.size(); j++) {
+            const ImmediateValue& val = global.values[j];
+            output += "    dq ";
+            switch (val.type) {
+                case ImmediateValueType::Literal:
+                    snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(val.literal));
+                    output += buf;
+                    break;
+                case ImmediateValueType::Name:
+                    output += x86_symbol(val.name);
+                    break;
+                case ImmediateValueType::DataOffset:
+                    snprintf(buf, sizeof(buf), "%s+%zu", X86_DATA_SYMBOL, val.offset);
+                    output += buf;
+                    break;
+            }
+            output += "\n";
+        }
+        size_t words = global.values.size();
+        size_t wanted = global.is_vec ? global.minimum_size : 1;
+        if (words < wanted) {
+            snprintf(buf, sizeof(buf), "    dq %zu dup 0\n", wanted - words);
+            output += buf;
+        }
+    }
+}
+void FasmGenerator::generate_jump_tables(const X86Func& func) {
+    char buf[64];
+    for (size_t i = 0; i < func.tables.size(); i++) {
+        const X86JumpTable& table = func.tables[i];
+        output += table.symbol;
+        output += ":\n";
+        for (size_t j = 0; j < table.labels.size(); j++) {
+            snprintf(buf, sizeof(buf), ".L%zu\n", table.labels[j]);
+            output += "    dq ";
+            output += x86_symbol(func.name);
+            output += buf;
+        }
+    }
+}
+void FasmGenerator::generate_data_section(const std::vector<unsigned char>& data) {
+    output += X86_DATA_SYMBOL;
+    output += ":\n";
+    const size_t ROW_SIZE = 16;
+    for (size_t i = 0; i < data.size(); i += ROW_SIZE) {
+        output += "    db ";
+        for (size_t j = i; j < i + ROW_SIZE && j < data.size(); j++) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), j == i ? "%u" : ",%u", static_cast<unsigned int>(data[j]));
+            output += buf;
+        }
+        output += "\n";
+    }
+}
+void FasmGenerator::generate_program(const Compiler& c, const X86Program& program) {
+    output.clear();
+    output += "format ELF64\n\n";
+    std::set<std::string> defined;
+    std::set<std::string> exported;
+    for (size_t i = 0; i < c.funcs.size(); i++) {
+        defined.insert(c.funcs[i].name);
+        if (!c.funcs[i].local) exported.insert(c.funcs[i].name);
+    }
+    for (size_t i = 0; i < c.globals.size(); i++) {
+        defined.insert(c.globals[i].name);
+        exported.insert(c.globals[i].name);
+    }
+    for (const std::string& name : exported) {
+        output += "public " + x86_symbol(name) + " as '" + name + "'\n";
+    }
+    for (size_t i = 0; i < c.extrns.size(); i++) {
+        if (defined.count(c.extrns[i])) continue;
+        defined.insert(c.extrns[i]);
+        output += "extrn '" + c.extrns[i] + "' as " + x86_symbol(c.extrns[i]) + "\n";
+    }
+    output += "\nsection '.text' executable\n\n";
+    for (size_t i = 0; i < program.funcs.size(); i++) {
+        generate_func(program.funcs[i]);
+    }
+    bool cold = false;
+    for (size_t i = 0; i < program.funcs.size(); i++) {
+        const X86Func& func = program.funcs[i];
+        if (func.cold_begin == func.code.size()) continue;
+        if (!cold) output += "\nsection '.text.cold' executable\n\n";
+        cold = true;
+        generate_cold_code(func);
+    }
+    output += "\nsection '.data' writeable align 8\n\n";
+    generate_globals(c.globals);
+    for (size_t i = 0; i < program.funcs.size(); i++) {
+        generate_jump_tables(program.funcs[i]);
+    }
+    generate_data_section(c.data);
+    output += "\nsection '.note.GNU-stack'\n";
+}
@@ -0,0 +1,28 @@
+#ifndef FASM_H
+#define FASM_H
+
+#include "compiler.h"
+#include "x86_64.h"
+#include <string>
+
+// Prints a lowered program as fasm source for an ELF64 object file
+class FasmGenerator {
+public:
+    std::string output;
+
+    void generate_program(const Compiler& c, const X86Program& program);
+
+private:
+    void generate_func(const X86Func& func);
+    void generate_cold_code(const X86Func& func);
+    void generate_inst(const X86Inst& inst);
+    void generate_globals(const std::vector<Global>& globals);
+    void generate_jump_tables(const X86Func& func);
+    void generate_data_section(const std::vector<unsigned char>& data);
+
+    void dump_operand(const Operand& operand, bool sized);
+
+    std::string label_scope;  // Qualifies labels printed outside their function
+};
+
+#endif
@@ -0,0 +1,170 @@
+#include "opt.h"
+#include "analysis.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <map>
+#include <set>
+struct Reachability {
+    const Compiler& c;
+    std::map<std::string, size_t> funcs;
+    std::map<std::string, size_t> globals;
+    std::set<std::string> names;
+    std::set<size_t> literals;
+    std::vector<std::string> worklist;
+
+    explicit Reachability(const Compiler& compiler) : c(compiler) {}
+    void reach(const std::string& name);
+    void reach_arg(const Arg& arg);
+    void reach_asm(const std::string& text);
+    void reach_func(const Func& func);
+    void reach_global(const Global& global);
+    void run();
+};
+void Reachability::reach(const std::string& name) {
+    if (names.insert(name).second) worklist.push_back(name);
+}
+void Reachability::reach_arg(const Arg& arg) {
+    if (arg.type == ArgType::External || arg.type == ArgType::RefExternal) reach(arg.name);
+    if (arg.type == ArgType::DataOffset) literals.insert(arg.offset);
+}
+// Inline assembly may name any symbol, mangled or not
+void Reachability::reach_asm(const std::string& text) {
+    size_t i = 0;
+    while (i < text.size()) {
+        unsigned char ch = static_cast<unsigned char>(text[i]);
+        if (!isalpha(ch) && ch != '_') {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < text.size() && (isalnum(static_cast<unsigned char>(text[i])) || text[i] == '_')) i++;
+        std::string word = text.substr(start, i - start);
+        if (funcs.count(word) || globals.count(word)) reach(word);
+        if (word[0] == '_') {
+            std::string unmangled = word.substr(1);
+            if (funcs.count(unmangled) || globals.count(unmangled)) reach(unmangled);
+        }
+    }
+}
+void Reachability::reach_func(const Func& func) {
+    for (const OpWithLocation& owl : func.body) {
+        const Op& op = owl.opcode;
+        std::vector<const Arg*> args;
+        op_args(op, args);
+        for (const Arg* arg : args) reach_arg(*arg);
+        if (op.type == OpType::ExternalAssign) reach(op.name);
+        if (op.type == OpType::Asm) {
+            for (const std::string& text : op.asm_args) reach_asm(text);
+        }
+    }
+}
+void Reachability::reach_global(const Global& global) {
+    for (const ImmediateValue& value : global.values) {
+        if (value.type == ImmediateValueType::Name) reach(value.name);
+        if (value.type == ImmediateValueType::DataOffset) literals.insert(value.offset);
+    }
+}
+void Reachability::run() {
+    while (!worklist.empty()) {
+        std::string name = worklist.back();
+        worklist.pop_back();
+        auto f = funcs.find(name);
+        if (f != funcs.end()) reach_func(c.funcs[f->second]);
+        auto g = globals.find(name);
+        if (g != globals.end()) reach_global(c.globals[g->second]);
+    }
+}
+static bool reversed_less(const std::string& a, const std::string& b) {
+    return std::lexicographical_compare(a.rbegin(), a.rend(), b.rbegin(), b.rend());
+}
+static bool is_suffix(const std::string& a, const std::string& b) {
+    return a.size() <= b.size() && std::equal(a.rbegin(), a.rend(), b.rbegin());
+}
+// Lays out the referenced literals sorted by their reversed bytes, where a
+// literal ending another one directly after it is placed inside it, and
+// remaps offsets to the new layout
+static void layout_data(Compiler& c, const std::set<size_t>& used) {
+    std::vector<std::string> literals;
+    for (const auto& entry : c.strings) {
+        if (used.count(entry.second)) literals.push_back(entry.first + '\0');
+    }
+    std::sort(literals.begin(), literals.end(), reversed_less);
+    std::vector<size_t> host(literals.size());
+    for (size_t i = literals.size(); i-- > 0;) {
+        host[i] = i + 1 < literals.size() && is_suffix(literals[i], literals[i + 1]) ? host[i + 1] : i;
+    }
+    std::vector<unsigned char> data;
+    std::vector<size_t> offsets(literals.size());
+    for (size_t i = 0; i < literals.size(); i++) {
+        if (host[i] != i) continue;
+        offsets[i] = data.size();
+        data.insert(data.end(), literals[i].begin(), literals[i].end());
+    }
+    std::map<size_t, size_t> moved;
+    std::unordered_map<std::string, size_t> strings;
+    for (size_t i = 0; i < literals.size(); i++) {
+        const std::string& outer = literals[host[i]];
+        offsets[i] = offsets[host[i]] + outer.size() - literals[i].size();
+        std::string content = literals[i].substr(0, literals[i].size() - 1);
+        moved[c.strings[content]] = offsets[i];
+        strings[content] = offsets[i];
+    }
+    for (Func& func : c.funcs) {
+        for (OpWithLocation& owl : func.body) {
+            std::vector<Arg*> args;
+            op_args(owl.opcode, args);
+            for (Arg* arg : args) {
+                if (arg->type == ArgType::DataOffset) arg->offset = moved[arg->offset];
+            }
+        }
+    }
+    for (Global& global : c.globals) {
+        for (ImmediateValue& value : global.values) {
+            if (value.type == ImmediateValueType::DataOffset) value.offset = moved[value.offset];
+        }
+    }
+    c.data.swap(data);
+    c.strings.swap(strings);
+}
+bool eliminate_dead_globals(Compiler& c, const OptOptions& options) {
+    Reachability r(c);
+    for (size_t i = 0; i < c.funcs.size(); i++) r.funcs[c.funcs[i].name] = i;
+    for (size_t i = 0; i < c.globals.size(); i++) r.globals[c.globals[i].name] = i;
+    if (r.funcs.count("main")) {
+        r.reach("main");
+    } else {
+        for (const Func& func : c.funcs) r.reach(func.name);
+        for (const Global& global : c.globals) r.reach(global.name);
+    }
+    r.run();
+    std::vector<Func> funcs;
+    for (const Func& func : c.funcs) {
+        if (r.names.count(func.name)) funcs.push_back(func);
+    }
+    std::vector<Global> globals;
+    for (const Global& global : c.globals) {
+        if (r.names.count(global.name)) globals.push_back(global);
+    }
+    std::vector<std::string> extrns;
+    for (const std::string& name : c.extrns) {
+        if (r.names.count(name)) extrns.push_back(name);
+    }
+    size_t dead_funcs = c.funcs.size() - funcs.size();
+    size_t dead_globals = c.globals.size() - globals.size();
+    size_t dead_extrns = c.extrns.size() - extrns.size();
+    c.funcs.swap(funcs);
+    c.globals.swap(globals);
+    c.extrns.swap(extrns);
+    size_t data_size = c.data.size();
+    layout_data(c, r.literals);
+    bool changed = dead_funcs + dead_globals + dead_extrns > 0;
+    if (options.report && changed) {
+        printf("INFO: removed %zu unreferenced functions, %zu globals and %zu extrns\n", dead_funcs,
+               dead_globals, dead_extrns);
+    }
+    if (options.report && c.data.size() < data_size) {
+        printf("INFO: data section shrank from %zu to %zu bytes\n", data_size, c.data.size());
+    }
+    return changed || c.data.size() < data_size;
+}
@@ -0,0 +1,369 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+enum class ExprKind {
+    Const,
+    RefAuto,
+    RefExternal,
+    Data,
+    Global,
+    Load,
+    Negate,
+    Not,
+    Binop,
+    Intrinsic
+};
+struct ExprKey {
+    ExprKind kind;
+    int binop;
+    unsigned long long a;
+    unsigned long long b;
+    unsigned long long c;
+    bool operator==(const ExprKey& o) const {
+        return kind == o.kind && binop == o.binop && a == o.a && b == o.b && c == o.c;
+    }
+};
+struct ExprKeyHash {
+    size_t operator()(const ExprKey& k) const {
+        unsigned long long h = static_cast<unsigned long long>(k.kind) * 0x9E3779B97F4A7C15ULL;
+        h ^= static_cast<unsigned long long>(k.binop) + 0x7F4A7C15ULL + (h << 6) + (h >> 2);
+        h ^= k.a + 0x9E3779B9ULL + (h << 6) + (h >> 2);
+        h ^= k.b + 0x9E3779B9ULL + (h << 6) + (h >> 2);
+        h ^= k.c + 0x9E3779B9ULL + (h << 6) + (h >> 2);
+        return static_cast<size_t>(h);
+    }
+};
+static ExprKey make_key(ExprKind kind, unsigned long long a, unsigned long long b = 0,
+                        int binop = 0, unsigned long long c = 0) {
+    ExprKey key;
+    key.kind = kind;
+    key.binop = binop;
+    key.a = a;
+    key.b = b;
+    key.c = c;
+    return key;
+}
+static bool is_commutative(Binop op) {
+    switch (op) {
+        case Binop::Plus:
+        case Binop::Mult:
+        case Binop::Equal:
+        case Binop::NotEqual:
+        case Binop::BitOr:
+        case Binop::BitAnd:
+            return true;
+        default:
+            return false;
+    }
+}
+static const size_t NO_VN = static_cast<size_t>(-1);
+class ValueNumbering {
+public:
+    ValueNumbering(Func& f) : func(f), next_vn(0), epoch(0), epoch_counter(0), replaced(0) {}
+    size_t run();
+
+private:
+    struct Undo {
+        bool is_slot;
+        ExprKey key;
+        size_t slot;
+        size_t old;
+    };
+
+    Func& func;
+    Cfg cfg;
+    DomTree dom;
+    BitSet escaped;
+    BitSet ssa;
+    std::vector<size_t> escaped_list;
+    std::vector<size_t> multi_def_list;
+    std::unordered_map<ExprKey, size_t, ExprKeyHash> table;
+    std::unordered_map<std::string, size_t> names;
+    std::vector<size_t> slot_vn;
+    std::vector<size_t> holder;
+    std::vector<Undo> undo;
+    size_t next_vn;
+    size_t epoch;
+    size_t epoch_counter;
+    size_t replaced;
+
+    size_t fresh_vn();
+    bool holds(size_t vn);
+    size_t name_id(const std::string& name);
+    void set_slot_vn(size_t slot, size_t vn);
+    size_t lookup(const ExprKey& key);
+    size_t slot_value(size_t slot);
+    size_t arg_value(const Arg& arg);
+    void clobber_memory();
+    void visit(size_t b);
+};
+size_t ValueNumbering::fresh_vn() {
+    holder.push_back(NO_VN);
+    return next_vn++;
+}
+bool ValueNumbering::holds(size_t vn) {
+    size_t h = holder[vn];
+    return h != NO_VN && slot_vn[h] == vn;
+}
+size_t ValueNumbering::name_id(const std::string& name) {
+    auto it = names.find(name);
+    if (it != names.end()) return it->second;
+    size_t id = names.size();
+    names[name] = id;
+    return id;
+}
+void ValueNumbering::set_slot_vn(size_t slot, size_t vn) {
+    Undo u;
+    u.is_slot = true;
+    u.slot = slot;
+    u.old = slot_vn[slot];
+    undo.push_back(u);
+    slot_vn[slot] = vn;
+}
+size_t ValueNumbering::lookup(const ExprKey& key) {
+    auto it = table.find(key);
+    if (it != table.end()) return it->second;
+    size_t vn = fresh_vn();
+    Undo u;
+    u.is_slot = false;
+    u.key = key;
+    undo.push_back(u);
+    table[key] = vn;
+    return vn;
+}
+size_t ValueNumbering::slot_value(size_t slot) {
+    if (slot_vn[slot] == NO_VN) {
+        set_slot_vn(slot, fresh_vn());
+    }
+    return slot_vn[slot];
+}
+size_t ValueNumbering::arg_value(const Arg& arg) {
+    switch (arg.type) {
+        case ArgType::AutoVar:
+            return slot_value(arg.index);
+        case ArgType::Deref:
+            return lookup(make_key(ExprKind::Load, slot_value(arg.index), epoch));
+        case ArgType::RefAutoVar:
+            return lookup(make_key(ExprKind::RefAuto, arg.index));
+        case ArgType::RefExternal:
+            return lookup(make_key(ExprKind::RefExternal, name_id(arg.name)));
+        case ArgType::External:
+            return lookup(make_key(ExprKind::Global, name_id(arg.name), epoch));
+        case ArgType::Literal:
+            return lookup(make_key(ExprKind::Const, arg.value));
+        case ArgType::DataOffset:
+            return lookup(make_key(ExprKind::Data, arg.offset));
+        default:
+            return fresh_vn();
+    }
+}
+void ValueNumbering::clobber_memory() {
+    epoch = ++epoch_counter;
+    for (size_t s : escaped_list) {
+        if (slot_vn[s] != NO_VN) set_slot_vn(s, NO_VN);
+    }
+}
+// -c and !c of a literal become copies of the folded value, so that copy
+// propagation carries it into its uses before LICM hoists it into a slot
+static bool fold_literal_unary(Op& op) {
+    if (op.type != OpType::Negate && op.type != OpType::UnaryNot) return false;
+    if (op.arg.type != ArgType::Literal) return false;
+    unsigned long long value = op.type == OpType::Negate ? 0 - op.arg.value : op.arg.value == 0;
+    op.type = OpType::AutoAssign;
+    op.index = op.result;
+    op.arg = Arg::make_literal(value);
+    return true;
+}
+void ValueNumbering::visit(size_t b) {
+    size_t undo_mark = undo.size();
+    size_t saved_epoch = epoch;
+    const BasicBlock& block = cfg.blocks[b];
+    bool exact = b != 0 && block.preds.size() == 1 && block.preds[0] == dom.idom[b];
+    if (b != 0 && !exact) {
+        epoch = ++epoch_counter;
+        for (size_t s : multi_def_list) {
+            if (slot_vn[s] != NO_VN) set_slot_vn(s, NO_VN);
+        }
+        for (size_t s : escaped_list) {
+            if (slot_vn[s] != NO_VN) set_slot_vn(s, NO_VN);
+        }
+    }
+    for (size_t i = block.begin; i < block.end; i++) {
+        Op& op = func.body[i].opcode;
+        if (fold_literal_unary(op)) replaced++;
+        switch (op.type) {
+            case OpType::Negate:
+            case OpType::UnaryNot:
+            case OpType::Binop: {
+                ExprKey key;
+                if (op.type == OpType::Binop) {
+                    size_t a = arg_value(op.arg);
+                    size_t c = arg_value(op.arg2);
+                    if (is_commutative(op.binop) && c < a) std::swap(a, c);
+                    key = make_key(ExprKind::Binop, a, c, static_cast<int>(op.binop) + 1);
+                } else {
+                    ExprKind kind = op.type == OpType::Negate ? ExprKind::Negate : ExprKind::Not;
+                    key = make_key(kind, arg_value(op.arg));
+                }
+                size_t dest;
+                op_defined_slot(op, dest);
+                size_t vn = lookup(key);
+                if (holds(vn) && holder[vn] != dest) {
+                    op.type = OpType::AutoAssign;
+                    op.index = dest;
+                    op.arg = Arg::make_auto_var(holder[vn]);
+                    replaced++;
+                    set_slot_vn(dest, vn);
+                } else {
+                    set_slot_vn(dest, vn);
+                    holder[vn] = dest;
+                }
+                break;
+            }
+            case OpType::AutoAssign: {
+                size_t vn = arg_value(op.arg);
+                set_slot_vn(op.index, vn);
+                if (!holds(vn)) holder[vn] = op.index;
+                break;
+            }
+            case OpType::Funcall: {
+                clobber_memory();
+                set_slot_vn(op.result, fresh_vn());
+                break;
+            }
+            case OpType::Intrinsic: {
+                if (intrinsic_writes_memory(op)) {
+                    clobber_memory();
+                    set_slot_vn(op.result, fresh_vn());
+                    break;
+                }
+                size_t a = arg_value(op.funcall_args[0]);
+                size_t c = op.funcall_args.size() > 1 ? arg_value(op.funcall_args[1]) : 0;
+                size_t vn = lookup(make_key(ExprKind::Intrinsic, a, c, static_cast<int>(op.intrinsic),
+                                            intrinsic_reads_memory(op) ? epoch : 0));
+                if (holds(vn) && holder[vn] != op.result) {
+                    size_t dest = op.result;
+                    op.type = OpType::AutoAssign;
+                    op.index = dest;
+                    op.arg = Arg::make_auto_var(holder[vn]);
+                    op.funcall_args.clear();
+                    replaced++;
+                    set_slot_vn(dest, vn);
+                } else {
+                    set_slot_vn(op.result, vn);
+                    holder[vn] = op.result;
+                }
+                break;
+            }
+            case OpType::Select:
+                set_slot_vn(op.index, fresh_vn());
+                break;
+            case OpType::Store:
+            case OpType::ExternalAssign:
+                clobber_memory();
+                break;
+            case OpType::Asm:
+                if (asm_clobbers_memory(op)) clobber_memory();
+                break;
+            default:
+                break;
+        }
+    }
+    for (size_t c : dom.children[b]) {
+        visit(c);
+    }
+    while (undo.size() > undo_mark) {
+        Undo& u = undo.back();
+        if (u.is_slot) {
+            slot_vn[u.slot] = u.old;
+        } else {
+            table.erase(u.key);
+        }
+        undo.pop_back();
+    }
+    epoch = saved_epoch;
+}
+size_t ValueNumbering::run() {
+    build_cfg(func, cfg);
+    if (cfg.blocks.empty()) return 0;
+    compute_dominators(cfg, dom);
+    escaped_slots(func, escaped);
+    single_def_slots(func, cfg, dom, escaped, ssa);
+    size_t slots = func.auto_vars_count + 1;
+    for (size_t s = 1; s < slots; s++) {
+        if (escaped.test(s)) {
+            escaped_list.push_back(s);
+        } else if (!ssa.test(s)) {
+            multi_def_list.push_back(s);
+        }
+    }
+    slot_vn.assign(slots, NO_VN);
+    visit(0);
+    return replaced;
+}
+static size_t propagate_copies(Func& func) {
+    Cfg cfg;
+    build_cfg(func, cfg);
+    if (cfg.blocks.empty()) return 0;
+    DomTree dom;
+    compute_dominators(cfg, dom);
+    BitSet escaped;
+    escaped_slots(func, escaped);
+    BitSet ssa;
+    single_def_slots(func, cfg, dom, escaped, ssa);
+    std::vector<size_t> order;
+    reverse_postorder(cfg, order);
+    std::vector<bool> has_subst(func.auto_vars_count + 1, false);
+    std::vector<Arg> subst(func.auto_vars_count + 1);
+    for (size_t b : order) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+            const Op& op = func.body[i].opcode;
+            if (op.type != OpType::AutoAssign || !ssa.test(op.index)) continue;
+            Arg src = op.arg;
+            if (src.type == ArgType::AutoVar && has_subst[src.index]) {
+                src = subst[src.index];
+            }
+            if (is_constant_arg(src) || (src.type == ArgType::AutoVar && ssa.test(src.index))) {
+                subst[op.index] = src;
+                has_subst[op.index] = true;
+            }
+        }
+    }
+    size_t count = 0;
+    std::vector<Arg*> args;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        Op& op = func.body[i].opcode;
+        op_args(op, args);
+        for (Arg* arg : args) {
+            if (arg->type != ArgType::AutoVar && arg->type != ArgType::Deref) continue;
+            if (!has_subst[arg->index]) continue;
+            const Arg& src = subst[arg->index];
+            if (arg->type == ArgType::AutoVar) {
+                *arg = src;
+                count++;
+            } else if (src.type == ArgType::AutoVar) {
+                arg->index = src.index;
+                count++;
+            }
+        }
+        if (op.type == OpType::Store && has_subst[op.index] &&
+            subst[op.index].type == ArgType::AutoVar) {
+            op.index = subst[op.index].index;
+            count++;
+        }
+    }
+    return count;
+}
+bool value_number(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    ValueNumbering vn(func);
+    size_t replaced = vn.run();
+    size_t propagated = propagate_copies(func);
+    if (options.report) {
+        printf("INFO: %s: value numbering replaced %zu expressions, propagated %zu copies\n",
+               func.name.c_str(), replaced, propagated);
+    }
+    return replaced > 0 || propagated > 0;
+}
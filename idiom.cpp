@@ -0,0 +1,327 @@
+#include "opt.h"
+#include "analysis.h"
+#include <algorithm>
+#include <cstdio>
+#include <set>
+static const unsigned long long IDIOM_MIN_WORDS = 16;
+static const char* const IDIOM_FILL = "memset";
+static const char* const IDIOM_COPY = "memmove";
+// What a slot set in the loop body holds this iteration
+enum class IdiomForm {
+    Other,
+    Constant,  // A literal
+    Offset,    // iv * 8
+    Address,   // base + iv * 8
+    Load       // The word at base + iv * 8
+};
+struct IdiomValue {
+    IdiomForm form;
+    Arg base;
+    unsigned long long value;
+
+    IdiomValue() : form(IdiomForm::Other), value(0) {}
+};
+// Counted loop storing one word per iteration at dst + iv * 8: either a
+// literal or the word at src + iv * 8
+struct WordLoop {
+    CountedLoop loop;
+    Arg dst;
+    bool copy;
+    Arg src;
+    unsigned long long value;
+};
+class IdiomMatcher {
+public:
+    IdiomMatcher(const Func& f, const Cfg& c, const LoopInfo& i, const Liveness& lv, const BitSet& e)
+        : func(f), cfg(c), info(i), live(lv), escaped(e) {}
+    bool match(size_t l, WordLoop& word);
+
+private:
+    const Func& func;
+    const Cfg& cfg;
+    const LoopInfo& info;
+    const Liveness& live;
+    const BitSet& escaped;
+    std::vector<IdiomValue> values;
+
+    bool invariant_base(const Arg& arg, const CountedLoop& loop) const;
+    const IdiomValue& value_of(const Arg& arg) const;
+    IdiomValue evaluate(const Op& op, const CountedLoop& loop) const;
+};
+bool IdiomMatcher::invariant_base(const Arg& arg, const CountedLoop& loop) const {
+    switch (arg.type) {
+        case ArgType::RefAutoVar:
+        case ArgType::RefExternal:
+        case ArgType::External:
+        case ArgType::DataOffset:
+        case ArgType::Literal:
+            return true;
+        case ArgType::AutoVar:
+            if (escaped.test(arg.index)) return false;
+            for (size_t i = loop.test + 1; i < loop.latch; i++) {
+                size_t def;
+                if (op_defined_slot(func.body[i].opcode, def) && def == arg.index) return false;
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+const IdiomValue& IdiomMatcher::value_of(const Arg& arg) const {
+    static const IdiomValue other;
+    if (arg.type != ArgType::AutoVar && arg.type != ArgType::Deref) return other;
+    return values[arg.index];
+}
+IdiomValue IdiomMatcher::evaluate(const Op& op, const CountedLoop& loop) const {
+    IdiomValue result;
+    bool iv_left = op.arg.type == ArgType::AutoVar && op.arg.index == loop.iv;
+    bool iv_right = op.arg2.type == ArgType::AutoVar && op.arg2.index == loop.iv;
+    if (op.type == OpType::Binop) {
+        bool eight_left = op.arg.type == ArgType::Literal && op.arg.value == 8;
+        bool eight_right = op.arg2.type == ArgType::Literal && op.arg2.value == 8;
+        bool three_right = op.arg2.type == ArgType::Literal && op.arg2.value == 3;
+        if ((op.binop == Binop::Mult && ((iv_left && eight_right) || (iv_right && eight_left))) ||
+            (op.binop == Binop::BitShl && iv_left && three_right)) {
+            result.form = IdiomForm::Offset;
+        } else if (op.binop == Binop::Plus && value_of(op.arg2).form == IdiomForm::Offset &&
+                   op.arg2.type == ArgType::AutoVar && invariant_base(op.arg, loop)) {
+            result.form = IdiomForm::Address;
+            result.base = op.arg;
+        } else if (op.binop == Binop::Plus && value_of(op.arg).form == IdiomForm::Offset &&
+                   op.arg.type == ArgType::AutoVar && invariant_base(op.arg2, loop)) {
+            result.form = IdiomForm::Address;
+            result.base = op.arg2;
+        }
+    } else if (op.type == OpType::AutoAssign) {
+        if (op.arg.type == ArgType::Literal) {
+            result.form = IdiomForm::Constant;
+            result.value = op.arg.value;
+        } else if (op.arg.type == ArgType::Deref && value_of(op.arg).form == IdiomForm::Address) {
+            result.form = IdiomForm::Load;
+            result.base = value_of(op.arg).base;
+        }
+    }
+    return result;
+}
+// Every op of the body must serve the store or the step, or set a slot
+// that is dead once the iteration ends
+bool IdiomMatcher::match(size_t l, WordLoop& word) {
+    CountedLoop& loop = word.loop;
+    if (!match_counted_loop(func, cfg, info, l, escaped, loop)) return false;
+    if (loop.step != 1 || (loop.cmp != Binop::Less && loop.cmp != Binop::LessEqual)) return false;
+    long long start;
+    if (loop.bound.type == ArgType::Literal && counted_loop_start(func, loop, start)) {
+        long long words = static_cast<long long>(loop.bound.value) - start;
+        if (loop.cmp == Binop::LessEqual) words++;
+        if (words < static_cast<long long>(IDIOM_MIN_WORDS)) return false;
+    }
+    const BitSet& carried = live.live_in[info.loops[l].header];
+    values.assign(func.auto_vars_count + 1, IdiomValue());
+    bool stored = false;
+    for (size_t i = loop.test + 1; i < loop.latch; i++) {
+        const Op& op = func.body[i].opcode;
+        if (i == loop.update) {
+            values.assign(func.auto_vars_count + 1, IdiomValue());
+            continue;
+        }
+        size_t def;
+        if (op_defined_slot(op, def)) {
+            if (escaped.test(def) || carried.test(def)) return false;
+            if (op.type == OpType::AutoAssign && op.arg.type == ArgType::Deref &&
+                value_of(op.arg).form != IdiomForm::Address) {
+                return false;
+            }
+            if (op.type == OpType::Funcall || op.type == OpType::Intrinsic) return false;
+            if (op.type == OpType::Binop && (op.binop == Binop::Div || op.binop == Binop::Mod)) return false;
+            values[def] = evaluate(op, loop);
+            continue;
+        }
+        if (op.type != OpType::Store || stored) return false;
+        const IdiomValue& address = values[op.index];
+        if (address.form != IdiomForm::Address) return false;
+        word.dst = address.base;
+        const IdiomValue& value = value_of(op.arg);
+        if (op.arg.type == ArgType::Literal) {
+            word.copy = false;
+            word.value = op.arg.value;
+        } else if (op.arg.type == ArgType::AutoVar && value.form == IdiomForm::Constant) {
+            word.copy = false;
+            word.value = value.value;
+        } else if ((op.arg.type == ArgType::Deref && value.form == IdiomForm::Address) ||
+                   (op.arg.type == ArgType::AutoVar && value.form == IdiomForm::Load)) {
+            word.copy = true;
+            word.src = value.base;
+        } else {
+            return false;
+        }
+        stored = true;
+    }
+    if (!stored) return false;
+    return word.copy || word.value == (word.value & 0xFF) * 0x0101010101010101ULL;
+}
+static void push_binop(std::vector<OpWithLocation>& body, size_t dest, const Arg& lhs, Binop binop, const Arg& rhs,
+                       const OpWithLocation& from) {
+    Op op;
+    op.type = OpType::Binop;
+    op.index = dest;
+    op.arg = lhs;
+    op.binop = binop;
+    op.arg2 = rhs;
+    push_op(body, op, from.loc);
+}
+static void push_branch(std::vector<OpWithLocation>& body, size_t label, const Arg& lhs, Binop binop,
+                        const Arg& rhs, const OpWithLocation& from) {
+    Op op;
+    op.type = OpType::CmpJmpIfNotLabel;
+    op.label = label;
+    op.arg = lhs;
+    op.binop = binop;
+    op.arg2 = rhs;
+    push_op(body, op, from.loc);
+}
+static void push_label(std::vector<OpWithLocation>& body, OpType type, size_t label, const OpWithLocation& from) {
+    Op op;
+    op.type = type;
+    op.label = label;
+    push_op(body, op, from.loc);
+}
+// Runs the kernel over the words the loop has left and sets iv to its
+// final value. A copy whose destination starts inside the source, or a
+// store range covering a global the loop reads its base from, takes the
+// original loop instead, which stays behind the call
+static void rewrite_word_loop(Func& func, const WordLoop& word, std::vector<OpWithLocation>& out) {
+    const CountedLoop& loop = word.loop;
+    const OpWithLocation& at = func.body[loop.test];
+    size_t loop_label = func.body[loop.header].opcode.label;
+    size_t exit = at.opcode.label;
+    size_t next_label = max_label_index(func);
+    Arg iv = Arg::make_auto_var(loop.iv);
+    out.push_back(at);
+    size_t bytes = ++func.auto_vars_count;
+    push_binop(out, bytes, loop.bound, Binop::Minus, iv, at);
+    if (loop.cmp == Binop::LessEqual) push_binop(out, bytes, Arg::make_auto_var(bytes), Binop::Plus, Arg::make_literal(1), at);
+    push_binop(out, bytes, Arg::make_auto_var(bytes), Binop::BitShl, Arg::make_literal(3), at);
+    size_t offset = ++func.auto_vars_count;
+    push_binop(out, offset, iv, Binop::BitShl, Arg::make_literal(3), at);
+    size_t dst = ++func.auto_vars_count;
+    push_binop(out, dst, word.dst, Binop::Plus, Arg::make_auto_var(offset), at);
+    size_t src = 0;
+    if (word.copy) {
+        src = ++func.auto_vars_count;
+        push_binop(out, src, word.src, Binop::Plus, Arg::make_auto_var(offset), at);
+        size_t safe = next_label++;
+        size_t end = ++func.auto_vars_count;
+        push_branch(out, safe, Arg::make_auto_var(src), Binop::Less, Arg::make_auto_var(dst), at);
+        push_binop(out, end, Arg::make_auto_var(src), Binop::Plus, Arg::make_auto_var(bytes), at);
+        push_branch(out, safe, Arg::make_auto_var(dst), Binop::Less, Arg::make_auto_var(end), at);
+        push_label(out, OpType::JmpLabel, loop_label, at);
+        push_label(out, OpType::Label, safe, at);
+    }
+    std::vector<std::string> globals;
+    if (word.dst.type == ArgType::External) globals.push_back(word.dst.name);
+    if (word.copy && word.src.type == ArgType::External) globals.push_back(word.src.name);
+    for (const std::string& name : globals) {
+        size_t safe = next_label++;
+        size_t end = ++func.auto_vars_count;
+        Arg global = Arg::make_ref_external(name);
+        push_branch(out, safe, Arg::make_auto_var(dst), Binop::LessEqual, global, at);
+        push_binop(out, end, Arg::make_auto_var(dst), Binop::Plus, Arg::make_auto_var(bytes), at);
+        push_branch(out, safe, global, Binop::Less, Arg::make_auto_var(end), at);
+        push_label(out, OpType::JmpLabel, loop_label, at);
+        push_label(out, OpType::Label, safe, at);
+    }
+    Op call;
+    call.type = OpType::Funcall;
+    call.result = ++func.auto_vars_count;
+    call.arg = Arg::make_external(word.copy ? IDIOM_COPY : IDIOM_FILL);
+    call.funcall_args.push_back(Arg::make_auto_var(dst));
+    if (word.copy) {
+        call.funcall_args.push_back(Arg::make_auto_var(src));
+    } else {
+        call.funcall_args.push_back(Arg::make_literal(word.value & 0xFF));
+    }
+    call.funcall_args.push_back(Arg::make_auto_var(bytes));
+    push_op(out, call, at.loc);
+    if (loop.cmp == Binop::LessEqual) {
+        push_binop(out, loop.iv, loop.bound, Binop::Plus, Arg::make_literal(1), at);
+    } else {
+        Op assign;
+        assign.type = OpType::AutoAssign;
+        assign.index = loop.iv;
+        assign.arg = loop.bound;
+        push_op(out, assign, at.loc);
+    }
+    push_label(out, OpType::JmpLabel, exit, at);
+}
+static size_t recognize_in_function(Func& func, bool fill, bool copy, size_t& fills) {
+    size_t rewritten = 0;
+    if (has_asm_barrier(func)) return rewritten;
+    std::set<size_t> done;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        Cfg cfg;
+        build_cfg(func, cfg);
+        if (cfg.blocks.empty()) break;
+        DomTree dom;
+        compute_dominators(cfg, dom);
+        LoopInfo info;
+        find_loops(cfg, dom, info);
+        if (info.loops.empty()) break;
+        Liveness live;
+        compute_liveness(func, cfg, live);
+        BitSet escaped;
+        escaped_slots(func, escaped);
+        IdiomMatcher matcher(func, cfg, info, live, escaped);
+        for (size_t l = 0; l < info.loops.size() && !changed; l++) {
+            WordLoop word;
+            if (!matcher.match(l, word)) continue;
+            size_t label = func.body[word.loop.header].opcode.label;
+            if (done.count(label) || !(word.copy ? copy : fill)) continue;
+            done.insert(label);
+            std::vector<OpWithLocation> body(func.body.begin(), func.body.begin() + word.loop.header);
+            rewrite_word_loop(func, word, body);
+            body.insert(body.end(), func.body.begin() + word.loop.header, func.body.end());
+            func.body.swap(body);
+            if (!word.copy) fills++;
+            rewritten++;
+            changed = true;
+        }
+    }
+    return rewritten;
+}
+static bool defined_in_program(const Compiler& c, const std::string& name) {
+    for (const Func& func : c.funcs) {
+        if (func.name == name) return true;
+    }
+    for (const Global& global : c.globals) {
+        if (global.name == name) return true;
+    }
+    return false;
+}
+static void declare_extrn(Compiler& c, const std::string& name) {
+    if (std::find(c.extrns.begin(), c.extrns.end(), name) == c.extrns.end()) {
+        c.extrns.push_back(name);
+    }
+}
+bool recognize_loop_idioms(Compiler& c, const OptOptions& options) {
+    if (!options.libc) return false;
+    bool fill = !defined_in_program(c, IDIOM_FILL);
+    bool copy = !defined_in_program(c, IDIOM_COPY);
+    size_t total_fills = 0;
+    size_t total = 0;
+    for (Func& func : c.funcs) {
+        size_t fills = 0;
+        size_t rewritten = recognize_in_function(func, fill, copy, fills);
+        if (rewritten == 0) continue;
+        if (options.report) {
+            printf("INFO: %s: replaced %zu loops with %s and %zu with %s\n", func.name.c_str(), fills, IDIOM_FILL,
+                   rewritten - fills, IDIOM_COPY);
+        }
+        total_fills += fills;
+        total += rewritten;
+    }
+    if (total_fills > 0) declare_extrn(c, IDIOM_FILL);
+    if (total > total_fills) declare_extrn(c, IDIOM_COPY);
+    return total > 0;
+}
@@ -0,0 +1,213 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+#include <map>
+#include <set>
+static const size_t INLINE_TINY_OPS = 12;
+static const size_t INLINE_HOT_OPS = 60;
+static const size_t INLINE_SINGLE_CALL_OPS = 400;
+static const size_t INLINE_MAX_CALLER_OPS = 4000;
+static const double INLINE_HOT_FREQUENCY = 10.0;
+// Callees that cannot be spliced: inline assembly may depend on the frame
+// and labels, and the address of a parameter may be used to reach the
+// arguments after it
+static bool can_inline(const Func& func) {
+    for (const OpWithLocation& owl : func.body) {
+        const Op& op = owl.opcode;
+        if (op.type == OpType::Asm) return false;
+        std::vector<const Arg*> args;
+        op_args(op, args);
+        for (const Arg* arg : args) {
+            if (arg->type == ArgType::RefAutoVar && arg->index <= func.params_count) return false;
+        }
+    }
+    return true;
+}
+// Names referenced other than as the target of a direct call
+static void referenced_names(const Compiler& c, std::set<std::string>& names) {
+    for (const Func& func : c.funcs) {
+        for (const OpWithLocation& owl : func.body) {
+            std::vector<const Arg*> args;
+            op_args(owl.opcode, args);
+            for (const Arg* arg : args) {
+                if (owl.opcode.type == OpType::Funcall && arg == &owl.opcode.arg) continue;
+                if (arg->type == ArgType::External || arg->type == ArgType::RefExternal) names.insert(arg->name);
+            }
+        }
+    }
+    for (const Global& global : c.globals) {
+        for (const ImmediateValue& value : global.values) {
+            if (value.type == ImmediateValueType::Name) names.insert(value.name);
+        }
+    }
+}
+static void collect_reachable(const Compiler& c, const std::map<std::string, size_t>& index, size_t f,
+                              std::vector<bool>& reached) {
+    for (const OpWithLocation& owl : c.funcs[f].body) {
+        size_t callee;
+        if (direct_callee(owl.opcode, index, callee) && !reached[callee]) {
+            reached[callee] = true;
+            collect_reachable(c, index, callee, reached);
+        }
+    }
+}
+// Calls per run of the caller: profiled counts over the caller's entry
+// count (none if the entry never ran), or 10 per enclosing loop
+static double call_frequency(const Cfg& cfg, const LoopInfo& loops, const std::vector<unsigned long long>& counts,
+                             bool profiled, size_t i) {
+    size_t b = cfg.block_of_op[i];
+    if (profiled) {
+        if (counts[0] == 0) return 0.0;
+        return static_cast<double>(counts[b]) / static_cast<double>(counts[0]);
+    }
+    double frequency = 1.0;
+    for (size_t d = loops.depth(b); d > 0 && frequency < 1000000.0; d--) {
+        frequency *= 10.0;
+    }
+    return frequency;
+}
+// Replaces the call at body[i] with a copy of callee on fresh slots and
+// labels: parameters are assigned from the arguments, and each return
+// stores its value to the call's result and jumps past the copy
+static void splice_call(Func& caller, const OpWithLocation& call, const Func& callee,
+                        std::vector<OpWithLocation>& body, size_t& next_label) {
+    size_t base = caller.auto_vars_count;
+    caller.auto_vars_count += callee.auto_vars_count;
+    std::vector<size_t> slots(callee.auto_vars_count + 1);
+    for (size_t s = 0; s <= callee.auto_vars_count; s++) slots[s] = base + s;
+    for (const AutoVec& vec : callee.auto_vecs) {
+        AutoVec copy = vec;
+        copy.first = slots[vec.first];
+        caller.auto_vecs.push_back(copy);
+    }
+    size_t label_base = next_label;
+    next_label += max_label_index(callee);
+    size_t end = next_label++;
+    const Op& call_op = call.opcode;
+    for (size_t p = 0; p < callee.params_count; p++) {
+        Op assign;
+        assign.type = OpType::AutoAssign;
+        assign.index = slots[p + 1];
+        assign.arg = p < call_op.funcall_args.size() ? call_op.funcall_args[p] : Arg::make_literal(0);
+        push_op(body, assign, call);
+    }
+    bool scale = callee.profiled && call.count != NO_COUNT && !callee.body.empty() &&
+                 callee.body[0].count != NO_COUNT && callee.body[0].count > 0;
+    bool falls_through = callee.body.empty() || op_falls_through(callee.body.back().opcode);
+    for (size_t i = 0; i < callee.body.size(); i++) {
+        OpWithLocation owl = callee.body[i];
+        owl.count = NO_COUNT;
+        if (scale && callee.body[i].count != NO_COUNT) {
+            owl.count = static_cast<unsigned long long>(static_cast<double>(callee.body[i].count) *
+                                                        call.count / callee.body[0].count);
+        }
+        Op& op = owl.opcode;
+        remap_op_slots(op, slots);
+        if (op.type == OpType::Label) op.label += label_base;
+        std::vector<size_t*> labels;
+        op_jump_labels(op, labels);
+        for (size_t* label : labels) *label += label_base;
+        if (op.type != OpType::Return) {
+            body.push_back(owl);
+            continue;
+        }
+        Op assign;
+        assign.type = OpType::AutoAssign;
+        assign.index = call_op.result;
+        assign.arg = op.has_return_arg ? op.arg : Arg::make_literal(0);
+        push_op(body, assign, owl);
+        if (i + 1 < callee.body.size()) {
+            Op jmp;
+            jmp.type = OpType::JmpLabel;
+            jmp.label = end;
+            push_op(body, jmp, owl);
+        }
+    }
+    if (falls_through) {
+        Op assign;
+        assign.type = OpType::AutoAssign;
+        assign.index = call_op.result;
+        assign.arg = Arg::make_literal(0);
+        push_op(body, assign, call);
+    }
+    Op label;
+    label.type = OpType::Label;
+    label.label = end;
+    push_op(body, label, call);
+}
+bool inline_functions(Compiler& c, const OptOptions& options) {
+    std::map<std::string, size_t> index;
+    bool has_main = false;
+    for (size_t i = 0; i < c.funcs.size(); i++) {
+        index[c.funcs[i].name] = i;
+        if (c.funcs[i].name == "main") has_main = true;
+    }
+    std::set<std::string> referenced;
+    referenced_names(c, referenced);
+    std::vector<size_t> call_sites(c.funcs.size(), 0);
+    std::vector<bool> inlinable(c.funcs.size(), false);
+    std::vector<std::vector<bool>> reaches(c.funcs.size());
+    for (size_t f = 0; f < c.funcs.size(); f++) {
+        for (const OpWithLocation& owl : c.funcs[f].body) {
+            size_t callee;
+            if (direct_callee(owl.opcode, index, callee)) call_sites[callee]++;
+        }
+        inlinable[f] = c.funcs[f].name != "main" && can_inline(c.funcs[f]);
+        reaches[f].assign(c.funcs.size(), false);
+        collect_reachable(c, index, f, reaches[f]);
+    }
+    std::vector<bool> visited(c.funcs.size(), false);
+    std::vector<size_t> order;
+    for (size_t f = 0; f < c.funcs.size(); f++) {
+        if (!visited[f]) callees_first(c, index, f, visited, order);
+    }
+    size_t total = 0;
+    for (size_t f : order) {
+        Func& caller = c.funcs[f];
+        if (caller.body.empty()) continue;
+        Cfg cfg;
+        build_cfg(caller, cfg);
+        DomTree dom;
+        compute_dominators(cfg, dom);
+        LoopInfo loops;
+        find_loops(cfg, dom, loops);
+        std::vector<unsigned long long> counts;
+        bool profiled = profile_block_counts(caller, cfg, counts);
+        size_t size = body_size(caller);
+        std::vector<bool> splice(caller.body.size(), false);
+        size_t inlined = 0;
+        for (size_t i = 0; i < caller.body.size(); i++) {
+            size_t g;
+            if (!direct_callee(caller.body[i].opcode, index, g) || g == f || !inlinable[g] || reaches[g][f]) {
+                continue;
+            }
+            size_t callee_size = body_size(c.funcs[g]);
+            double frequency = call_frequency(cfg, loops, counts, profiled, i);
+            bool single = call_sites[g] == 1 && has_main && !referenced.count(c.funcs[g].name);
+            bool worth = callee_size <= INLINE_TINY_OPS ||
+                         (single && callee_size <= INLINE_SINGLE_CALL_OPS) ||
+                         (frequency >= INLINE_HOT_FREQUENCY && callee_size <= INLINE_HOT_OPS);
+            if (!worth || size + callee_size > INLINE_MAX_CALLER_OPS) continue;
+            splice[i] = true;
+            size += callee_size + c.funcs[g].params_count;
+            inlined++;
+        }
+        if (inlined == 0) continue;
+        std::vector<OpWithLocation> body;
+        size_t next_label = max_label_index(caller);
+        for (size_t i = 0; i < caller.body.size(); i++) {
+            size_t g;
+            if (splice[i] && direct_callee(caller.body[i].opcode, index, g)) {
+                splice_call(caller, caller.body[i], c.funcs[g], body, next_label);
+            } else {
+                body.push_back(caller.body[i]);
+            }
+        }
+        caller.body.swap(body);
+        total += inlined;
+        if (options.report) {
+            printf("INFO: %s: inlined %zu calls\n", caller.name.c_str(), inlined);
+        }
+    }
+    return total > 0;
+}
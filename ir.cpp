@@ -63,6 +63,7 @@ std::string IRGenerator::binop_to_string(Binop op) {
         case Binop::BitAnd:       return " & ";
         case Binop::BitShl:       return " << ";
         case Binop::BitShr:       return " >> ";
+        case Binop::BitSar:       return " >>> ";
         case Binop::Plus:         return " + ";
         case Binop::Minus:        return " - ";
         case Binop::Mod:          return " % ";
@@ -83,6 +84,9 @@ void IRGenerator::generate_function(const Func& func) {
              func.name.c_str(), func.params_count, func.auto_vars_count);
     output += buf;
     for (size_t i = 0; i < func.body.size(); i++) {
+        if (func.cold_ops > 0 && i == func.body.size() - func.cold_ops) {
+            output += "cold:\n";
+        }
         snprintf(buf, sizeof(buf), "%8zu:", i);
         output += buf;
         const OpWithLocation& op = func.body[i];
@@ -152,6 +156,17 @@ void IRGenerator::generate_function(const Func& func) {
                 output += ")\n";
                 break;
             }
+            case OpType::Intrinsic: {
+                snprintf(buf, sizeof(buf), "    auto[%zu] = intrinsic(%s", op.opcode.result,
+                         intrinsic_name(op.opcode.intrinsic));
+                output += buf;
+                for (size_t j = 0; j < op.opcode.funcall_args.size(); j++) {
+                    output += ", ";
+                    dump_arg(op.opcode.funcall_args[j]);
+                }
+                output += ")\n";
+                break;
+            }
             case OpType::Asm:
                 output += "    __asm__(\n";
                 for (size_t j = 0; j < op.opcode.asm_args.size(); j++) {
@@ -159,7 +174,15 @@ void IRGenerator::generate_function(const Func& func) {
                     output += op.opcode.asm_args[j];
                     output += "\n";
                 }
-                output += "    )\n";
+                output += "    )";
+                if (op.opcode.asm_declared) {
+                    output += " :";
+                    for (size_t j = 0; j < op.opcode.asm_clobbers.size(); j++) {
+                        output += j == 0 ? " " : ", ";
+                        output += op.opcode.asm_clobbers[j];
+                    }
+                }
+                output += "\n";
                 break;
             case OpType::Label: {
                 snprintf(buf, sizeof(buf), "    label[%zu]\n", op.opcode.label);
@@ -178,6 +201,38 @@ void IRGenerator::generate_function(const Func& func) {
                 output += "\n";
                 break;
             }
+            case OpType::CmpJmpIfNotLabel: {
+                snprintf(buf, sizeof(buf), "    jmp_if_not label[%zu], ", op.opcode.label);
+                output += buf;
+                dump_arg(op.opcode.arg);
+                output += binop_to_string(op.opcode.binop);
+                dump_arg(op.opcode.arg2);
+                output += "\n";
+                break;
+            }
+            case OpType::JmpTable: {
+                snprintf(buf, sizeof(buf), "    jmp_table label[%zu], ", op.opcode.label);
+                output += buf;
+                dump_arg(op.opcode.arg);
+                output += ":";
+                for (size_t j = 0; j < op.opcode.labels.size(); j++) {
+                    snprintf(buf, sizeof(buf), j == 0 ? " label[%zu]" : ", label[%zu]", op.opcode.labels[j]);
+                    output += buf;
+                }
+                output += "\n";
+                break;
+            }
+            case OpType::Select: {
+                snprintf(buf, sizeof(buf), "    auto[%zu] = ", op.opcode.index);
+                output += buf;
+                dump_arg(op.opcode.arg);
+                output += " ? ";
+                dump_arg(op.opcode.arg2);
+                output += " : ";
+                dump_arg(op.opcode.arg3);
+                output += "\n";
+                break;
+            }
         }
     }
 }
@@ -0,0 +1,549 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+#include <algorithm>
+struct IvUpdate {
+    size_t after;
+    bool subtract;
+    Arg step;
+    std::vector<size_t> ops;
+};
+struct BasicIv {
+    size_t slot;
+    std::vector<IvUpdate> updates;
+};
+struct ReducedIv {
+    size_t iv;
+    unsigned long long scale;
+    bool has_base;
+    Arg base;
+    size_t slot;
+};
+struct ScaledStep {
+    size_t step;
+    unsigned long long scale;
+    size_t slot;
+};
+struct IvCandidate {
+    size_t op;
+    size_t reduced;
+    size_t feeder;
+};
+// Values iv takes at the test of a counted loop, as long as each step
+// moves it toward a literal bound
+static bool test_range(const CountedLoop& loop, long long start, long long& lo, long long& hi) {
+    if (loop.bound.type != ArgType::Literal) return false;
+    long long bound = static_cast<long long>(loop.bound.value);
+    switch (loop.cmp) {
+        case Binop::Less:
+        case Binop::LessEqual:
+            if (loop.step < 0) return false;
+            break;
+        case Binop::Greater:
+        case Binop::GreaterEqual:
+            if (loop.step > 0) return false;
+            break;
+        case Binop::NotEqual:
+            if (loop.step == 1 ? start > bound : loop.step != -1 || start < bound) return false;
+            break;
+        default:
+            break;
+    }
+    long long step = loop.step < 0 ? -loop.step : loop.step;
+    lo = std::min(start, bound) - step;
+    hi = std::max(start, bound) + step;
+    return true;
+}
+// Whether base + value*scale is below 2^63 in magnitude, so comparing it
+// orders the same as comparing value
+static bool scaled_fits(long long value, const ReducedIv& red) {
+    const long long limit = 1LL << 62;
+    long long product;
+    if (__builtin_mul_overflow(value, static_cast<long long>(red.scale), &product)) return false;
+    if (product >= limit || product <= -limit) return false;
+    if (!red.has_base) return true;
+    long long base = static_cast<long long>(red.base.value);
+    return red.base.type == ArgType::Literal && base < limit && base > -limit;
+}
+static OpWithLocation make_binop(size_t dest, const Arg& lhs, Binop binop, const Arg& rhs, Loc loc) {
+    OpWithLocation owl;
+    owl.opcode.type = OpType::Binop;
+    owl.opcode.binop = binop;
+    owl.opcode.index = dest;
+    owl.opcode.arg = lhs;
+    owl.opcode.arg2 = rhs;
+    owl.loc = loc;
+    return owl;
+}
+static OpWithLocation make_copy(size_t dest, const Arg& src, Loc loc) {
+    OpWithLocation owl;
+    owl.opcode.type = OpType::AutoAssign;
+    owl.opcode.index = dest;
+    owl.opcode.arg = src;
+    owl.loc = loc;
+    return owl;
+}
+class IvReducer {
+public:
+    IvReducer(Func& f, const Cfg& c, const LoopInfo& i, size_t l, const Liveness& lv,
+              const BitSet& e)
+        : func(f), cfg(c), info(i), loop(l), live(lv), escaped(e), reduced(0), tests(0) {}
+    bool run();
+
+    Func& func;
+    const Cfg& cfg;
+    const LoopInfo& info;
+    size_t loop;
+    const Liveness& live;
+    const BitSet& escaped;
+    size_t reduced;
+    size_t tests;
+
+private:
+    std::vector<size_t> ops;
+    std::vector<size_t> def_count;
+    std::vector<std::vector<size_t>> defs;
+    std::vector<bool> invariant;
+    std::vector<BasicIv> ivs;
+    std::vector<size_t> iv_of_slot;
+    std::vector<ReducedIv> reduced_ivs;
+    std::vector<IvCandidate> candidates;
+
+    bool invariant_arg(const Arg& arg) const;
+    bool step_arg(const Arg& arg) const;
+    bool match_step(const Op& op, size_t slot, bool& subtract, Arg& step) const;
+    bool find_basic_iv(size_t slot, BasicIv& iv) const;
+    bool match_scaled(size_t op_index, size_t& iv, unsigned long long& scale) const;
+    bool updated_between(size_t iv, size_t from, size_t to) const;
+    bool good_dest(size_t dest) const;
+    size_t reduced_for(size_t iv, unsigned long long scale, bool has_base, const Arg& base);
+};
+bool IvReducer::invariant_arg(const Arg& arg) const {
+    if (is_constant_arg(arg)) return true;
+    return arg.type == ArgType::AutoVar && invariant[arg.index];
+}
+bool IvReducer::step_arg(const Arg& arg) const {
+    return arg.type == ArgType::Literal || (arg.type == ArgType::AutoVar && invariant[arg.index]);
+}
+bool IvReducer::match_step(const Op& op, size_t slot, bool& subtract, Arg& step) const {
+    if (op.type != OpType::Binop) return false;
+    if (op.binop == Binop::Plus) {
+        subtract = false;
+        if (is_slot(op.arg, slot) && step_arg(op.arg2)) {
+            step = op.arg2;
+            return true;
+        }
+        if (is_slot(op.arg2, slot) && step_arg(op.arg)) {
+            step = op.arg;
+            return true;
+        }
+    } else if (op.binop == Binop::Minus) {
+        subtract = true;
+        if (is_slot(op.arg, slot) && step_arg(op.arg2)) {
+            step = op.arg2;
+            return true;
+        }
+    }
+    return false;
+}
+bool IvReducer::find_basic_iv(size_t slot, BasicIv& iv) const {
+    iv.slot = slot;
+    for (size_t i : defs[slot]) {
+        const Op& op = func.body[i].opcode;
+        IvUpdate update;
+        update.after = i;
+        if (op.type == OpType::Binop && match_step(op, slot, update.subtract, update.step)) {
+            update.ops.push_back(i);
+        } else if (op.type == OpType::AutoAssign && op.arg.type == ArgType::AutoVar) {
+            size_t tmp = op.arg.index;
+            if (def_count[tmp] != 1 || escaped.test(tmp)) return false;
+            size_t j = defs[tmp][0];
+            if (j >= i || cfg.block_of_op[j] != cfg.block_of_op[i]) return false;
+            if (!match_step(func.body[j].opcode, slot, update.subtract, update.step)) return false;
+            for (size_t k : defs[slot]) {
+                if (k > j && k < i) return false;
+            }
+            if (count_slot_uses(func, tmp) != 1) return false;
+            update.ops.push_back(j);
+            update.ops.push_back(i);
+        } else {
+            return false;
+        }
+        iv.updates.push_back(update);
+    }
+    return !iv.updates.empty();
+}
+bool IvReducer::match_scaled(size_t op_index, size_t& iv, unsigned long long& scale) const {
+    const Op& op = func.body[op_index].opcode;
+    if (op.type != OpType::Binop) return false;
+    const Arg* var = nullptr;
+    const Arg* lit = nullptr;
+    if (op.binop == Binop::Mult) {
+        if (op.arg.type == ArgType::AutoVar && op.arg2.type == ArgType::Literal) {
+            var = &op.arg;
+            lit = &op.arg2;
+        } else if (op.arg2.type == ArgType::AutoVar && op.arg.type == ArgType::Literal) {
+            var = &op.arg2;
+            lit = &op.arg;
+        } else {
+            return false;
+        }
+        scale = lit->value;
+    } else if (op.binop == Binop::BitShl) {
+        if (op.arg.type != ArgType::AutoVar || op.arg2.type != ArgType::Literal) return false;
+        if (op.arg2.value >= 63) return false;
+        var = &op.arg;
+        scale = 1ULL << op.arg2.value;
+    } else {
+        return false;
+    }
+    if (iv_of_slot[var->index] == NO_LOOP) return false;
+    unsigned long long magnitude = static_cast<long long>(scale) < 0 ? 0 - scale : scale;
+    if (scale == 0 || magnitude >= (1ULL << 32)) return false;
+    iv = iv_of_slot[var->index];
+    return true;
+}
+bool IvReducer::updated_between(size_t iv, size_t from, size_t to) const {
+    for (const IvUpdate& update : ivs[iv].updates) {
+        for (size_t k : update.ops) {
+            if (k > from && k < to) return true;
+        }
+    }
+    return false;
+}
+bool IvReducer::good_dest(size_t dest) const {
+    return def_count[dest] == 1 && !escaped.test(dest) &&
+           !live.live_in[info.loops[loop].header].test(dest) && iv_of_slot[dest] == NO_LOOP;
+}
+size_t IvReducer::reduced_for(size_t iv, unsigned long long scale, bool has_base, const Arg& base) {
+    for (size_t r = 0; r < reduced_ivs.size(); r++) {
+        const ReducedIv& red = reduced_ivs[r];
+        if (red.iv == iv && red.scale == scale && red.has_base == has_base &&
+            (!has_base || same_arg(red.base, base))) {
+            return r;
+        }
+    }
+    ReducedIv red;
+    red.iv = iv;
+    red.scale = scale;
+    red.has_base = has_base;
+    red.base = base;
+    red.slot = 0;
+    reduced_ivs.push_back(red);
+    return reduced_ivs.size() - 1;
+}
+bool IvReducer::run() {
+    const Loop& lp = info.loops[loop];
+    if (!can_insert_preheader(func, cfg, info, loop)) return false;
+    size_t slots = func.auto_vars_count + 1;
+    def_count.assign(slots, 0);
+    defs.assign(slots, std::vector<size_t>());
+    bool memory_written = false;
+    for (size_t b : lp.blocks) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+            const Op& op = func.body[i].opcode;
+            ops.push_back(i);
+            memory_written |= op_writes_memory(op);
+            size_t def;
+            if (op_defined_slot(op, def)) {
+                def_count[def]++;
+                defs[def].push_back(i);
+            }
+        }
+    }
+    std::sort(ops.begin(), ops.end());
+    invariant.assign(slots, false);
+    for (size_t s = 1; s < slots; s++) {
+        invariant[s] = def_count[s] == 0 && (!escaped.test(s) || !memory_written);
+    }
+    iv_of_slot.assign(slots, NO_LOOP);
+    for (size_t s = 1; s < slots; s++) {
+        if (def_count[s] == 0 || escaped.test(s)) continue;
+        BasicIv iv;
+        if (find_basic_iv(s, iv)) {
+            iv_of_slot[s] = ivs.size();
+            ivs.push_back(iv);
+        }
+    }
+    if (ivs.empty()) return false;
+    std::vector<size_t> consumed(slots, 0);
+    for (size_t i : ops) {
+        const Op& op = func.body[i].opcode;
+        if (op.type != OpType::Binop || op.binop != Binop::Plus || !good_dest(op.index)) continue;
+        for (int side = 0; side < 2; side++) {
+            const Arg& var = side == 0 ? op.arg2 : op.arg;
+            const Arg& base = side == 0 ? op.arg : op.arg2;
+            if (var.type != ArgType::AutoVar || !invariant_arg(base)) continue;
+            size_t iv = NO_LOOP;
+            unsigned long long scale = 1;
+            size_t feeder = NO_LOOP;
+            if (iv_of_slot[var.index] != NO_LOOP) {
+                iv = iv_of_slot[var.index];
+            } else if (def_count[var.index] == 1) {
+                size_t j = defs[var.index][0];
+                if (cfg.block_of_op[j] != cfg.block_of_op[i] || j > i) continue;
+                if (!match_scaled(j, iv, scale) || updated_between(iv, j, i)) continue;
+                feeder = var.index;
+            } else {
+                continue;
+            }
+            IvCandidate cand;
+            cand.op = i;
+            cand.reduced = reduced_for(iv, scale, true, base);
+            cand.feeder = feeder;
+            candidates.push_back(cand);
+            if (feeder != NO_LOOP) consumed[feeder]++;
+            break;
+        }
+    }
+    for (size_t i : ops) {
+        const Op& op = func.body[i].opcode;
+        if (op.type != OpType::Binop || !good_dest(op.index)) continue;
+        size_t iv;
+        unsigned long long scale;
+        if (!match_scaled(i, iv, scale)) continue;
+        if (consumed[op.index] > 0 && count_slot_uses(func, op.index) == consumed[op.index]) continue;
+        IvCandidate cand;
+        cand.op = i;
+        cand.reduced = reduced_for(iv, scale, false, Arg());
+        cand.feeder = NO_LOOP;
+        candidates.push_back(cand);
+    }
+    if (candidates.empty()) return false;
+    CountedLoop counted;
+    long long start = 0;
+    bool is_counted = match_counted_loop(func, cfg, info, loop, escaped, counted) &&
+                      counted_loop_start(func, counted, start);
+    std::vector<OpWithLocation> preheader = open_preheader(func, cfg, info, loop);
+    Loc loc = func.body[cfg.blocks[lp.header].begin].loc;
+    std::vector<std::vector<OpWithLocation>> after(func.body.size());
+    std::vector<bool> removed(func.body.size(), false);
+    std::vector<ScaledStep> scaled_steps;
+    for (ReducedIv& red : reduced_ivs) {
+        const BasicIv& iv = ivs[red.iv];
+        red.slot = ++func.auto_vars_count;
+        Arg iv_arg = Arg::make_auto_var(iv.slot);
+        if (red.scale == 1) {
+            preheader.push_back(make_copy(red.slot, iv_arg, loc));
+        } else {
+            preheader.push_back(make_binop(red.slot, iv_arg, Binop::Mult,
+                                           Arg::make_literal(red.scale), loc));
+        }
+        if (red.has_base) {
+            preheader.push_back(make_binop(red.slot, red.base, Binop::Plus,
+                                           Arg::make_auto_var(red.slot), loc));
+        }
+        for (const IvUpdate& update : iv.updates) {
+            Arg stride;
+            if (update.step.type == ArgType::Literal) {
+                stride = Arg::make_literal(update.step.value * red.scale);
+            } else if (red.scale == 1) {
+                stride = update.step;
+            } else {
+                size_t tmp = 0;
+                for (const ScaledStep& known : scaled_steps) {
+                    if (known.step == update.step.index && known.scale == red.scale) {
+                        tmp = known.slot;
+                    }
+                }
+                if (tmp == 0) {
+                    tmp = ++func.auto_vars_count;
+                    preheader.push_back(make_binop(tmp, update.step, Binop::Mult,
+                                                   Arg::make_literal(red.scale), loc));
+                    ScaledStep known;
+                    known.step = update.step.index;
+                    known.scale = red.scale;
+                    known.slot = tmp;
+                    scaled_steps.push_back(known);
+                }
+                stride = Arg::make_auto_var(tmp);
+            }
+            Arg self = Arg::make_auto_var(red.slot);
+            after[update.after].push_back(make_binop(red.slot, self,
+                                                     update.subtract ? Binop::Minus : Binop::Plus,
+                                                     stride, func.body[update.after].loc));
+        }
+    }
+    for (const IvCandidate& cand : candidates) {
+        Op& op = func.body[cand.op].opcode;
+        size_t dest = op.index;
+        size_t q = reduced_ivs[cand.reduced].slot;
+        op.type = OpType::AutoAssign;
+        op.arg = Arg::make_auto_var(q);
+        reduced++;
+        size_t total = count_slot_uses(func, dest);
+        size_t forwarded = 0;
+        size_t iv = reduced_ivs[cand.reduced].iv;
+        const BasicBlock& block = cfg.blocks[cfg.block_of_op[cand.op]];
+        std::vector<Arg*> args;
+        for (size_t k = cand.op + 1; k < block.end; k++) {
+            Op& use = func.body[k].opcode;
+            op_args(use, args);
+            for (Arg* arg : args) {
+                if ((arg->type == ArgType::AutoVar || arg->type == ArgType::Deref) &&
+                    arg->index == dest) {
+                    arg->index = q;
+                    forwarded++;
+                }
+            }
+            if (use.type == OpType::Store && use.index == dest) {
+                use.index = q;
+                forwarded++;
+            }
+            size_t def;
+            if (op_defined_slot(use, def) && def == dest) break;
+            if (updated_between(iv, k - 1, k + 1)) break;
+        }
+        if (forwarded == total) removed[cand.op] = true;
+    }
+    for (size_t r = 0; r < reduced_ivs.size(); r++) {
+        const ReducedIv& red = reduced_ivs[r];
+        const BasicIv& iv = ivs[red.iv];
+        if (red.scale >= (1ULL << 31)) continue;
+        bool done = false;
+        for (size_t r2 = 0; r2 < r; r2++) {
+            if (reduced_ivs[r2].iv == red.iv) done = true;
+        }
+        if (done) continue;
+        size_t cmp = NO_LOOP;
+        bool iv_left = true;
+        for (size_t i : ops) {
+            const Op& op = func.body[i].opcode;
+            bool fused = op.type == OpType::CmpJmpIfNotLabel;
+            if (removed[i] || (op.type != OpType::Binop && !fused) || !is_comparison(op.binop)) continue;
+            if (is_slot(op.arg, iv.slot) && invariant_arg(op.arg2) && !is_slot(op.arg2, iv.slot)) {
+                iv_left = true;
+            } else if (is_slot(op.arg2, iv.slot) && invariant_arg(op.arg)) {
+                iv_left = false;
+            } else {
+                continue;
+            }
+            if (fused) {
+                cmp = i;
+                break;
+            }
+            if (def_count[op.index] != 1 || escaped.test(op.index)) continue;
+            if (count_slot_uses(func, op.index) != 1) continue;
+            bool branch = false;
+            const BasicBlock& block = cfg.blocks[cfg.block_of_op[i]];
+            for (size_t k = i + 1; k < block.end; k++) {
+                const Op& use = func.body[k].opcode;
+                if (use.type == OpType::JmpIfNotLabel && is_slot(use.arg, op.index)) branch = true;
+            }
+            if (!branch) continue;
+            cmp = i;
+            break;
+        }
+        if (cmp == NO_LOOP) continue;
+        std::vector<bool> ignore(func.body.size(), false);
+        ignore[cmp] = true;
+        for (const IvUpdate& update : iv.updates) {
+            for (size_t k : update.ops) ignore[k] = true;
+        }
+        bool other_use = false;
+        std::vector<size_t> uses;
+        for (size_t i : ops) {
+            if (ignore[i] || removed[i]) continue;
+            const Op& op = func.body[i].opcode;
+            op_used_slots(op, uses);
+            if (std::find(uses.begin(), uses.end(), iv.slot) == uses.end()) continue;
+            size_t def;
+            bool pure = op.type == OpType::Binop || op.type == OpType::AutoAssign ||
+                        op.type == OpType::Negate || op.type == OpType::UnaryNot;
+            if (pure && op_defined_slot(op, def) && !escaped.test(def) &&
+                count_slot_uses(func, def) == 0) {
+                continue;
+            }
+            other_use = true;
+        }
+        for (size_t b : info.loops[loop].blocks) {
+            for (size_t s : cfg.blocks[b].succs) {
+                if (!info.contains(loop, s) && live.live_in[s].test(iv.slot)) other_use = true;
+            }
+        }
+        if (other_use) continue;
+        if (red.scale != 1 || red.has_base) {
+            long long lo, hi;
+            if (!is_counted || counted.iv != iv.slot || counted.test != cmp) continue;
+            if (!test_range(counted, start, lo, hi) || !scaled_fits(lo, red) || !scaled_fits(hi, red)) continue;
+        }
+        Op& op = func.body[cmp].opcode;
+        const Arg& bound = iv_left ? op.arg2 : op.arg;
+        size_t limit = ++func.auto_vars_count;
+        if (red.scale == 1) {
+            preheader.push_back(make_copy(limit, bound, loc));
+        } else {
+            preheader.push_back(make_binop(limit, bound, Binop::Mult,
+                                           Arg::make_literal(red.scale), loc));
+        }
+        if (red.has_base) {
+            preheader.push_back(make_binop(limit, red.base, Binop::Plus,
+                                           Arg::make_auto_var(limit), loc));
+        }
+        if (iv_left) {
+            op.arg = Arg::make_auto_var(red.slot);
+            op.arg2 = Arg::make_auto_var(limit);
+        } else {
+            op.arg = Arg::make_auto_var(limit);
+            op.arg2 = Arg::make_auto_var(red.slot);
+        }
+        for (const IvUpdate& update : iv.updates) {
+            for (size_t k : update.ops) removed[k] = true;
+        }
+        tests++;
+    }
+    std::vector<OpWithLocation> body;
+    body.reserve(func.body.size() + preheader.size());
+    size_t header_begin = cfg.blocks[lp.header].begin;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        if (i == header_begin) {
+            body.insert(body.end(), preheader.begin(), preheader.end());
+        }
+        if (!removed[i]) body.push_back(func.body[i]);
+        body.insert(body.end(), after[i].begin(), after[i].end());
+    }
+    func.body.swap(body);
+    return true;
+}
+bool reduce_induction_variables(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    size_t reduced = 0;
+    size_t tests = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        Cfg cfg;
+        build_cfg(func, cfg);
+        if (cfg.blocks.empty()) break;
+        DomTree dom;
+        compute_dominators(cfg, dom);
+        LoopInfo info;
+        find_loops(cfg, dom, info);
+        if (info.loops.empty()) break;
+        Liveness live;
+        compute_liveness(func, cfg, live);
+        BitSet escaped;
+        escaped_slots(func, escaped);
+        std::vector<size_t> order;
+        for (size_t l = 0; l < info.loops.size(); l++) {
+            order.push_back(l);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return info.loops[a].depth > info.loops[b].depth;
+        });
+        for (size_t l : order) {
+            IvReducer reducer(func, cfg, info, l, live, escaped);
+            if (reducer.run()) {
+                reduced += reducer.reduced;
+                tests += reducer.tests;
+                changed = true;
+                break;
+            }
+        }
+    }
+    if (options.report) {
+        printf("INFO: %s: strength-reduced %zu induction expressions, replaced %zu loop tests\n",
+               func.name.c_str(), reduced, tests);
+    }
+    return reduced > 0;
+}
@@ -0,0 +1,297 @@
+#include "opt.h"
+#include "analysis.h"
+#include <algorithm>
+#include <cstdio>
+static const unsigned long long LOOP_SCALE = 10;
+static const unsigned long long MAX_FREQUENCY = 1000000;
+struct LayoutEdge {
+    size_t from;
+    size_t to;
+    unsigned long long weight;
+};
+static bool is_conditional(const Op& op) {
+    return op.type == OpType::JmpIfNotLabel || op.type == OpType::CmpJmpIfNotLabel;
+}
+static Binop inverted_comparison(Binop op) {
+    switch (op) {
+        case Binop::Less:         return Binop::GreaterEqual;
+        case Binop::Greater:      return Binop::LessEqual;
+        case Binop::LessEqual:    return Binop::Greater;
+        case Binop::GreaterEqual: return Binop::Less;
+        case Binop::Equal:        return Binop::NotEqual;
+        default:                  return Binop::Equal;
+    }
+}
+// Turns a conditional jump around: it now jumps to label exactly when it
+// used to fall through
+static void invert_branch(Op& op, size_t label) {
+    if (op.type == OpType::JmpIfNotLabel) {
+        op.type = OpType::CmpJmpIfNotLabel;
+        op.binop = Binop::Equal;
+        op.arg2 = Arg::make_literal(0);
+    } else {
+        op.binop = inverted_comparison(op.binop);
+    }
+    op.label = label;
+}
+static bool edge_before(const LayoutEdge& a, const LayoutEdge& b) {
+    if (a.weight != b.weight) return a.weight > b.weight;
+    bool a_falls = a.to == a.from + 1;
+    bool b_falls = b.to == b.from + 1;
+    if (a_falls != b_falls) return a_falls;
+    if (a.from != b.from) return a.from < b.from;
+    return a.to < b.to;
+}
+// Cold blocks only run on the way out of the function from the middle of a
+// loop: a return (or a private chain of blocks ending in one) entered from
+// a loop block other than the header, whose exit test is the normal way out
+static void find_cold_blocks(const Func& func, const Cfg& cfg, const LoopInfo& loops,
+                             std::vector<bool>& cold) {
+    size_t n = cfg.blocks.size();
+    std::vector<bool> returns(n, false);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = n; b-- > 0;) {
+            if (returns[b]) continue;
+            const BasicBlock& block = cfg.blocks[b];
+            bool ret = func.body[block.end - 1].opcode.type == OpType::Return;
+            if (!ret && block.succs.size() == 1) {
+                size_t s = block.succs[0];
+                ret = returns[s] && cfg.blocks[s].preds.size() == 1;
+            }
+            if (ret) {
+                returns[b] = true;
+                changed = true;
+            }
+        }
+    }
+    cold.assign(n, false);
+    for (size_t b = 1; b < n; b++) {
+        if (!returns[b]) continue;
+        for (size_t p : cfg.blocks[b].preds) {
+            size_t loop = loops.innermost[p];
+            if (loop == NO_LOOP || loops.loops[loop].header == p) continue;
+            if (loops.depth(p) > loops.depth(b)) cold[b] = true;
+        }
+    }
+    changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b = 1; b < n; b++) {
+            if (cold[b] || !returns[b] || cfg.blocks[b].preds.size() != 1) continue;
+            size_t p = cfg.blocks[b].preds[0];
+            if (cold[p] && cfg.blocks[p].succs.size() == 1) {
+                cold[b] = true;
+                changed = true;
+            }
+        }
+    }
+}
+// Static edge weights: blocks run LOOP_SCALE times per enclosing loop, a
+// branch stays in its loop 7 times out of 8 and avoids a cold side 15
+// times out of 16
+static void weigh_edges(const Func& func, const Cfg& cfg, const LoopInfo& loops,
+                        const std::vector<bool>& cold, std::vector<LayoutEdge>& edges) {
+    edges.clear();
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        const BasicBlock& block = cfg.blocks[b];
+        unsigned long long freq = cold[b] ? 1 : 16;
+        for (size_t d = loops.depth(b); d > 0 && freq < MAX_FREQUENCY; d--) {
+            freq *= LOOP_SCALE;
+        }
+        const Op& last = func.body[block.end - 1].opcode;
+        if (is_conditional(last) && block.succs.size() == 2) {
+            size_t loop = loops.innermost[b];
+            size_t share[2] = {8, 8};
+            bool exits[2];
+            for (int k = 0; k < 2; k++) {
+                exits[k] = loop != NO_LOOP && !loops.contains(loop, block.succs[k]);
+            }
+            if (exits[0] != exits[1]) {
+                share[0] = exits[0] ? 2 : 14;
+                share[1] = exits[1] ? 2 : 14;
+            } else if (cold[block.succs[0]] != cold[block.succs[1]]) {
+                share[0] = cold[block.succs[0]] ? 1 : 15;
+                share[1] = cold[block.succs[1]] ? 1 : 15;
+            }
+            for (int k = 0; k < 2; k++) {
+                edges.push_back({b, block.succs[k], freq * share[k]});
+            }
+            continue;
+        }
+        for (size_t s : block.succs) {
+            edges.push_back({b, s, freq * 16 / block.succs.size()});
+        }
+    }
+    std::sort(edges.begin(), edges.end(), edge_before);
+}
+// Profiled edge weights: an edge into a block without other predecessors
+// runs as often as that block, the rest of the source's count is split among
+// its other successors by their counts
+static void weigh_profiled_edges(const Cfg& cfg, const std::vector<unsigned long long>& counts,
+                                 std::vector<LayoutEdge>& edges) {
+    edges.clear();
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        const BasicBlock& block = cfg.blocks[b];
+        unsigned long long rest = counts[b];
+        unsigned long long shared = 0;
+        size_t sharing = 0;
+        for (size_t s : block.succs) {
+            if (cfg.blocks[s].preds.size() == 1) {
+                rest -= std::min(rest, counts[s]);
+            } else {
+                shared += counts[s];
+                sharing++;
+            }
+        }
+        for (size_t s : block.succs) {
+            unsigned long long weight;
+            if (cfg.blocks[s].preds.size() == 1) {
+                weight = std::min(counts[s], counts[b]);
+            } else if (shared == 0) {
+                weight = rest / sharing;
+            } else {
+                weight = static_cast<unsigned long long>(static_cast<double>(rest) * counts[s] / shared);
+            }
+            edges.push_back({b, s, weight});
+        }
+    }
+    std::sort(edges.begin(), edges.end(), edge_before);
+}
+// Greedy bottom-up chaining (Pettis-Hansen): the heaviest edges become
+// fall-throughs first. Cold blocks only chain with each other
+static void form_chains(const Cfg& cfg, const std::vector<bool>& cold,
+                        const std::vector<LayoutEdge>& edges, std::vector<std::vector<size_t>>& chains) {
+    size_t n = cfg.blocks.size();
+    std::vector<size_t> chain_of(n);
+    chains.assign(n, std::vector<size_t>());
+    for (size_t b = 0; b < n; b++) {
+        chain_of[b] = b;
+        chains[b].push_back(b);
+    }
+    for (const LayoutEdge& e : edges) {
+        size_t a = chain_of[e.from];
+        size_t b = chain_of[e.to];
+        if (a == b || e.to == 0 || cold[e.from] != cold[e.to]) continue;
+        if (chains[a].back() != e.from || chains[b].front() != e.to) continue;
+        for (size_t x : chains[b]) {
+            chain_of[x] = a;
+            chains[a].push_back(x);
+        }
+        chains[b].clear();
+    }
+}
+bool layout_blocks(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    if (func.body.empty()) return false;
+    if (op_falls_through(func.body.back().opcode)) {
+        OpWithLocation ret;
+        ret.opcode.type = OpType::Return;
+        ret.loc = func.body.back().loc;
+        func.body.push_back(ret);
+    }
+    Cfg cfg;
+    build_cfg(func, cfg);
+    DomTree dom;
+    compute_dominators(cfg, dom);
+    LoopInfo loops;
+    find_loops(cfg, dom, loops);
+    size_t n = cfg.blocks.size();
+    std::vector<bool> cold;
+    std::vector<LayoutEdge> edges;
+    std::vector<unsigned long long> counts;
+    if (profile_block_counts(func, cfg, counts)) {
+        cold.assign(n, false);
+        for (size_t b = 1; b < n; b++) cold[b] = counts[b] == 0;
+        weigh_profiled_edges(cfg, counts, edges);
+    } else {
+        find_cold_blocks(func, cfg, loops, cold);
+        weigh_edges(func, cfg, loops, cold, edges);
+    }
+    std::vector<std::vector<size_t>> chains;
+    form_chains(cfg, cold, edges, chains);
+    std::vector<size_t> order;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t c = 0; c < n; c++) {
+            if (!chains[c].empty() && cold[chains[c].front()] == (pass == 1)) {
+                order.insert(order.end(), chains[c].begin(), chains[c].end());
+            }
+        }
+    }
+    size_t hot_blocks = 0;
+    while (hot_blocks < n && !cold[order[hot_blocks]]) hot_blocks++;
+    std::vector<size_t> label(n, NO_BLOCK);
+    size_t next_label = max_label_index(func);
+    for (size_t b = 0; b < n; b++) {
+        const Op& first = func.body[cfg.blocks[b].begin].opcode;
+        if (first.type == OpType::Label) label[b] = first.label;
+    }
+    std::vector<bool> fresh(n, false);
+    std::vector<std::vector<Op>> tail(n);
+    size_t moved = 0;
+    size_t inverted = 0;
+    for (size_t k = 0; k < n; k++) {
+        size_t b = order[k];
+        if (b != k) moved++;
+        size_t next = k + 1 < n && k + 1 != hot_blocks ? order[k + 1] : NO_BLOCK;
+        const BasicBlock& block = cfg.blocks[b];
+        const Op& last = func.body[block.end - 1].opcode;
+        if (!op_falls_through(last) || b + 1 >= n || next == b + 1) continue;
+        size_t fall = b + 1;
+        if (label[fall] == NO_BLOCK) {
+            label[fall] = next_label++;
+            fresh[fall] = true;
+        }
+        Op jmp;
+        jmp.type = OpType::JmpLabel;
+        jmp.label = label[fall];
+        if (is_conditional(last) && next != NO_BLOCK && next == cfg.block_of_label[last.label]) {
+            Op branch = last;
+            invert_branch(branch, label[fall]);
+            tail[b].push_back(branch);
+            inverted++;
+        } else {
+            tail[b].push_back(last);
+            tail[b].push_back(jmp);
+        }
+    }
+    std::vector<OpWithLocation> body;
+    body.reserve(func.body.size() + n);
+    size_t cold_begin = 0;
+    for (size_t k = 0; k < n; k++) {
+        size_t b = order[k];
+        if (k == hot_blocks) cold_begin = body.size();
+        const BasicBlock& block = cfg.blocks[b];
+        size_t next = k + 1 < n && k + 1 != hot_blocks ? order[k + 1] : NO_BLOCK;
+        if (fresh[b]) {
+            OpWithLocation owl;
+            owl.opcode.type = OpType::Label;
+            owl.opcode.label = label[b];
+            owl.loc = func.body[block.begin].loc;
+            body.push_back(owl);
+        }
+        size_t end = block.end;
+        const Op& last = func.body[end - 1].opcode;
+        bool drop_jump = last.type == OpType::JmpLabel && next != NO_BLOCK &&
+                         cfg.block_of_label[last.label] == next;
+        if (!tail[b].empty() || drop_jump) end--;
+        for (size_t i = block.begin; i < end; i++) {
+            body.push_back(func.body[i]);
+        }
+        for (const Op& op : tail[b]) {
+            OpWithLocation owl;
+            owl.opcode = op;
+            owl.loc = func.body[block.end - 1].loc;
+            owl.count = func.body[block.end - 1].count;
+            body.push_back(owl);
+        }
+    }
+    func.cold_ops = hot_blocks < n ? body.size() - cold_begin : 0;
+    func.body.swap(body);
+    if (options.report) {
+        printf("INFO: %s: moved %zu blocks, inverted %zu branches, %zu cold blocks\n",
+               func.name.c_str(), moved, inverted, n - hot_blocks);
+    }
+    return moved > 0;
+}
@@ -235,7 +235,7 @@ bool Lexer::parse_string_into_storage(char delim) {
 bool Lexer::get_token() {
     while (true) {
         skip_whitespaces();
-        if (skip_prefix("
+        if (skip_prefix("//")) {
             skip_until("\n");
             continue;
         }
@@ -0,0 +1,129 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+#include <algorithm>
+static bool hoist_from_loop(Func& func, const Cfg& cfg, const LoopInfo& info, size_t l,
+                            const Liveness& live, const BitSet& escaped, size_t& hoisted) {
+    const Loop& loop = info.loops[l];
+    if (!can_insert_preheader(func, cfg, info, l)) return false;
+    size_t slots = func.auto_vars_count + 1;
+    std::vector<size_t> def_count(slots, 0);
+    bool memory_written = false;
+    for (size_t b : loop.blocks) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+            const Op& op = func.body[i].opcode;
+            memory_written |= op_writes_memory(op);
+            size_t def;
+            if (op_defined_slot(op, def)) def_count[def]++;
+        }
+    }
+    std::vector<bool> invariant(slots, false);
+    for (size_t s = 1; s < slots; s++) {
+        invariant[s] = def_count[s] == 0 && (!escaped.test(s) || !memory_written);
+    }
+    auto invariant_arg = [&](const Arg& arg) {
+        if (is_constant_arg(arg)) return true;
+        if (arg.type == ArgType::AutoVar) return static_cast<bool>(invariant[arg.index]);
+        if (arg.type == ArgType::External) return !memory_written;
+        return false;
+    };
+    std::vector<size_t> order;
+    std::vector<bool> hoist(func.body.size(), false);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t b : loop.blocks) {
+            for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+                if (hoist[i]) continue;
+                const Op& op = func.body[i].opcode;
+                size_t dest;
+                switch (op.type) {
+                    case OpType::Binop:
+                        if ((op.binop == Binop::Div || op.binop == Binop::Mod) &&
+                            (op.arg2.type != ArgType::Literal || op.arg2.value == 0)) {
+                            continue;
+                        }
+                        if (!invariant_arg(op.arg) || !invariant_arg(op.arg2)) continue;
+                        break;
+                    case OpType::Negate:
+                    case OpType::UnaryNot:
+                    case OpType::AutoAssign:
+                        if (!invariant_arg(op.arg)) continue;
+                        break;
+                    case OpType::Intrinsic:
+                        if (intrinsic_reads_memory(op) || intrinsic_writes_memory(op)) continue;
+                        if (!std::all_of(op.funcall_args.begin(), op.funcall_args.end(), invariant_arg)) continue;
+                        break;
+                    default:
+                        continue;
+                }
+                op_defined_slot(op, dest);
+                if (def_count[dest] != 1 || escaped.test(dest) ||
+                    live.live_in[loop.header].test(dest)) {
+                    continue;
+                }
+                hoist[i] = true;
+                invariant[dest] = true;
+                order.push_back(i);
+                changed = true;
+            }
+        }
+    }
+    if (order.empty()) return false;
+    std::vector<OpWithLocation> preheader = open_preheader(func, cfg, info, l);
+    for (size_t h : order) {
+        preheader.push_back(func.body[h]);
+        preheader.back().count = NO_COUNT;
+    }
+    size_t header_begin = cfg.blocks[loop.header].begin;
+    std::vector<OpWithLocation> body;
+    body.reserve(func.body.size() + 1);
+    for (size_t i = 0; i < func.body.size(); i++) {
+        if (i == header_begin) {
+            body.insert(body.end(), preheader.begin(), preheader.end());
+        }
+        if (!hoist[i]) body.push_back(func.body[i]);
+    }
+    func.body.swap(body);
+    hoisted += order.size();
+    return true;
+}
+bool hoist_loop_invariants(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    unsigned long long cost_before = estimated_op_cost(func);
+    size_t hoisted = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        Cfg cfg;
+        build_cfg(func, cfg);
+        if (cfg.blocks.empty()) break;
+        DomTree dom;
+        compute_dominators(cfg, dom);
+        LoopInfo info;
+        find_loops(cfg, dom, info);
+        if (info.loops.empty()) break;
+        Liveness live;
+        compute_liveness(func, cfg, live);
+        BitSet escaped;
+        escaped_slots(func, escaped);
+        std::vector<size_t> order;
+        for (size_t l = 0; l < info.loops.size(); l++) {
+            order.push_back(l);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return info.loops[a].depth > info.loops[b].depth;
+        });
+        for (size_t l : order) {
+            if (hoist_from_loop(func, cfg, info, l, live, escaped, hoisted)) {
+                changed = true;
+                break;
+            }
+        }
+    }
+    if (options.report) {
+        printf("INFO: %s: hoisted %zu loop-invariant ops (estimated cost %llu -> %llu)\n",
+               func.name.c_str(), hoisted, cost_before, estimated_op_cost(func));
+    }
+    return hoisted > 0;
+}
@@ -5,9 +5,18 @@
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
 #include "lexer.h"
 #include "compiler.h"
 #include "ir.h"
+#include "opt.h"
+#include "profile.h"
+#include "x86_64.h"
+#include "fasm.h"
+#include "elf64.h"
 struct Flag {
     std::string name;
     std::string description;
@@ -41,6 +50,12 @@ bool parse_flags(int argc, char** argv) {
             continue;
         }
         std::string flag_name = arg.substr(1);
+        size_t eq = flag_name.find('=');
+        std::string inline_value;
+        if (eq != std::string::npos) {
+            inline_value = flag_name.substr(eq + 1);
+            flag_name = flag_name.substr(0, eq);
+        }
         Flag* found = nullptr;
         for (Flag* f : g_flags) {
             if (f->name == flag_name) {
@@ -53,7 +68,13 @@ bool parse_flags(int argc, char** argv) {
             return false;
         }
         if (found->is_bool) {
+            if (eq != std::string::npos) {
+                fprintf(stderr, "ERROR: Flag -%s takes no value\n", flag_name.c_str());
+                return false;
+            }
             found->bool_value = true;
+        } else if (eq != std::string::npos) {
+            found->value = inline_value;
         } else {
             if (i + 1 >= argc) {
                 fprintf(stderr, "ERROR: Flag -%s requires a value\n", flag_name.c_str());
@@ -80,6 +101,7 @@ void print_usage() {
             fprintf(stderr, "\n");
         }
     }
+    fprintf(stderr, "Flags that take a value also accept it as -flag=<val>\n");
 }
 bool read_entire_file(const char* path, std::string& content) {
     std::ifstream file(path, std::ios::binary);
@@ -107,9 +129,63 @@ bool write_entire_file(const char* path, const std::string& content) {
     file.write(content.c_str(), content.size());
     return file.good();
 }
+bool run_command(const std::vector<std::string>& args) {
+    std::string line = "CMD:";
+    for (const std::string& arg : args) {
+        line += " " + arg;
+    }
+    printf("%s\n", line.c_str());
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "ERROR: could not fork: %s\n", strerror(errno));
+        return false;
+    }
+    if (pid == 0) {
+        std::vector<char*> argv;
+        for (const std::string& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        fprintf(stderr, "ERROR: could not run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0) {
+        fprintf(stderr, "ERROR: could not wait for %s: %s\n", args[0].c_str(), strerror(errno));
+        return false;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ERROR: %s failed\n", args[0].c_str());
+        return false;
+    }
+    return true;
+}
+bool parse_target(const std::string& name, Target& target) {
+    if (name == "ir" || name.empty()) {
+        target = Target::IR;
+    } else if (name == "fasm-x86_64-linux") {
+        target = Target::Fasm_x86_64_Linux;
+    } else if (name == "elf-x86_64-linux") {
+        target = Target::Elf_x86_64_Linux;
+    } else {
+        return false;
+    }
+    return true;
+}
 int main(int argc, char** argv) {
     Flag* output_flag = add_string_flag("o", "", "Output file path");
-    Flag* target_flag = add_string_flag("t", "ir", "Compilation target (ir, list)");
+    Flag* target_flag = add_string_flag("t", "ir", "Compilation target (ir, fasm-x86_64-linux, elf-x86_64-linux, list)");
+    Flag* optimize_flag = add_bool_flag("O", false, "Run the IR optimization passes");
+    Flag* stats_flag = add_bool_flag("stats", false, "Report per-function optimization statistics");
+    Flag* profile_generate_flag = add_string_flag("fprofile-generate", "", "Count executed blocks and write the profile to this file at exit");
+    Flag* profile_use_flag = add_string_flag("fprofile-use", "", "Optimize with a profile written by a -fprofile-generate build");
+    Flag* asm_only_flag = add_bool_flag("S", false, "Stop after writing the assembly file");
+    Flag* object_only_flag = add_bool_flag("c", false, "Stop after writing the object file (elf targets)");
+    Flag* nostdlib_flag = add_bool_flag("nostdlib", false, "Write a static executable without libc or a linker (elf targets)");
+    Flag* fasm_flag = add_string_flag("fasm", "fasm", "Assembler used by fasm targets");
+    Flag* cc_flag = add_string_flag("cc", "cc", "Linker driver used by native targets");
     Flag* help_flag = add_bool_flag("h", false, "Show this help message");
     Flag* help_flag2 = add_bool_flag("help", false, "Show this help message");
     if (!parse_flags(argc, argv)) {
@@ -122,9 +198,25 @@ int main(int argc, char** argv) {
     }
     if (target_flag->value == "list") {
         fprintf(stderr, "Available targets:\n");
-        fprintf(stderr, "  ir - Intermediate Representation (text format)\n");
+        fprintf(stderr, "  ir                - Intermediate Representation (text format)\n");
+        fprintf(stderr, "  fasm-x86_64-linux - x86-64 Linux executable, assembled with fasm\n");
+        fprintf(stderr, "  elf-x86_64-linux  - x86-64 Linux executable, encoded without an assembler\n");
         return 0;
     }
+    Target target;
+    if (!parse_target(target_flag->value, target)) {
+        fprintf(stderr, "ERROR: Unknown target '%s'\n", target_flag->value.c_str());
+        fprintf(stderr, "       Use -t list to see available targets\n");
+        return 1;
+    }
+    if (!profile_generate_flag->value.empty() && !profile_use_flag->value.empty()) {
+        fprintf(stderr, "ERROR: -fprofile-generate and -fprofile-use cannot be combined\n");
+        return 1;
+    }
+    if (!profile_generate_flag->value.empty() && nostdlib_flag->bool_value) {
+        fprintf(stderr, "ERROR: -fprofile-generate writes the profile through libc and cannot be used with -nostdlib\n");
+        return 1;
+    }
     if (g_positional_args.empty()) {
         fprintf(stderr, "ERROR: no input file provided\n");
         print_usage();
@@ -140,7 +232,13 @@ int main(int argc, char** argv) {
         if (dot != std::string::npos) {
             output_path = output_path.substr(0, dot);
         }
-        output_path += ".ir";
+        if (target == Target::IR) {
+            output_path += ".ir";
+        } else if (asm_only_flag->bool_value) {
+            output_path += ".asm";
+        } else if (object_only_flag->bool_value) {
+            output_path += ".o";
+        }
     }
     std::string input_content;
     if (!read_entire_file(input_path, input_content)) {
@@ -149,7 +247,7 @@ int main(int argc, char** argv) {
     Lexer lexer(input_path, input_content.c_str(), 
                 input_content.c_str() + input_content.size());
     Compiler compiler;
-    compiler.target = Target::IR;
+    compiler.target = target;
     printf("INFO: Compiling %s\n", input_path);
     if (!compile_program(lexer, compiler)) {
         fprintf(stderr, "ERROR: Compilation failed\n");
@@ -159,17 +257,84 @@ int main(int argc, char** argv) {
         fprintf(stderr, "ERROR: Compilation failed with %zu errors\n", compiler.error_count);
         return 1;
     }
-    if (target_flag->value == "ir" || target_flag->value.empty()) {
+    if (stats_flag->bool_value && compiler.reused_string_bytes > 0) {
+        printf("INFO: repeated string literals share %zu data bytes\n", compiler.reused_string_bytes);
+    }
+    if (!profile_generate_flag->value.empty() &&
+        !instrument_program(compiler, profile_generate_flag->value)) {
+        return 1;
+    }
+    if (!profile_use_flag->value.empty()) {
+        ProfileData profile;
+        if (!read_profile(profile_use_flag->value.c_str(), profile)) {
+            return 1;
+        }
+        apply_profile(compiler, profile, stats_flag->bool_value);
+    }
+    if (optimize_flag->bool_value) {
+        OptOptions options;
+        options.report = stats_flag->bool_value;
+        options.libc = !nostdlib_flag->bool_value;
+        optimize_program(compiler, options);
+    }
+    if (target == Target::IR) {
         IRGenerator ir_gen;
         ir_gen.generate_program(compiler);
         if (!write_entire_file(output_path.c_str(), ir_gen.output)) {
             return 1;
         }
         printf("INFO: Generated %s\n", output_path.c_str());
+    } else if (target == Target::Fasm_x86_64_Linux || asm_only_flag->bool_value) {
+        X86Program program;
+        lower_x86_64(compiler, program, optimize_flag->bool_value, stats_flag->bool_value);
+        FasmGenerator fasm_gen;
+        fasm_gen.generate_program(compiler, program);
+        std::string asm_path = asm_only_flag->bool_value ? output_path : output_path + ".asm";
+        if (!write_entire_file(asm_path.c_str(), fasm_gen.output)) {
+            return 1;
+        }
+        printf("INFO: Generated %s\n", asm_path.c_str());
+        if (!asm_only_flag->bool_value) {
+            std::string object_path = output_path + ".o";
+            if (!run_command({fasm_flag->value, asm_path, object_path})) {
+                return 1;
+            }
+            if (!run_command({cc_flag->value, "-no-pie", "-o", output_path, object_path})) {
+                return 1;
+            }
+            printf("INFO: Generated %s\n", output_path.c_str());
+        }
     } else {
-        fprintf(stderr, "ERROR: Unknown target '%s'\n", target_flag->value.c_str());
-        fprintf(stderr, "       Use -t list to see available targets\n");
-        return 1;
+        X86Program program;
+        lower_x86_64(compiler, program, optimize_flag->bool_value, stats_flag->bool_value);
+        ObjectFile obj;
+        if (!encode_x86_64(compiler, program, obj)) {
+            return 1;
+        }
+        std::string image;
+        if (nostdlib_flag->bool_value) {
+            if (!write_elf_executable(obj, image)) {
+                return 1;
+            }
+            if (!write_entire_file(output_path.c_str(), image)) {
+                return 1;
+            }
+            chmod(output_path.c_str(), 0755);
+        } else {
+            write_elf_object(obj, image);
+            std::string object_path = object_only_flag->bool_value ? output_path : output_path + ".o";
+            if (!write_entire_file(object_path.c_str(), image)) {
+                return 1;
+            }
+            printf("INFO: Generated %s\n", object_path.c_str());
+            if (!object_only_flag->bool_value &&
+                !run_command({cc_flag->value, "-no-pie", "-o", output_path, object_path})) {
+                return 1;
+            }
+        }
+        if (!object_only_flag->bool_value) {
+            printf("INFO: Generated %s\n", output_path.c_str());
+        }
     }
     for (Flag* f : g_flags) {
         delete f;
@@ -0,0 +1,106 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+struct AddressResolver {
+    Func& func;
+    const Cfg& cfg;
+    const DomTree& dom;
+    const std::vector<SlotClass>& classes;
+    size_t resolved;
+
+    AddressResolver(Func& f, const Cfg& c, const DomTree& d, const std::vector<SlotClass>& cl)
+        : func(f), cfg(c), dom(d), classes(cl), resolved(0) {}
+    bool target(const MemoryModel& model, size_t pointer, size_t& slot) const;
+    void visit(size_t b, MemoryModel& model);
+};
+// The scalar slot the value of pointer is the address of, if known
+bool AddressResolver::target(const MemoryModel& model, size_t pointer, size_t& slot) const {
+    const MemoryLocation& loc = model.points_to[pointer];
+    if (loc.base != MemoryBase::Slot || !loc.exact || loc.offset != 0) return false;
+    if (classes[loc.slot] != SlotClass::AddressTaken) return false;
+    slot = loc.slot;
+    return true;
+}
+void AddressResolver::visit(size_t b, MemoryModel& model) {
+    const BasicBlock& block = cfg.blocks[b];
+    if (b != 0 && !(block.preds.size() == 1 && block.preds[0] == dom.idom[b])) model.enter_join();
+    std::vector<Arg*> args;
+    for (size_t i = block.begin; i < block.end; i++) {
+        Op& op = func.body[i].opcode;
+        size_t slot;
+        op_args(op, args);
+        for (Arg* arg : args) {
+            if (arg->type == ArgType::Deref && target(model, arg->index, slot)) {
+                *arg = Arg::make_auto_var(slot);
+                resolved++;
+            }
+        }
+        if (op.type == OpType::Store && target(model, op.index, slot)) {
+            op.type = OpType::AutoAssign;
+            op.index = slot;
+            resolved++;
+        }
+        model.step(op);
+    }
+    for (size_t c : dom.children[b]) {
+        MemoryModel child = model;
+        visit(c, child);
+    }
+}
+// Drops pure ops assigning slots nothing reads, such as the pointers whose
+// every use was resolved, so that their `&x` goes with them
+static void remove_unused_defs(Func& func) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        std::vector<SlotClass> classes;
+        classify_slots(func, classes);
+        std::vector<size_t> uses(func.auto_vars_count + 1, 0);
+        std::vector<size_t> used;
+        for (const OpWithLocation& owl : func.body) {
+            op_used_slots(owl.opcode, used);
+            for (size_t u : used) uses[u]++;
+        }
+        std::vector<OpWithLocation> body;
+        for (const OpWithLocation& owl : func.body) {
+            size_t def;
+            if (is_pure_op(owl.opcode) && op_defined_slot(owl.opcode, def) &&
+                classes[def] == SlotClass::Promotable && uses[def] == 0) {
+                changed = true;
+                continue;
+            }
+            body.push_back(owl);
+        }
+        func.body.swap(body);
+    }
+}
+bool promote_address_taken_slots(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    std::vector<SlotClass> before;
+    classify_slots(func, before);
+    Cfg cfg;
+    build_cfg(func, cfg);
+    if (cfg.blocks.empty()) return false;
+    DomTree dom;
+    compute_dominators(cfg, dom);
+    BitSet escaped;
+    escaped_slots(func, escaped);
+    BitSet ssa;
+    single_def_slots(func, cfg, dom, escaped, ssa);
+    MemoryModel model(func, escaped, ssa);
+    AddressResolver resolver(func, cfg, dom, before);
+    resolver.visit(0, model);
+    if (resolver.resolved == 0) return false;
+    remove_unused_defs(func);
+    std::vector<SlotClass> after;
+    classify_slots(func, after);
+    size_t promoted = 0;
+    for (size_t s = 1; s < after.size(); s++) {
+        if (before[s] == SlotClass::AddressTaken && after[s] == SlotClass::Promotable) promoted++;
+    }
+    if (options.report) {
+        printf("INFO: %s: resolved %zu accesses through pointers, promoted %zu address-taken slots\n",
+               func.name.c_str(), resolver.resolved, promoted);
+    }
+    return true;
+}
@@ -0,0 +1,255 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+static const size_t MEMOPT_MAX_VALUES = 64;
+// A memory word known to hold the value of a slot or constant
+struct KnownValue {
+    MemoryLocation loc;
+    Arg value;
+};
+// Memory an op touched, recorded on the way forward for the backward
+// dead store sweep
+struct MemoryAccess {
+    std::vector<MemoryLocation> reads;
+    bool writes;
+    MemoryLocation write;
+    bool clobbers;
+    bool defines;
+    size_t def;
+
+    MemoryAccess() : writes(false), clobbers(false), defines(false), def(0) {}
+};
+// Bytes an intrinsic reads through a pointer may be anywhere
+static MemoryLocation anywhere() {
+    MemoryLocation loc;
+    loc.base = MemoryBase::Pointer;
+    loc.slot = 0;
+    loc.offset = 0;
+    loc.exact = false;
+    return loc;
+}
+static bool is_store(const Op& op) {
+    return op.type == OpType::Store || op.type == OpType::ExternalAssign;
+}
+class MemoryForwarding {
+public:
+    MemoryForwarding(Func& f) : forwarded(0), redundant(0), dead_stores(0), func(f) {}
+    void run();
+
+    size_t forwarded;
+    size_t redundant;
+    size_t dead_stores;
+
+private:
+    Func& func;
+    Cfg cfg;
+    DomTree dom;
+    BitSet escaped;
+    BitSet ssa;
+    std::vector<bool> dead;
+
+    bool forwardable(const Arg& arg) const;
+    void visit(size_t b, MemoryModel& model, std::vector<KnownValue>& known);
+    void sweep_dead_stores(size_t b, const std::vector<MemoryAccess>& accesses);
+};
+bool MemoryForwarding::forwardable(const Arg& arg) const {
+    switch (arg.type) {
+        case ArgType::AutoVar:
+            return !escaped.test(arg.index);
+        case ArgType::RefAutoVar:
+        case ArgType::RefExternal:
+        case ArgType::Literal:
+        case ArgType::DataOffset:
+            return true;
+        default:
+            return false;
+    }
+}
+static const KnownValue* find_known(const std::vector<KnownValue>& known, const MemoryLocation& loc) {
+    for (size_t k = known.size(); k-- > 0;) {
+        if (alias_locations(known[k].loc, loc) == AliasResult::Must) return &known[k];
+    }
+    return nullptr;
+}
+static void forget_aliases(std::vector<KnownValue>& known, const MemoryLocation& loc) {
+    std::vector<KnownValue> kept;
+    for (const KnownValue& k : known) {
+        if (alias_locations(k.loc, loc) == AliasResult::No) kept.push_back(k);
+    }
+    known.swap(kept);
+}
+static void forget_slot(std::vector<KnownValue>& known, size_t slot) {
+    std::vector<KnownValue> kept;
+    for (const KnownValue& k : known) {
+        bool holds = k.value.type == ArgType::AutoVar && k.value.index == slot;
+        if (!holds && !location_uses_slot(k.loc, slot)) kept.push_back(k);
+    }
+    known.swap(kept);
+}
+static void remember(std::vector<KnownValue>& known, const MemoryLocation& loc, const Arg& value) {
+    if (known.size() >= MEMOPT_MAX_VALUES) known.erase(known.begin());
+    KnownValue k;
+    k.loc = loc;
+    k.value = value;
+    known.push_back(k);
+}
+// Reads take the value last stored or loaded at the same word, stores of
+// the value already there go, and what each op touched is recorded for
+// the dead store sweep. Facts flow on into blocks whose only predecessor
+// is their immediate dominator
+void MemoryForwarding::visit(size_t b, MemoryModel& model, std::vector<KnownValue>& known) {
+    const BasicBlock& block = cfg.blocks[b];
+    bool exact = b != 0 && block.preds.size() == 1 && block.preds[0] == dom.idom[b];
+    if (b != 0 && !exact) {
+        known.clear();
+        model.enter_join();
+    }
+    std::vector<MemoryAccess> accesses(block.end - block.begin);
+    for (size_t i = block.begin; i < block.end; i++) {
+        Op& op = func.body[i].opcode;
+        MemoryAccess& access = accesses[i - block.begin];
+        std::vector<Arg*> args;
+        op_args(op, args);
+        bool loads = false;
+        MemoryLocation load;
+        MemoryLocation loc;
+        if (op.type == OpType::Store && model.read_location(Arg::make_auto_var(op.index), loc)) {
+            access.reads.push_back(loc);
+        }
+        for (Arg* arg : args) {
+            if (op.type == OpType::Funcall && arg == &op.arg) continue;
+            if (arg->type == ArgType::Deref && model.read_location(Arg::make_auto_var(arg->index), loc)) {
+                access.reads.push_back(loc);
+            }
+            if (!model.read_location(*arg, loc)) continue;
+            const KnownValue* k = find_known(known, loc);
+            if (k) {
+                *arg = k->value;
+                forwarded++;
+                continue;
+            }
+            access.reads.push_back(loc);
+            if (op.type == OpType::AutoAssign) {
+                loads = true;
+                load = loc;
+            }
+        }
+        if (intrinsic_reads_memory(op)) access.reads.push_back(anywhere());
+        MemoryLocation write;
+        if (model.write_location(op, write)) {
+            const KnownValue* k = find_known(known, write);
+            if (is_store(op) && k && same_arg(k->value, op.arg)) {
+                dead[i] = true;
+                redundant++;
+                continue;
+            }
+            forget_aliases(known, write);
+            access.writes = true;
+            access.write = write;
+        }
+        if (model.clobbers_memory(op)) {
+            known.clear();
+            access.clobbers = true;
+        }
+        size_t def = 0;
+        if (op_defined_slot(op, def)) {
+            forget_slot(known, def);
+            access.defines = true;
+            access.def = def;
+        }
+        if (access.writes && forwardable(op.arg) && (is_store(op) || op.type == OpType::AutoAssign)) {
+            remember(known, write, op.arg);
+        } else if (loads && !escaped.test(def) && !location_uses_slot(load, def)) {
+            remember(known, load, Arg::make_auto_var(def));
+        }
+        model.step(op);
+    }
+    sweep_dead_stores(b, accesses);
+    for (size_t c : dom.children[b]) {
+        MemoryModel child_model = model;
+        std::vector<KnownValue> child_known = known;
+        visit(c, child_model, child_known);
+    }
+}
+// Walking back from the end of the block, a store is dead when a later
+// store writes the same word first, or when it writes the frame and the
+// block returns before anything may read it
+void MemoryForwarding::sweep_dead_stores(size_t b, const std::vector<MemoryAccess>& accesses) {
+    const BasicBlock& block = cfg.blocks[b];
+    std::vector<MemoryLocation> overwritten;
+    std::vector<MemoryLocation> frame_reads;
+    bool frame_dead = block.end > block.begin && func.body[block.end - 1].opcode.type == OpType::Return;
+    for (size_t i = block.end; i-- > block.begin;) {
+        if (dead[i]) continue;
+        const Op& op = func.body[i].opcode;
+        const MemoryAccess& access = accesses[i - block.begin];
+        if (access.defines) {
+            std::vector<MemoryLocation> kept;
+            for (const MemoryLocation& loc : overwritten) {
+                if (!location_uses_slot(loc, access.def)) kept.push_back(loc);
+            }
+            overwritten.swap(kept);
+            for (MemoryLocation& loc : frame_reads) {
+                if (location_uses_slot(loc, access.def)) loc.exact = false;
+            }
+        }
+        if (access.writes) {
+            bool dead_store = false;
+            for (const MemoryLocation& loc : overwritten) {
+                if (alias_locations(loc, access.write) == AliasResult::Must) dead_store = true;
+            }
+            if (frame_dead && access.write.base == MemoryBase::Slot) {
+                dead_store = true;
+                for (const MemoryLocation& loc : frame_reads) {
+                    if (alias_locations(loc, access.write) != AliasResult::No) dead_store = false;
+                }
+            }
+            if (dead_store && is_store(op)) {
+                dead[i] = true;
+                dead_stores++;
+                continue;
+            }
+            overwritten.push_back(access.write);
+        }
+        if (access.clobbers) {
+            overwritten.clear();
+            frame_reads.clear();
+            frame_dead = false;
+        }
+        for (const MemoryLocation& read : access.reads) {
+            std::vector<MemoryLocation> kept;
+            for (const MemoryLocation& loc : overwritten) {
+                if (alias_locations(loc, read) == AliasResult::No) kept.push_back(loc);
+            }
+            overwritten.swap(kept);
+            if (frame_dead) frame_reads.push_back(read);
+        }
+    }
+}
+void MemoryForwarding::run() {
+    build_cfg(func, cfg);
+    if (cfg.blocks.empty()) return;
+    compute_dominators(cfg, dom);
+    escaped_slots(func, escaped);
+    single_def_slots(func, cfg, dom, escaped, ssa);
+    dead.assign(func.body.size(), false);
+    MemoryModel model(func, escaped, ssa);
+    std::vector<KnownValue> known;
+    visit(0, model, known);
+    if (redundant + dead_stores == 0) return;
+    std::vector<OpWithLocation> body;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        if (!dead[i]) body.push_back(func.body[i]);
+    }
+    func.body.swap(body);
+}
+bool eliminate_redundant_memory_ops(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    MemoryForwarding pass(func);
+    pass.run();
+    if (options.report) {
+        printf("INFO: %s: forwarded %zu loads, removed %zu redundant and %zu dead stores\n", func.name.c_str(),
+               pass.forwarded, pass.redundant, pass.dead_stores);
+    }
+    return pass.forwarded + pass.redundant + pass.dead_stores > 0;
+}
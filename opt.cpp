@@ -0,0 +1,24 @@
+#include "opt.h"
+void optimize_program(Compiler& c, const OptOptions& options) {
+    inline_functions(c, options);
+    specialize_functions(c, options);
+    eliminate_dead_globals(c, options);
+    recognize_loop_idioms(c, options);
+    for (size_t i = 0; i < c.funcs.size(); i++) {
+        Func& func = c.funcs[i];
+        promote_address_taken_slots(func, options);
+        eliminate_tail_calls(func, options);
+        unroll_loops(func, options);
+        split_slot_webs(func, options);
+        value_number(func, options);
+        eliminate_redundant_memory_ops(func, options);
+        hoist_loop_invariants(func, options);
+        reduce_induction_variables(func, options);
+        simplify_algebra(func, options);
+        canonicalize_branches(func, options);
+        eliminate_dead_code(func, options);
+        compact_auto_slots(func, options);
+        layout_blocks(func, options);
+    }
+    eliminate_dead_globals(c, options);
+}
@@ -0,0 +1,112 @@
+#ifndef OPT_H
+#define OPT_H
+
+#include "compiler.h"
+#include <vector>
+
+// Relative cost of one op of each kind on the code generation target
+struct TargetCosts {
+    unsigned mult;
+    unsigned shift;
+    unsigned add;
+    unsigned unroll;  // Copies of a small counted loop body per iteration
+
+    TargetCosts() : mult(3), shift(1), add(1), unroll(4) {}
+};
+
+struct OptOptions;
+
+// State handed to a peephole rule looking at func->body[index]
+struct PeepholeContext {
+    Func* func;
+    const OptOptions* options;
+    size_t block_begin;
+    size_t index;
+    std::vector<Op> before;  // Ops to insert in front of the rewritten op
+};
+
+// Rewrites op in place and returns true if it fired. Rules are looked up
+// by op type and, for binops, by operator
+typedef bool (*PeepholeFn)(PeepholeContext& ctx, Op& op);
+
+struct PeepholeRule {
+    const char* name;
+    OpType type;
+    Binop binop;
+    PeepholeFn apply;
+};
+
+// Optimizer settings, filled in from the command line
+struct OptOptions {
+    bool report;  // Print per-function statistics for each pass
+    bool libc;    // Optimized code may call memset and memmove
+    TargetCosts costs;
+    std::vector<PeepholeRule> target_rules;  // Tried before the generic rules
+
+    OptOptions() : report(false), libc(false) {}
+};
+
+// Runs the IR pass pipeline over every function of the program
+void optimize_program(Compiler& c, const OptOptions& options);
+
+// Splices small callees, callees with a single call site and callees called
+// often (by loop depth or profile) into their callers, callees first.
+// Recursive calls and callees with inline assembly stay calls
+bool inline_functions(Compiler& c, const OptOptions& options);
+
+// Clones functions called with literal arguments for parameters they
+// compute or branch with, dropping those parameters from the clone's
+// signature, and redirects the calls. Identical bindings share one clone,
+// and the total size of clones is bounded
+bool specialize_functions(Compiler& c, const OptOptions& options);
+
+// Drops functions, globals and extrn declarations not reachable from main,
+// or from every definition in a program without main, and the string
+// literals only they used. Names in inline assembly count as references.
+// The remaining literals are laid out suffix-sorted so that one ending
+// another shares its bytes
+bool eliminate_dead_globals(Compiler& c, const OptOptions& options);
+
+// Counted loops storing a byte-splat word or copying the word at the same
+// index, one word per step, become a memset or memmove call over the rest
+// of the range, and iv takes its final value. Forward copies into a source
+// they overlap and stores over a global the loop reads its base from jump
+// to the original loop instead. Needs options.libc, and is skipped for a
+// program defining the kernel's name itself
+bool recognize_loop_idioms(Compiler& c, const OptOptions& options);
+
+// Individual passes. Each returns true if it changed the function
+// Loads and stores through a pointer known to hold `&x` of a scalar slot
+// become reads and writes of x, and pointers left unused are dropped. A
+// slot whose every `&x` goes becomes promotable (see classify_slots)
+bool promote_address_taken_slots(Func& func, const OptOptions& options);
+// A call of the function itself whose result is returned at once becomes
+// assignments to the parameters and a jump back to the start. Functions
+// whose slots may be reached through pointers keep their calls
+bool eliminate_tail_calls(Func& func, const OptOptions& options);
+// Loops of a compare-and-branch header and a straight-line body stepping
+// one slot by a constant: known short trip counts are unrolled fully, and
+// others run costs.unroll bodies per test ahead of the original loop,
+// which finishes the remainder. Profiled loops with few iterations per
+// entry are kept. Copied ops keep their source locations; temporaries of
+// the copies are told apart by split_slot_webs, which runs next
+bool unroll_loops(Func& func, const OptOptions& options);
+bool split_slot_webs(Func& func, const OptOptions& options);
+bool value_number(Func& func, const OptOptions& options);
+// Loads of a word last stored or loaded on the same straight-line path
+// take that value, stores of the value a word already holds are dropped,
+// and stores overwritten before any possible read, or to the frame right
+// before a return, are removed. Aliasing follows MemoryModel
+bool eliminate_redundant_memory_ops(Func& func, const OptOptions& options);
+bool hoist_loop_invariants(Func& func, const OptOptions& options);
+bool reduce_induction_variables(Func& func, const OptOptions& options);
+bool simplify_algebra(Func& func, const OptOptions& options);
+bool canonicalize_branches(Func& func, const OptOptions& options);
+bool eliminate_dead_code(Func& func, const OptOptions& options);
+bool compact_auto_slots(Func& func, const OptOptions& options);
+// Reorders blocks into fall-through chains and moves cold blocks to the end
+// of the body, recorded in Func::cold_ops. Profiled functions use their
+// block counts, and blocks that never ran are cold
+bool layout_blocks(Func& func, const OptOptions& options);
+
+#endif // OPT_H
@@ -0,0 +1,492 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+#include <algorithm>
+static bool is_literal(const Arg& arg, long long value) {
+    return arg.type == ArgType::Literal && static_cast<long long>(arg.value) == value;
+}
+static bool same_slot(const Arg& a, const Arg& b) {
+    return a.type == ArgType::AutoVar && b.type == ArgType::AutoVar && a.index == b.index;
+}
+static int power_of_two(const Arg& arg) {
+    if (arg.type != ArgType::Literal) return -1;
+    long long value = static_cast<long long>(arg.value);
+    if (value < 2 || (value & (value - 1)) != 0) return -1;
+    int k = 0;
+    while ((1LL << k) != value) k++;
+    return k;
+}
+static size_t op_dest(const Op& op) {
+    size_t dest = 0;
+    op_defined_slot(op, dest);
+    return dest;
+}
+static void set_copy(Op& op, const Arg& src) {
+    size_t dest = op_dest(op);
+    op.type = OpType::AutoAssign;
+    op.index = dest;
+    op.arg = src;
+}
+static void set_binop(Op& op, Binop binop, const Arg& lhs, const Arg& rhs) {
+    size_t dest = op_dest(op);
+    op.type = OpType::Binop;
+    op.binop = binop;
+    op.index = dest;
+    op.arg = lhs;
+    op.arg2 = rhs;
+}
+static void set_negate(Op& op, const Arg& src) {
+    size_t dest = op_dest(op);
+    op.type = OpType::Negate;
+    op.result = dest;
+    op.arg = src;
+}
+static Arg emit_binop(PeepholeContext& ctx, Binop binop, const Arg& lhs, const Arg& rhs) {
+    Op op;
+    op.type = OpType::Binop;
+    op.binop = binop;
+    op.index = ++ctx.func->auto_vars_count;
+    op.arg = lhs;
+    op.arg2 = rhs;
+    ctx.before.push_back(op);
+    return Arg::make_auto_var(op.index);
+}
+static Binop inverted_comparison(Binop op) {
+    switch (op) {
+        case Binop::Less:         return Binop::GreaterEqual;
+        case Binop::Greater:      return Binop::LessEqual;
+        case Binop::LessEqual:    return Binop::Greater;
+        case Binop::GreaterEqual: return Binop::Less;
+        case Binop::Equal:        return Binop::NotEqual;
+        default:                  return Binop::Equal;
+    }
+}
+static Binop mirrored_comparison(Binop op) {
+    switch (op) {
+        case Binop::Less:         return Binop::Greater;
+        case Binop::Greater:      return Binop::Less;
+        case Binop::LessEqual:    return Binop::GreaterEqual;
+        case Binop::GreaterEqual: return Binop::LessEqual;
+        default:                  return op;
+    }
+}
+static bool is_commutative(Binop op) {
+    switch (op) {
+        case Binop::Plus:
+        case Binop::Mult:
+        case Binop::Equal:
+        case Binop::NotEqual:
+        case Binop::BitOr:
+        case Binop::BitAnd:
+            return true;
+        default:
+            return false;
+    }
+}
+static bool fold_intrinsic(const Op& op, unsigned long long& out) {
+    for (const Arg& arg : op.funcall_args) {
+        if (arg.type != ArgType::Literal) return false;
+    }
+    unsigned long long x = op.funcall_args[0].value;
+    unsigned n = op.funcall_args.size() > 1 ? static_cast<unsigned>(op.funcall_args[1].value & 63) : 0;
+    switch (op.intrinsic) {
+        case Intrinsic::Popcount: out = static_cast<unsigned long long>(__builtin_popcountll(x)); return true;
+        case Intrinsic::Clz:      out = x == 0 ? 64 : static_cast<unsigned long long>(__builtin_clzll(x)); return true;
+        case Intrinsic::Ctz:      out = x == 0 ? 64 : static_cast<unsigned long long>(__builtin_ctzll(x)); return true;
+        case Intrinsic::Bswap:    out = __builtin_bswap64(x); return true;
+        case Intrinsic::Rotl:     out = n == 0 ? x : (x << n) | (x >> (64 - n)); return true;
+        case Intrinsic::Rotr:     out = n == 0 ? x : (x >> n) | (x << (64 - n)); return true;
+        default:                  return false;
+    }
+}
+static bool fold_constants(Op& op) {
+    if (op.type == OpType::Binop) {
+        unsigned long long value;
+        if (op.arg.type != ArgType::Literal || op.arg2.type != ArgType::Literal) return false;
+        if (!fold_binop(op.binop, op.arg.value, op.arg2.value, value)) return false;
+        set_copy(op, Arg::make_literal(value));
+        return true;
+    }
+    if (op.type == OpType::Negate && op.arg.type == ArgType::Literal) {
+        set_copy(op, Arg::make_literal(0 - op.arg.value));
+        return true;
+    }
+    if (op.type == OpType::UnaryNot && op.arg.type == ArgType::Literal) {
+        set_copy(op, Arg::make_literal(op.arg.value == 0));
+        return true;
+    }
+    if (op.type == OpType::Intrinsic) {
+        unsigned long long value;
+        if (!fold_intrinsic(op, value)) return false;
+        set_copy(op, Arg::make_literal(value));
+        op.funcall_args.clear();
+        return true;
+    }
+    if (op.type == OpType::JmpTable && op.arg.type == ArgType::Literal) {
+        if (op.arg.value < op.labels.size()) op.label = op.labels[op.arg.value];
+        op.type = OpType::JmpLabel;
+        op.arg = Arg();
+        op.labels.clear();
+        return true;
+    }
+    return false;
+}
+static bool canonicalize_operands(Op& op) {
+    if (op.type != OpType::Binop) return false;
+    if (op.arg.type != ArgType::Literal || op.arg2.type == ArgType::Literal) return false;
+    if (is_commutative(op.binop)) {
+        std::swap(op.arg, op.arg2);
+        return true;
+    }
+    if (is_comparison(op.binop)) {
+        op.binop = mirrored_comparison(op.binop);
+        std::swap(op.arg, op.arg2);
+        return true;
+    }
+    return false;
+}
+static bool rule_add_zero(PeepholeContext&, Op& op) {
+    if (!is_literal(op.arg2, 0)) return false;
+    set_copy(op, op.arg);
+    return true;
+}
+static bool rule_sub(PeepholeContext&, Op& op) {
+    if (is_literal(op.arg2, 0)) {
+        set_copy(op, op.arg);
+        return true;
+    }
+    if (is_literal(op.arg, 0)) {
+        set_negate(op, op.arg2);
+        return true;
+    }
+    if (same_slot(op.arg, op.arg2)) {
+        set_copy(op, Arg::make_literal(0));
+        return true;
+    }
+    return false;
+}
+static bool rule_mult_identity(PeepholeContext&, Op& op) {
+    if (is_literal(op.arg2, 0)) {
+        set_copy(op, Arg::make_literal(0));
+        return true;
+    }
+    if (is_literal(op.arg2, 1)) {
+        set_copy(op, op.arg);
+        return true;
+    }
+    if (is_literal(op.arg2, -1)) {
+        set_negate(op, op.arg);
+        return true;
+    }
+    int k = power_of_two(op.arg2);
+    if (k < 0) return false;
+    set_binop(op, Binop::BitShl, op.arg, Arg::make_literal(k));
+    return true;
+}
+static Arg emit_negate(PeepholeContext& ctx, const Arg& x) {
+    Op op;
+    op.type = OpType::Negate;
+    op.result = ++ctx.func->auto_vars_count;
+    op.arg = x;
+    ctx.before.push_back(op);
+    return Arg::make_auto_var(op.result);
+}
+// x * c as a signed sum of shifted copies of x, one term per nonzero digit
+// of c in non-adjacent form. A negative c flips every sign, and a positive
+// term goes first so that only an all-negative sum needs a negation
+static bool rule_mult_decompose(PeepholeContext& ctx, Op& op) {
+    if (op.arg2.type != ArgType::Literal) return false;
+    bool negative = static_cast<long long>(op.arg2.value) < 0;
+    unsigned long long k = negative ? 0 - op.arg2.value : op.arg2.value;
+    if (k < 2 || k >= (1ULL << 62) || (!negative && k < 3)) return false;
+    std::vector<std::pair<int, bool>> terms;
+    for (int bit = 0; k != 0; bit++, k >>= 1) {
+        if ((k & 1) == 0) continue;
+        bool add = (k & 3) == 1;
+        terms.push_back(std::make_pair(bit, add != negative));
+        k = add ? k - 1 : k + 1;
+    }
+    if (!negative && terms.size() < 2) return false;
+    std::reverse(terms.begin(), terms.end());
+    for (size_t t = 0; t < terms.size(); t++) {
+        if (!terms[t].second) continue;
+        std::rotate(terms.begin(), terms.begin() + t, terms.begin() + t + 1);
+        break;
+    }
+    const TargetCosts& costs = ctx.options->costs;
+    unsigned cost = static_cast<unsigned>(terms.size() - 1) * costs.add;
+    for (const auto& term : terms) {
+        if (term.first != 0) cost += costs.shift;
+    }
+    if (!terms[0].second) cost += costs.add;
+    if (cost >= costs.mult) return false;
+    Arg x = op.arg;
+    auto term_arg = [&](int shift) {
+        if (shift == 0) return x;
+        return emit_binop(ctx, Binop::BitShl, x, Arg::make_literal(shift));
+    };
+    if (terms.size() == 1) {
+        set_negate(op, term_arg(terms[0].first));
+        return true;
+    }
+    Arg acc = term_arg(terms[0].first);
+    if (!terms[0].second) acc = emit_negate(ctx, acc);
+    for (size_t t = 1; t + 1 < terms.size(); t++) {
+        Arg term = term_arg(terms[t].first);
+        acc = emit_binop(ctx, terms[t].second ? Binop::Plus : Binop::Minus, acc, term);
+    }
+    Arg last = term_arg(terms.back().first);
+    set_binop(op, terms.back().second ? Binop::Plus : Binop::Minus, acc, last);
+    return true;
+}
+// Signed x / 2^k rounds toward zero: bias negative x by 2^k - 1 first
+static Arg emit_rounding_bias(PeepholeContext& ctx, const Arg& x, int k) {
+    Arg sign;
+    if (k == 1) {
+        sign = emit_binop(ctx, Binop::BitShr, x, Arg::make_literal(63));
+    } else {
+        sign = emit_binop(ctx, Binop::BitSar, x, Arg::make_literal(63));
+        sign = emit_binop(ctx, Binop::BitShr, sign, Arg::make_literal(64 - k));
+    }
+    return emit_binop(ctx, Binop::Plus, x, sign);
+}
+static bool rule_div(PeepholeContext& ctx, Op& op) {
+    if (is_literal(op.arg2, 1)) {
+        set_copy(op, op.arg);
+        return true;
+    }
+    if (is_literal(op.arg2, -1)) {
+        set_negate(op, op.arg);
+        return true;
+    }
+    int k = power_of_two(op.arg2);
+    if (k < 0) return false;
+    Arg biased = emit_rounding_bias(ctx, op.arg, k);
+    set_binop(op, Binop::BitSar, biased, Arg::make_literal(k));
+    return true;
+}
+static bool rule_mod(PeepholeContext& ctx, Op& op) {
+    if (is_literal(op.arg2, 1) || is_literal(op.arg2, -1)) {
+        set_copy(op, Arg::make_literal(0));
+        return true;
+    }
+    int k = power_of_two(op.arg2);
+    if (k < 0) return false;
+    Arg biased = emit_rounding_bias(ctx, op.arg, k);
+    Arg rounded = emit_binop(ctx, Binop::BitAnd, biased, Arg::make_literal(0 - (1ULL << k)));
+    set_binop(op, Binop::Minus, op.arg, rounded);
+    return true;
+}
+static bool rule_or(PeepholeContext&, Op& op) {
+    if (is_literal(op.arg2, 0) || same_slot(op.arg, op.arg2)) {
+        set_copy(op, op.arg);
+        return true;
+    }
+    if (is_literal(op.arg2, -1)) {
+        set_copy(op, op.arg2);
+        return true;
+    }
+    return false;
+}
+static bool rule_and(PeepholeContext&, Op& op) {
+    if (is_literal(op.arg2, 0)) {
+        set_copy(op, op.arg2);
+        return true;
+    }
+    if (is_literal(op.arg2, -1) || same_slot(op.arg, op.arg2)) {
+        set_copy(op, op.arg);
+        return true;
+    }
+    return false;
+}
+static bool rule_shift(PeepholeContext&, Op& op) {
+    if (is_literal(op.arg2, 0)) {
+        set_copy(op, op.arg);
+        return true;
+    }
+    if (is_literal(op.arg, 0)) {
+        set_copy(op, op.arg);
+        return true;
+    }
+    return false;
+}
+static bool rule_compare_self(PeepholeContext&, Op& op) {
+    if (!same_slot(op.arg, op.arg2)) return false;
+    bool reflexive = op.binop == Binop::Equal || op.binop == Binop::LessEqual ||
+                     op.binop == Binop::GreaterEqual;
+    set_copy(op, Arg::make_literal(reflexive ? 1 : 0));
+    return true;
+}
+static bool reads_memory(const Arg& arg, const BitSet& escaped) {
+    return arg.type == ArgType::Deref || arg.type == ArgType::External ||
+           (arg.type == ArgType::AutoVar && escaped.test(arg.index));
+}
+static bool changed_between(const Func& func, size_t from, size_t to, const Arg& arg,
+                            const BitSet& escaped) {
+    if (arg.type != ArgType::AutoVar && arg.type != ArgType::Deref &&
+        arg.type != ArgType::External) {
+        return false;
+    }
+    for (size_t k = from + 1; k < to; k++) {
+        const Op& op = func.body[k].opcode;
+        size_t def;
+        if (arg.type != ArgType::External && op_defined_slot(op, def) && def == arg.index) {
+            return true;
+        }
+        if (reads_memory(arg, escaped) && op_writes_memory(op)) {
+            return true;
+        }
+    }
+    return false;
+}
+// !(a < b) becomes a >= b and !!a becomes a != 0 when the inner result has
+// no other reader
+static bool rule_not_chain(PeepholeContext& ctx, Op& op) {
+    if (op.arg.type != ArgType::AutoVar) return false;
+    const Func& func = *ctx.func;
+    size_t t = op.arg.index;
+    size_t j = ctx.index;
+    size_t def = 0;
+    while (j > ctx.block_begin) {
+        j--;
+        if (op_defined_slot(func.body[j].opcode, def) && def == t) break;
+    }
+    if (def != t || j == ctx.index) return false;
+    const Op& inner = func.body[j].opcode;
+    bool compare = inner.type == OpType::Binop && is_comparison(inner.binop);
+    if (!compare && inner.type != OpType::UnaryNot) return false;
+    BitSet escaped;
+    escaped_slots(func, escaped);
+    if (escaped.test(t) || count_slot_uses(func, t) != 1) return false;
+    if (changed_between(func, j, ctx.index, inner.arg, escaped)) return false;
+    if (compare) {
+        if (changed_between(func, j, ctx.index, inner.arg2, escaped)) return false;
+        set_binop(op, inverted_comparison(inner.binop), inner.arg, inner.arg2);
+    } else {
+        set_binop(op, Binop::NotEqual, inner.arg, Arg::make_literal(0));
+    }
+    return true;
+}
+static bool substitute_constants(Op& op, const std::vector<bool>& known,
+                                 const std::vector<unsigned long long>& value) {
+    switch (op.type) {
+        case OpType::Binop:
+        case OpType::Negate:
+        case OpType::UnaryNot:
+        case OpType::AutoAssign:
+        case OpType::Store:
+        case OpType::CmpJmpIfNotLabel:
+        case OpType::Select:
+        case OpType::JmpTable:
+        case OpType::Intrinsic:
+            break;
+        default:
+            return false;
+    }
+    bool changed = false;
+    std::vector<Arg*> args;
+    op_args(op, args);
+    for (Arg* arg : args) {
+        if (arg->type == ArgType::AutoVar && known[arg->index]) {
+            *arg = Arg::make_literal(value[arg->index]);
+            changed = true;
+        }
+    }
+    return changed;
+}
+static const PeepholeRule GENERIC_RULES[] = {
+    {"add-zero",          OpType::Binop,    Binop::Plus,         rule_add_zero},
+    {"sub-identity",      OpType::Binop,    Binop::Minus,        rule_sub},
+    {"mult-identity",     OpType::Binop,    Binop::Mult,         rule_mult_identity},
+    {"mult-decompose",    OpType::Binop,    Binop::Mult,         rule_mult_decompose},
+    {"div-pow2",          OpType::Binop,    Binop::Div,          rule_div},
+    {"mod-pow2",          OpType::Binop,    Binop::Mod,          rule_mod},
+    {"or-identity",       OpType::Binop,    Binop::BitOr,        rule_or},
+    {"and-identity",      OpType::Binop,    Binop::BitAnd,       rule_and},
+    {"shl-zero",          OpType::Binop,    Binop::BitShl,       rule_shift},
+    {"shr-zero",          OpType::Binop,    Binop::BitShr,       rule_shift},
+    {"sar-zero",          OpType::Binop,    Binop::BitSar,       rule_shift},
+    {"less-self",         OpType::Binop,    Binop::Less,         rule_compare_self},
+    {"greater-self",      OpType::Binop,    Binop::Greater,      rule_compare_self},
+    {"less-equal-self",   OpType::Binop,    Binop::LessEqual,    rule_compare_self},
+    {"greater-equal-self", OpType::Binop,   Binop::GreaterEqual, rule_compare_self},
+    {"equal-self",        OpType::Binop,    Binop::Equal,        rule_compare_self},
+    {"not-equal-self",    OpType::Binop,    Binop::NotEqual,     rule_compare_self},
+    {"not-chain",         OpType::UnaryNot, Binop::Plus,         rule_not_chain},
+};
+static bool rule_matches(const PeepholeRule& rule, const Op& op) {
+    return rule.type == op.type && (op.type != OpType::Binop || rule.binop == op.binop);
+}
+static bool apply_rules(PeepholeContext& ctx, Op& op, size_t& by_target) {
+    if (fold_constants(op) || canonicalize_operands(op)) return true;
+    for (const PeepholeRule& rule : ctx.options->target_rules) {
+        if (rule_matches(rule, op) && rule.apply(ctx, op)) {
+            by_target++;
+            return true;
+        }
+    }
+    for (const PeepholeRule& rule : GENERIC_RULES) {
+        if (rule_matches(rule, op) && rule.apply(ctx, op)) return true;
+    }
+    return false;
+}
+bool simplify_algebra(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    Cfg cfg;
+    build_cfg(func, cfg);
+    BitSet escaped;
+    escaped_slots(func, escaped);
+    std::vector<std::vector<Op>> inserted(func.body.size());
+    std::vector<bool> known(func.auto_vars_count + 1, false);
+    std::vector<unsigned long long> value(func.auto_vars_count + 1, 0);
+    size_t simplified = 0;
+    size_t by_target = 0;
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        std::fill(known.begin(), known.end(), false);
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+            Op& op = func.body[i].opcode;
+            bool fired = substitute_constants(op, known, value);
+            PeepholeContext ctx;
+            ctx.func = &func;
+            ctx.options = &options;
+            ctx.block_begin = cfg.blocks[b].begin;
+            ctx.index = i;
+            for (int round = 0; round < 4; round++) {
+                if (!apply_rules(ctx, op, by_target)) break;
+                fired = true;
+            }
+            if (fired) simplified++;
+            size_t def;
+            if (op_defined_slot(op, def) && def < known.size()) {
+                known[def] = op.type == OpType::AutoAssign && op.arg.type == ArgType::Literal &&
+                             !escaped.test(def);
+                value[def] = op.arg.value;
+            }
+            inserted[i].swap(ctx.before);
+        }
+    }
+    if (simplified > 0) {
+        std::vector<OpWithLocation> body;
+        body.reserve(func.body.size());
+        for (size_t i = 0; i < func.body.size(); i++) {
+            for (const Op& op : inserted[i]) {
+                OpWithLocation owl;
+                owl.opcode = op;
+                owl.loc = func.body[i].loc;
+                body.push_back(owl);
+            }
+            const Op& op = func.body[i].opcode;
+            if (op.type == OpType::AutoAssign && op.arg.type == ArgType::AutoVar &&
+                op.arg.index == op.index) {
+                continue;
+            }
+            body.push_back(func.body[i]);
+        }
+        func.body.swap(body);
+    }
+    if (options.report) {
+        printf("INFO: %s: simplified %zu ops (%zu by target rules)\n",
+               func.name.c_str(), simplified, by_target);
+    }
+    return simplified > 0;
+}
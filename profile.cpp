@@ -0,0 +1,336 @@
+#include "profile.h"
+#include "analysis.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+static const unsigned long long PROFILE_MAGIC = 0x31464F5250474E42ULL;  // "BNGPROF1"
+static const char* const PROFILE_COUNTERS = "__bong_profile";
+static const char* const PROFILE_DUMP = "__bong_profile_dump";
+static unsigned long long hash_word(unsigned long long h, unsigned long long word) {
+    for (int i = 0; i < 8; i++) {
+        h ^= (word >> (8 * i)) & 0xFF;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+// FNV-1a over the control flow of the body: op kinds, jump targets and
+// compared operators. Constants and slot numbers may change freely
+static unsigned long long body_hash(const Func& func) {
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    std::vector<const size_t*> labels;
+    for (const OpWithLocation& owl : func.body) {
+        const Op& op = owl.opcode;
+        h = hash_word(h, static_cast<unsigned long long>(op.type));
+        if (op.type == OpType::Label) h = hash_word(h, op.label);
+        if (op.type == OpType::CmpJmpIfNotLabel) h = hash_word(h, static_cast<unsigned long long>(op.binop));
+        op_jump_labels(op, labels);
+        for (const size_t* label : labels) h = hash_word(h, *label);
+    }
+    return h;
+}
+static void push_word(Global& global, unsigned long long word) {
+    global.values.push_back(ImmediateValue::make_literal(word));
+}
+static void declare_extrn(Compiler& c, const std::string& name) {
+    if (std::find(c.extrns.begin(), c.extrns.end(), name) == c.extrns.end()) {
+        c.extrns.push_back(name);
+    }
+}
+// __bong_profile[word]++ through two fresh slots
+static void push_counter(std::vector<OpWithLocation>& body, size_t addr, size_t value, size_t word,
+                         const Loc& loc) {
+    Op op;
+    op.type = OpType::Binop;
+    op.binop = Binop::Plus;
+    op.index = addr;
+    op.arg = Arg::make_external(PROFILE_COUNTERS);
+    op.arg2 = Arg::make_literal(8 * word);
+    push_op(body, op, loc);
+    op = Op();
+    op.type = OpType::AutoAssign;
+    op.index = value;
+    op.arg = Arg::make_deref(addr);
+    push_op(body, op, loc);
+    op = Op();
+    op.type = OpType::Binop;
+    op.binop = Binop::Plus;
+    op.index = value;
+    op.arg = Arg::make_auto_var(value);
+    op.arg2 = Arg::make_literal(1);
+    push_op(body, op, loc);
+    op = Op();
+    op.type = OpType::Store;
+    op.index = addr;
+    op.arg = Arg::make_auto_var(value);
+    push_op(body, op, loc);
+}
+static void instrument_function(Func& func, Global& counters) {
+    Cfg cfg;
+    build_cfg(func, cfg);
+    std::string name = func.name;
+    push_word(counters, name.size());
+    for (size_t i = 0; i < name.size(); i += 8) {
+        unsigned long long word = 0;
+        for (size_t j = 0; j < 8 && i + j < name.size(); j++) {
+            word |= static_cast<unsigned long long>(static_cast<unsigned char>(name[i + j])) << (8 * j);
+        }
+        push_word(counters, word);
+    }
+    push_word(counters, body_hash(func));
+    push_word(counters, cfg.blocks.size());
+    size_t addr = ++func.auto_vars_count;
+    size_t value = ++func.auto_vars_count;
+    std::vector<OpWithLocation> body;
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        const BasicBlock& block = cfg.blocks[b];
+        size_t i = block.begin;
+        while (i < block.end && func.body[i].opcode.type == OpType::Label) {
+            body.push_back(func.body[i++]);
+        }
+        Loc loc = i < block.end ? func.body[i].loc : func.body[block.begin].loc;
+        push_counter(body, addr, value, counters.values.size(), loc);
+        push_word(counters, 0);
+        while (i < block.end) {
+            body.push_back(func.body[i++]);
+        }
+    }
+    func.body.swap(body);
+}
+static Func make_dump_function(Compiler& c, const Global& counters, const std::string& path, const Loc& loc) {
+    Func func;
+    func.name = PROFILE_DUMP;
+    func.name_loc = loc;
+    func.params_count = 0;
+    func.auto_vars_count = 2;
+    func.cold_ops = 0;
+    func.profiled = false;
+    func.local = false;
+    Op op;
+    op.type = OpType::Funcall;
+    op.result = 1;
+    op.arg = Arg::make_external("fopen");
+    op.funcall_args.push_back(Arg::make_data_offset(c.compile_string(path)));
+    op.funcall_args.push_back(Arg::make_data_offset(c.compile_string("wb")));
+    push_op(func.body, op, loc);
+    op = Op();
+    op.type = OpType::JmpIfNotLabel;
+    op.arg = Arg::make_auto_var(1);
+    op.label = 0;
+    push_op(func.body, op, loc);
+    op = Op();
+    op.type = OpType::Funcall;
+    op.result = 2;
+    op.arg = Arg::make_external("fwrite");
+    op.funcall_args.push_back(Arg::make_external(PROFILE_COUNTERS));
+    op.funcall_args.push_back(Arg::make_literal(8));
+    op.funcall_args.push_back(Arg::make_literal(counters.values.size()));
+    op.funcall_args.push_back(Arg::make_auto_var(1));
+    push_op(func.body, op, loc);
+    op = Op();
+    op.type = OpType::Funcall;
+    op.result = 2;
+    op.arg = Arg::make_external("fclose");
+    op.funcall_args.push_back(Arg::make_auto_var(1));
+    push_op(func.body, op, loc);
+    op = Op();
+    op.type = OpType::Label;
+    op.label = 0;
+    push_op(func.body, op, loc);
+    op = Op();
+    op.type = OpType::Return;
+    push_op(func.body, op, loc);
+    return func;
+}
+bool instrument_program(Compiler& c, const std::string& path) {
+    Func* main_func = nullptr;
+    for (Func& func : c.funcs) {
+        if (func.name == PROFILE_COUNTERS || func.name == PROFILE_DUMP) {
+            fprintf(stderr, "%s:%d:%d: ERROR: `%s` is reserved for -fprofile-generate\n",
+                    func.name_loc.input_path, func.name_loc.line_number, func.name_loc.line_offset,
+                    func.name.c_str());
+            return false;
+        }
+        if (func.name == "main") main_func = &func;
+    }
+    for (const Global& global : c.globals) {
+        if (global.name == PROFILE_COUNTERS || global.name == PROFILE_DUMP) {
+            fprintf(stderr, "ERROR: `%s` is reserved for -fprofile-generate\n", global.name.c_str());
+            return false;
+        }
+    }
+    if (!main_func) {
+        fprintf(stderr, "ERROR: -fprofile-generate needs a `main` function to write the profile at exit\n");
+        return false;
+    }
+    Global counters;
+    counters.name = PROFILE_COUNTERS;
+    counters.is_vec = true;
+    push_word(counters, PROFILE_MAGIC);
+    push_word(counters, c.funcs.size());
+    for (Func& func : c.funcs) {
+        instrument_function(func, counters);
+    }
+    counters.minimum_size = counters.values.size();
+    Op op;
+    op.type = OpType::Funcall;
+    op.result = ++main_func->auto_vars_count;
+    op.arg = Arg::make_external("atexit");
+    op.funcall_args.push_back(Arg::make_ref_external(PROFILE_DUMP));
+    OpWithLocation owl;
+    owl.opcode = op;
+    owl.loc = main_func->name_loc;
+    main_func->body.insert(main_func->body.begin(), owl);
+    c.funcs.push_back(make_dump_function(c, counters, path, main_func->name_loc));
+    c.globals.push_back(counters);
+    declare_extrn(c, "atexit");
+    declare_extrn(c, "fopen");
+    declare_extrn(c, "fwrite");
+    declare_extrn(c, "fclose");
+    return true;
+}
+bool read_profile(const char* path, ProfileData& profile) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "ERROR: could not open profile %s\n", path);
+        return false;
+    }
+    std::vector<unsigned long long> words;
+    unsigned char buf[8];
+    while (file.read(reinterpret_cast<char*>(buf), 8)) {
+        unsigned long long word = 0;
+        for (int i = 0; i < 8; i++) word |= static_cast<unsigned long long>(buf[i]) << (8 * i);
+        words.push_back(word);
+    }
+    size_t at = 2;
+    if (words.size() < at || words[0] != PROFILE_MAGIC) {
+        fprintf(stderr, "ERROR: %s is not a profile written by -fprofile-generate\n", path);
+        return false;
+    }
+    for (unsigned long long f = 0; f < words[1]; f++) {
+        if (at >= words.size() || words[at] > 8 * (words.size() - at)) break;
+        size_t length = words[at++];
+        std::string name;
+        for (size_t i = 0; i < length; i++) {
+            name += static_cast<char>((words[at + i / 8] >> (8 * (i % 8))) & 0xFF);
+        }
+        at += (length + 7) / 8;
+        if (at + 2 > words.size() || words[at + 1] > words.size() - at - 2) break;
+        FuncProfile& func = profile.funcs[name];
+        func.body_hash = words[at];
+        func.counts.assign(words.begin() + at + 2, words.begin() + at + 2 + words[at + 1]);
+        at += 2 + words[at + 1];
+    }
+    if (at != words.size()) {
+        fprintf(stderr, "ERROR: profile %s is truncated or corrupt\n", path);
+        return false;
+    }
+    return true;
+}
+static bool is_case_test(const Op& op) {
+    return op.type == OpType::CmpJmpIfNotLabel && op.binop == Binop::NotEqual &&
+           op.arg.type == ArgType::AutoVar && op.arg2.type == ArgType::Literal;
+}
+static bool hotter_test(const std::pair<unsigned long long, OpWithLocation>& a,
+                        const std::pair<unsigned long long, OpWithLocation>& b) {
+    return a.first > b.first;
+}
+// Runs of `jmp_if_not Lk, v != K` with distinct K, as a switch dispatches
+// a few cases, are put in order of falling taken counts
+static size_t order_case_tests(Func& func, const Cfg& cfg, const std::vector<unsigned long long>& counts) {
+    size_t reordered = 0;
+    size_t i = 0;
+    while (i < func.body.size()) {
+        size_t j = i;
+        std::vector<std::pair<unsigned long long, OpWithLocation>> tests;
+        while (j < func.body.size() && is_case_test(func.body[j].opcode) &&
+               func.body[j].opcode.arg.index == func.body[i].opcode.arg.index) {
+            bool distinct = true;
+            for (const auto& t : tests) {
+                if (t.second.opcode.arg2.value == func.body[j].opcode.arg2.value) distinct = false;
+            }
+            size_t target = cfg.block_of_label[func.body[j].opcode.label];
+            if (!distinct || target == NO_BLOCK) break;
+            tests.push_back(std::make_pair(counts[target], func.body[j]));
+            j++;
+        }
+        if (tests.size() < 2) {
+            i = std::max(j, i + 1);
+            continue;
+        }
+        std::stable_sort(tests.begin(), tests.end(), hotter_test);
+        unsigned long long reaching = func.body[i].count;
+        for (size_t k = 0; k < tests.size(); k++) {
+            if (tests[k].second.opcode.arg2.value != func.body[i + k].opcode.arg2.value) reordered++;
+            func.body[i + k] = tests[k].second;
+            func.body[i + k].count = reaching;
+            reaching -= std::min(reaching, tests[k].first);
+        }
+        i = j;
+    }
+    return reordered;
+}
+// A jump table entry taking most of the dispatches is tested before the
+// indexed jump
+static size_t peel_hot_table_entries(Func& func, const Cfg& cfg, const std::vector<unsigned long long>& counts) {
+    size_t peeled = 0;
+    std::vector<OpWithLocation> body;
+    for (const OpWithLocation& owl : func.body) {
+        const Op& op = owl.opcode;
+        if (op.type != OpType::JmpTable || op.arg.type != ArgType::AutoVar || owl.count == 0) {
+            body.push_back(owl);
+            continue;
+        }
+        size_t hot = 0;
+        unsigned long long hot_count = 0;
+        for (size_t k = 0; k < op.labels.size(); k++) {
+            size_t target = cfg.block_of_label[op.labels[k]];
+            if (target != NO_BLOCK && counts[target] > hot_count) {
+                hot = k;
+                hot_count = counts[target];
+            }
+        }
+        if (2 * std::min(hot_count, owl.count) <= owl.count) {
+            body.push_back(owl);
+            continue;
+        }
+        OpWithLocation test = owl;
+        test.opcode = Op();
+        test.opcode.type = OpType::CmpJmpIfNotLabel;
+        test.opcode.binop = Binop::NotEqual;
+        test.opcode.arg = op.arg;
+        test.opcode.arg2 = Arg::make_literal(hot);
+        test.opcode.label = op.labels[hot];
+        body.push_back(test);
+        body.push_back(owl);
+        body.back().count = owl.count - std::min(hot_count, owl.count);
+        peeled++;
+    }
+    func.body.swap(body);
+    return peeled;
+}
+void apply_profile(Compiler& c, const ProfileData& profile, bool report) {
+    for (Func& func : c.funcs) {
+        auto it = profile.funcs.find(func.name);
+        if (it == profile.funcs.end()) {
+            if (report) printf("INFO: %s: not in the profile, using static estimates\n", func.name.c_str());
+            continue;
+        }
+        Cfg cfg;
+        build_cfg(func, cfg);
+        if (it->second.body_hash != body_hash(func) || it->second.counts.size() != cfg.blocks.size()) {
+            if (report) printf("INFO: %s: changed since it was profiled, using static estimates\n", func.name.c_str());
+            continue;
+        }
+        const std::vector<unsigned long long>& counts = it->second.counts;
+        for (size_t i = 0; i < func.body.size(); i++) {
+            func.body[i].count = counts[cfg.block_of_op[i]];
+        }
+        func.profiled = true;
+        size_t reordered = order_case_tests(func, cfg, counts);
+        size_t peeled = peel_hot_table_entries(func, cfg, counts);
+        if (report) {
+            printf("INFO: %s: profiled %llu calls, reordered %zu case tests, peeled %zu table entries\n",
+                   func.name.c_str(), counts.empty() ? 0ULL : counts[0], reordered, peeled);
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "compiler.h"
+#include <map>
+#include <string>
+#include <vector>
+
+// Block counters of one function, in the block order of its unoptimized
+// body, and a hash of that body's control flow
+struct FuncProfile {
+    unsigned long long body_hash;
+    std::vector<unsigned long long> counts;
+};
+
+// Profile written by an instrumented program, keyed by function name
+struct ProfileData {
+    std::map<std::string, FuncProfile> funcs;
+};
+
+// Counts every basic block of every function, before any optimization.
+// main registers an atexit handler writing the counters to path as
+// little-endian words: magic, function count, then per function its name
+// length, name bytes padded to a word, body hash, counter count, counters
+bool instrument_program(Compiler& c, const std::string& path);
+
+bool read_profile(const char* path, ProfileData& profile);
+
+// Gives every op the count of its block in functions whose body still
+// hashes as profiled; changed or unknown functions keep static estimates.
+// Then tests the hottest switch cases first
+void apply_profile(Compiler& c, const ProfileData& profile, bool report);
+
+#endif // PROFILE_H
@@ -0,0 +1,183 @@
+#include "regalloc.h"
+#include "analysis.h"
+#include <algorithm>
+#include <set>
+struct ScanInterval {
+    size_t slot;
+    size_t start;
+    size_t end;
+    double cost;
+    RegMask clobbered;  // Registers overwritten by calls inside the interval
+    int reg;
+};
+static void compute_spill_costs(const Func& func, const Cfg& cfg, std::vector<double>& cost) {
+    DomTree dom;
+    compute_dominators(cfg, dom);
+    LoopInfo loops;
+    find_loops(cfg, dom, loops);
+    cost.assign(func.auto_vars_count + 1, 0.0);
+    std::vector<unsigned long long> counts;
+    bool profiled = profile_block_counts(func, cfg, counts);
+    std::vector<size_t> uses;
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        double weight = 1.0;
+        for (size_t d = loops.depth(b); d > 0 && weight < 1000000.0; d--) {
+            weight *= 10.0;
+        }
+        if (profiled) weight = static_cast<double>(counts[b]);
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+            const Op& op = func.body[i].opcode;
+            op_used_slots(op, uses);
+            for (size_t u : uses) {
+                cost[u] += weight;
+            }
+            size_t def;
+            if (op_defined_slot(op, def)) cost[def] += weight;
+        }
+    }
+}
+static bool usable(const RegisterDesc& desc, const ScanInterval& interval) {
+    return (interval.clobbered & reg_bit(desc.reg)) == 0;
+}
+static int pick_free_register(const RegisterFile& file, const ScanInterval& interval,
+                              const std::set<int>& busy) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t r = 0; r < file.count; r++) {
+            const RegisterDesc& desc = file.regs[r];
+            if (busy.count(desc.reg) || !usable(desc, interval)) continue;
+            if (pass == 0 && desc.callee_saved) continue;
+            return desc.reg;
+        }
+    }
+    return NO_REG;
+}
+static const RegisterDesc* find_desc(const RegisterFile& file, int reg) {
+    for (size_t r = 0; r < file.count; r++) {
+        if (file.regs[r].reg == reg) return &file.regs[r];
+    }
+    return nullptr;
+}
+static void linear_scan(std::vector<ScanInterval>& intervals, const RegisterFile& file) {
+    std::vector<size_t> active;
+    std::set<int> busy;
+    for (size_t i = 0; i < intervals.size(); i++) {
+        ScanInterval& cur = intervals[i];
+        for (size_t a = 0; a < active.size();) {
+            if (intervals[active[a]].end < cur.start) {
+                busy.erase(intervals[active[a]].reg);
+                active[a] = active.back();
+                active.pop_back();
+            } else {
+                a++;
+            }
+        }
+        int reg = pick_free_register(file, cur, busy);
+        if (reg != NO_REG) {
+            cur.reg = reg;
+            busy.insert(reg);
+            active.push_back(i);
+            continue;
+        }
+        size_t victim = active.size();
+        for (size_t a = 0; a < active.size(); a++) {
+            const ScanInterval& other = intervals[active[a]];
+            if (!usable(*find_desc(file, other.reg), cur)) continue;
+            if (victim == active.size() || other.cost < intervals[active[victim]].cost ||
+                (other.cost == intervals[active[victim]].cost && other.end > intervals[active[victim]].end)) {
+                victim = a;
+            }
+        }
+        if (victim == active.size() || intervals[active[victim]].cost >= cur.cost) continue;
+        cur.reg = intervals[active[victim]].reg;
+        intervals[active[victim]].reg = NO_REG;
+        active[victim] = i;
+    }
+}
+void assign_stack_slots(const Func& func, RegAllocation& result) {
+    size_t slots = func.auto_vars_count + 1;
+    result = RegAllocation();
+    result.reg.assign(slots, NO_REG);
+    result.frame_word.resize(slots);
+    for (size_t s = 0; s < slots; s++) {
+        result.frame_word[s] = s;
+    }
+    result.frame_words = func.auto_vars_count;
+    result.in_memory = func.auto_vars_count;
+}
+void allocate_registers(const Func& func, const RegisterFile& file,
+                        const std::vector<RegMask>& call_clobbers, RegAllocation& result) {
+    if (has_asm_barrier(func)) {
+        assign_stack_slots(func, result);
+        return;
+    }
+    size_t slots = func.auto_vars_count + 1;
+    result = RegAllocation();
+    result.reg.assign(slots, NO_REG);
+    result.frame_word.assign(slots, 0);
+    BitSet escaped;
+    escaped_slots(func, escaped);
+    for (size_t s = 1; s < slots; s++) {
+        if (!escaped.test(s)) continue;
+        result.frame_word[s] = ++result.frame_words;
+        result.in_memory++;
+    }
+    if (func.body.empty()) return;
+    Cfg cfg;
+    build_cfg(func, cfg);
+    Liveness live;
+    compute_liveness(func, cfg, live);
+    std::vector<LiveInterval> live_intervals;
+    compute_live_intervals(func, cfg, live, live_intervals);
+    std::vector<double> cost;
+    compute_spill_costs(func, cfg, cost);
+    std::vector<size_t> calls;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        if (call_clobbers[i] != 0) calls.push_back(2 * i + 1);
+    }
+    std::vector<ScanInterval> intervals;
+    for (const LiveInterval& li : live_intervals) {
+        if (escaped.test(li.slot)) continue;
+        ScanInterval interval;
+        interval.slot = li.slot;
+        interval.start = li.start;
+        interval.end = li.end;
+        interval.cost = cost[li.slot];
+        interval.clobbered = 0;
+        interval.reg = NO_REG;
+        auto call = std::upper_bound(calls.begin(), calls.end(), li.start);
+        for (; call != calls.end() && *call < li.end; ++call) {
+            interval.clobbered |= call_clobbers[*call / 2];
+        }
+        intervals.push_back(interval);
+    }
+    linear_scan(intervals, file);
+    std::set<int> callee_saved;
+    std::vector<size_t> free_words;
+    std::vector<const ScanInterval*> in_frame;
+    for (const ScanInterval& interval : intervals) {
+        if (interval.reg != NO_REG) {
+            result.reg[interval.slot] = interval.reg;
+            result.in_registers++;
+            if (find_desc(file, interval.reg)->callee_saved) callee_saved.insert(interval.reg);
+            continue;
+        }
+        for (size_t a = 0; a < in_frame.size();) {
+            if (in_frame[a]->end < interval.start) {
+                free_words.push_back(result.frame_word[in_frame[a]->slot]);
+                in_frame[a] = in_frame.back();
+                in_frame.pop_back();
+            } else {
+                a++;
+            }
+        }
+        if (!free_words.empty()) {
+            result.frame_word[interval.slot] = free_words.back();
+            free_words.pop_back();
+        } else {
+            result.frame_word[interval.slot] = ++result.frame_words;
+        }
+        in_frame.push_back(&interval);
+        result.spilled++;
+    }
+    result.callee_saved.assign(callee_saved.begin(), callee_saved.end());
+}
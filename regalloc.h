@@ -0,0 +1,54 @@
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include "compiler.h"
+#include <vector>
+
+// One allocatable register of a native target, by its hardware number
+struct RegisterDesc {
+    int reg;
+    bool callee_saved;
+};
+
+// Registers a target hands to the allocator, tried in table order
+struct RegisterFile {
+    const RegisterDesc* regs;
+    size_t count;
+};
+
+static const int NO_REG = -1;
+
+// Set of hardware registers, one bit per register number
+typedef unsigned RegMask;
+
+inline RegMask reg_bit(int reg) {
+    return 1u << reg;
+}
+
+// Home of every auto slot of a function. Slots without a register live in
+// the frame word at [fp - 8*frame_word]; unused slots have neither
+struct RegAllocation {
+    std::vector<int> reg;
+    std::vector<size_t> frame_word;
+    size_t frame_words;
+    std::vector<int> callee_saved;  // Callee-saved registers the function writes
+    size_t in_registers;
+    size_t spilled;
+    size_t in_memory;  // Slots that may be reached through pointers
+
+    RegAllocation() : frame_words(0), in_registers(0), spilled(0), in_memory(0) {}
+};
+
+// Linear scan over the live intervals of the auto slots. Spill choices are
+// weighted by profiled block counts, or else by loop depth, an interval live across a Funcall
+// or another op with call_clobbers[op index] never gets one of those registers and spilled intervals
+// share frame words when they do not overlap. Escaped slots always stay in
+// the frame, in their original order so auto vectors remain contiguous
+void allocate_registers(const Func& func, const RegisterFile& file,
+                        const std::vector<RegMask>& call_clobbers, RegAllocation& result);
+
+// Every slot in the frame word of its own index, as the unoptimized
+// backends lay out the frame
+void assign_stack_slots(const Func& func, RegAllocation& result);
+
+#endif // REGALLOC_H
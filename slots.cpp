@@ -0,0 +1,73 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+#include <set>
+#include <algorithm>
+bool compact_auto_slots(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    size_t slots = func.auto_vars_count + 1;
+    Cfg cfg;
+    build_cfg(func, cfg);
+    Liveness live;
+    compute_liveness(func, cfg, live);
+    std::vector<LiveInterval> intervals;
+    compute_live_intervals(func, cfg, live, intervals);
+    BitSet escaped;
+    escaped_slots(func, escaped);
+    const size_t UNASSIGNED = static_cast<size_t>(-1);
+    std::vector<size_t> map(slots, UNASSIGNED);
+    map[0] = 0;
+    size_t next = func.params_count + 1;
+    for (size_t i = 1; i <= func.params_count && i < slots; i++) {
+        map[i] = i;
+    }
+    for (AutoVec& vec : func.auto_vecs) {
+        for (size_t i = 0; i < vec.size; i++) {
+            map[vec.first + i] = next + i;
+        }
+        vec.first = next;
+        next += vec.size;
+    }
+    for (size_t s = func.params_count + 1; s < slots; s++) {
+        if (escaped.test(s) && map[s] == UNASSIGNED) {
+            map[s] = next++;
+        }
+    }
+    std::set<size_t> free_slots;
+    std::vector<LiveInterval> active;
+    for (const LiveInterval& interval : intervals) {
+        if (map[interval.slot] != UNASSIGNED) continue;
+        for (size_t i = 0; i < active.size();) {
+            if (active[i].end < interval.start) {
+                free_slots.insert(map[active[i].slot]);
+                active[i] = active.back();
+                active.pop_back();
+            } else {
+                i++;
+            }
+        }
+        if (!free_slots.empty()) {
+            map[interval.slot] = *free_slots.begin();
+            free_slots.erase(free_slots.begin());
+        } else {
+            map[interval.slot] = next++;
+        }
+        active.push_back(interval);
+    }
+    for (size_t s = 1; s < slots; s++) {
+        if (map[s] == UNASSIGNED) {
+            map[s] = 0;
+        }
+    }
+    for (size_t i = 0; i < func.body.size(); i++) {
+        remap_op_slots(func.body[i].opcode, map);
+    }
+    size_t before = func.auto_vars_count;
+    func.auto_vars_count = next - 1;
+    if (options.report) {
+        printf("INFO: %s: frame %zu -> %zu slots (%zu -> %zu bytes)\n",
+               func.name.c_str(), before, func.auto_vars_count,
+               before * 8, func.auto_vars_count * 8);
+    }
+    return func.auto_vars_count != before;
+}
@@ -0,0 +1,155 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+#include <map>
+static const size_t SPECIALIZE_MAX_OPS = 200;
+static const size_t SPECIALIZE_BUDGET_OPS = 2000;
+static const size_t SPECIALIZE_MAX_CLONES = 4;
+// Bound (parameter, value) pairs of a callee
+typedef std::vector<std::pair<size_t, unsigned long long>> Binding;
+// Parameters a constant would fold away: read by arithmetic, a comparison
+// or a branch rather than only passed on. Functions with inline assembly
+// or a parameter's address taken keep their signature
+static void foldable_params(const Func& func, std::vector<bool>& foldable) {
+    foldable.assign(func.params_count + 1, false);
+    if (has_asm_barrier(func)) return;
+    for (const OpWithLocation& owl : func.body) {
+        const Op& op = owl.opcode;
+        std::vector<const Arg*> args;
+        op_args(op, args);
+        for (const Arg* arg : args) {
+            if (arg->type == ArgType::RefAutoVar && arg->index <= func.params_count) {
+                foldable.assign(func.params_count + 1, false);
+                return;
+            }
+        }
+        bool folds = op.type == OpType::Binop || op.type == OpType::CmpJmpIfNotLabel ||
+                     op.type == OpType::JmpIfNotLabel || op.type == OpType::JmpTable ||
+                     op.type == OpType::Select || op.type == OpType::UnaryNot || op.type == OpType::Negate;
+        if (!folds) continue;
+        for (const Arg* arg : args) {
+            if (arg->type == ArgType::AutoVar && arg->index >= 1 && arg->index <= func.params_count) {
+                foldable[arg->index] = true;
+            }
+        }
+    }
+}
+static bool call_binding(const Op& op, const Func& callee, const std::vector<bool>& foldable, Binding& binding) {
+    binding.clear();
+    for (size_t p = 0; p < callee.params_count && p < op.funcall_args.size(); p++) {
+        const Arg& arg = op.funcall_args[p];
+        if (arg.type == ArgType::Literal && foldable[p + 1]) binding.push_back(std::make_pair(p, arg.value));
+    }
+    return !binding.empty();
+}
+static bool name_taken(const Compiler& c, const std::map<std::string, size_t>& index, const std::string& name) {
+    if (index.count(name)) return true;
+    for (const Global& global : c.globals) {
+        if (global.name == name) return true;
+    }
+    for (const std::string& extrn : c.extrns) {
+        if (extrn == name) return true;
+    }
+    return false;
+}
+static std::string clone_name(const Compiler& c, const std::string& name, const std::map<std::string, size_t>& index) {
+    for (size_t n = 1;; n++) {
+        std::string candidate = name + "__spec" + std::to_string(n);
+        if (!name_taken(c, index, candidate)) return candidate;
+    }
+}
+// Copy of callee without the bound parameters: the remaining ones keep
+// their order in the first slots, and the bound ones become locals
+// assigned their value on entry
+static Func make_specialization(const Func& callee, const Binding& binding, const std::string& name) {
+    std::vector<bool> bound(callee.params_count, false);
+    for (const auto& b : binding) bound[b.first] = true;
+    std::vector<size_t> slots(callee.auto_vars_count + 1);
+    for (size_t s = 0; s <= callee.auto_vars_count; s++) slots[s] = s;
+    size_t next = 1;
+    for (size_t p = 0; p < callee.params_count; p++) {
+        if (!bound[p]) slots[p + 1] = next++;
+    }
+    size_t params = next - 1;
+    for (size_t p = 0; p < callee.params_count; p++) {
+        if (bound[p]) slots[p + 1] = next++;
+    }
+    Func func = callee;
+    func.name = name;
+    func.local = true;
+    func.params_count = params;
+    func.body.clear();
+    for (AutoVec& vec : func.auto_vecs) vec.first = slots[vec.first];
+    for (const auto& b : binding) {
+        OpWithLocation owl;
+        owl.opcode.type = OpType::AutoAssign;
+        owl.opcode.index = slots[b.first + 1];
+        owl.opcode.arg = Arg::make_literal(b.second);
+        owl.loc = callee.name_loc;
+        owl.count = callee.body.empty() ? NO_COUNT : callee.body[0].count;
+        func.body.push_back(owl);
+    }
+    for (const OpWithLocation& owl : callee.body) {
+        func.body.push_back(owl);
+        remap_op_slots(func.body.back().opcode, slots);
+    }
+    return func;
+}
+bool specialize_functions(Compiler& c, const OptOptions& options) {
+    std::map<std::string, size_t> index;
+    for (size_t i = 0; i < c.funcs.size(); i++) index[c.funcs[i].name] = i;
+    std::vector<std::vector<bool>> foldable(c.funcs.size());
+    for (size_t f = 0; f < c.funcs.size(); f++) foldable_params(c.funcs[f], foldable[f]);
+    std::map<std::pair<size_t, Binding>, size_t> clones;
+    std::vector<size_t> clone_count(c.funcs.size(), 0);
+    size_t budget = SPECIALIZE_BUDGET_OPS;
+    size_t total = 0;
+    for (size_t f = 0; f < c.funcs.size(); f++) {
+        for (size_t i = 0; i < c.funcs[f].body.size(); i++) {
+            size_t g;
+            if (!direct_callee(c.funcs[f].body[i].opcode, index, g) || g >= foldable.size()) continue;
+            if (c.funcs[g].name == "main") continue;
+            Binding binding;
+            if (!call_binding(c.funcs[f].body[i].opcode, c.funcs[g], foldable[g], binding)) continue;
+            auto key = std::make_pair(g, binding);
+            auto it = clones.find(key);
+            size_t clone;
+            if (it != clones.end()) {
+                clone = it->second;
+            } else {
+                size_t size = body_size(c.funcs[g]);
+                if (size > SPECIALIZE_MAX_OPS || size > budget || clone_count[g] >= SPECIALIZE_MAX_CLONES) {
+                    continue;
+                }
+                budget -= size;
+                clone_count[g]++;
+                std::string name = clone_name(c, c.funcs[g].name, index);
+                clone = c.funcs.size();
+                c.funcs.push_back(make_specialization(c.funcs[g], binding, name));
+                index[name] = clone;
+                clones[key] = clone;
+                if (options.report) {
+                    printf("INFO: %s: specialized as %s for %zu constant arguments\n", c.funcs[g].name.c_str(),
+                           name.c_str(), binding.size());
+                }
+            }
+            Op& op = c.funcs[f].body[i].opcode;
+            std::vector<Arg> args;
+            size_t b = 0;
+            for (size_t p = 0; p < op.funcall_args.size(); p++) {
+                if (b < binding.size() && binding[b].first == p) {
+                    b++;
+                    continue;
+                }
+                args.push_back(op.funcall_args[p]);
+            }
+            op.funcall_args.swap(args);
+            op.arg.name = c.funcs[clone].name;
+            total++;
+        }
+    }
+    if (options.report && total > 0) {
+        printf("INFO: redirected %zu calls to specialized functions\n", total);
+    }
+    return total > 0;
+}
@@ -0,0 +1,77 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+static bool is_self_tail_call(const Func& func, size_t i) {
+    const Op& op = func.body[i].opcode;
+    if (op.type != OpType::Funcall || i + 1 >= func.body.size()) return false;
+    if (op.arg.type != ArgType::External && op.arg.type != ArgType::RefExternal) return false;
+    if (op.arg.name != func.name) return false;
+    const Op& ret = func.body[i + 1].opcode;
+    return ret.type == OpType::Return && ret.has_return_arg && ret.arg.type == ArgType::AutoVar &&
+           ret.arg.index == op.result;
+}
+static bool reads_param(const Func& func, const Arg& arg) {
+    return (arg.type == ArgType::AutoVar || arg.type == ArgType::Deref) && arg.index >= 1 &&
+           arg.index <= func.params_count;
+}
+// f(a, b) returned from f becomes p1 = a; p2 = b; jmp entry. Arguments
+// reading a parameter go through a fresh slot first, as the parameters are
+// assigned together
+static void rewrite_tail_call(Func& func, const OpWithLocation& call, size_t entry,
+                              std::vector<OpWithLocation>& body) {
+    const Op& op = call.opcode;
+    std::vector<Arg> values;
+    for (size_t p = 0; p < func.params_count; p++) {
+        Arg value = p < op.funcall_args.size() ? op.funcall_args[p] : Arg::make_literal(0);
+        if (reads_param(func, value) && !(value.type == ArgType::AutoVar && value.index == p + 1)) {
+            Op copy;
+            copy.type = OpType::AutoAssign;
+            copy.index = ++func.auto_vars_count;
+            copy.arg = value;
+            push_op(body, copy, call);
+            value = Arg::make_auto_var(copy.index);
+        }
+        values.push_back(value);
+    }
+    for (size_t p = 0; p < func.params_count; p++) {
+        if (values[p].type == ArgType::AutoVar && values[p].index == p + 1) continue;
+        Op assign;
+        assign.type = OpType::AutoAssign;
+        assign.index = p + 1;
+        assign.arg = values[p];
+        push_op(body, assign, call);
+    }
+    Op jmp;
+    jmp.type = OpType::JmpLabel;
+    jmp.label = entry;
+    push_op(body, jmp, call);
+}
+bool eliminate_tail_calls(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    size_t calls = 0;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        if (is_self_tail_call(func, i)) calls++;
+    }
+    if (calls == 0) return false;
+    BitSet escaped;
+    escaped_slots(func, escaped);
+    if (!escaped.empty()) return false;
+    size_t entry = max_label_index(func);
+    std::vector<OpWithLocation> body(1);
+    body[0].opcode.type = OpType::Label;
+    body[0].opcode.label = entry;
+    body[0].loc = func.body[0].loc;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        if (is_self_tail_call(func, i)) {
+            rewrite_tail_call(func, func.body[i], entry, body);
+            i++;
+        } else {
+            body.push_back(func.body[i]);
+        }
+    }
+    func.body.swap(body);
+    if (options.report) {
+        printf("INFO: %s: turned %zu self tail calls into jumps\n", func.name.c_str(), calls);
+    }
+    return true;
+}
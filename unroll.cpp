@@ -0,0 +1,176 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+#include <set>
+static const size_t UNROLL_MAX_BODY_OPS = 16;
+static const size_t UNROLL_MAX_OPS = 64;
+static const unsigned long long FULL_UNROLL_MAX_TRIPS = 8;
+static bool trip_count(const CountedLoop& loop, long long init, unsigned long long& trips) {
+    if (loop.bound.type != ArgType::Literal) return false;
+    long long bound = static_cast<long long>(loop.bound.value);
+    long long distance;
+    switch (loop.cmp) {
+        case Binop::Less: distance = bound - init; break;
+        case Binop::LessEqual: distance = bound - init + 1; break;
+        case Binop::Greater: distance = init - bound; break;
+        case Binop::GreaterEqual: distance = init - bound + 1; break;
+        case Binop::NotEqual:
+            if ((bound - init) % loop.step != 0 || (bound - init) / loop.step < 0) return false;
+            trips = static_cast<unsigned long long>((bound - init) / loop.step);
+            return true;
+        default:
+            return false;
+    }
+    bool up = loop.cmp == Binop::Less || loop.cmp == Binop::LessEqual;
+    long long stride = up ? loop.step : -loop.step;
+    if (distance <= 0) {
+        trips = 0;
+        return true;
+    }
+    if (stride <= 0) return false;
+    trips = static_cast<unsigned long long>((distance + stride - 1) / stride);
+    return true;
+}
+static OpWithLocation make_op(const Op& op, const OpWithLocation& from) {
+    OpWithLocation owl;
+    owl.opcode = op;
+    owl.loc = from.loc;
+    return owl;
+}
+static void copy_body(const Func& func, const CountedLoop& loop, size_t copies, unsigned long long divisor,
+                      std::vector<OpWithLocation>& out) {
+    for (size_t k = 0; k < copies; k++) {
+        for (size_t i = loop.test + 1; i < loop.latch; i++) {
+            OpWithLocation owl = func.body[i];
+            if (owl.count != NO_COUNT) owl.count /= divisor;
+            out.push_back(owl);
+        }
+    }
+}
+// The unrolled loop runs while factor more iterations are certain, testing
+// iv against bound moved by the steps in between, and leaves the rest to
+// the original loop. A bound so close to the end of the word range that
+// moving it wraps skips straight to the original loop
+static void unroll_partially(Func& func, const CountedLoop& loop, size_t factor, std::vector<OpWithLocation>& out,
+                             std::set<size_t>& done) {
+    const OpWithLocation& at = func.body[loop.header];
+    size_t unrolled = max_label_index(func);
+    size_t rest = unrolled + 1;
+    size_t limit = ++func.auto_vars_count;
+    bool up = loop.cmp == Binop::Less || loop.cmp == Binop::LessEqual;
+    unsigned long long distance = static_cast<unsigned long long>(loop.step) * (factor - 1);
+    Op op;
+    op.type = OpType::Binop;
+    op.binop = Binop::Minus;
+    op.index = limit;
+    op.arg = loop.bound;
+    op.arg2 = Arg::make_literal(distance);
+    out.push_back(make_op(op, at));
+    op = Op();
+    op.type = OpType::CmpJmpIfNotLabel;
+    op.label = rest;
+    op.binop = up ? Binop::Less : Binop::Greater;
+    op.arg = Arg::make_auto_var(limit);
+    op.arg2 = loop.bound;
+    out.push_back(make_op(op, at));
+    op = Op();
+    op.type = OpType::Label;
+    op.label = unrolled;
+    out.push_back(make_op(op, at));
+    op = func.body[loop.test].opcode;
+    op.label = rest;
+    op.binop = loop.cmp;
+    op.arg = Arg::make_auto_var(loop.iv);
+    op.arg2 = Arg::make_auto_var(limit);
+    OpWithLocation test = make_op(op, func.body[loop.test]);
+    if (func.body[loop.test].count != NO_COUNT) test.count = func.body[loop.test].count / factor;
+    out.push_back(test);
+    copy_body(func, loop, factor, factor, out);
+    op = Op();
+    op.type = OpType::JmpLabel;
+    op.label = unrolled;
+    out.push_back(make_op(op, func.body[loop.latch]));
+    op = Op();
+    op.type = OpType::Label;
+    op.label = rest;
+    out.push_back(make_op(op, at));
+    done.insert(unrolled);
+    done.insert(func.body[loop.header].opcode.label);
+}
+// Loops that ran fewer than this many iterations per entry in the profile
+// are left alone
+static bool profile_allows(const Func& func, const Cfg& cfg, const LoopInfo& info, size_t l, size_t factor) {
+    std::vector<unsigned long long> counts;
+    if (!profile_block_counts(func, cfg, counts)) return true;
+    const Loop& lp = info.loops[l];
+    unsigned long long header = counts[lp.header];
+    unsigned long long body = counts[lp.latches[0]];
+    if (body == 0) return false;
+    unsigned long long entries = header > body ? header - body : 1;
+    return body / entries >= 2 * factor;
+}
+bool unroll_loops(Func& func, const OptOptions& options) {
+    size_t full = 0;
+    size_t partial = 0;
+    std::set<size_t> done;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        Cfg cfg;
+        build_cfg(func, cfg);
+        if (cfg.blocks.empty()) break;
+        DomTree dom;
+        compute_dominators(cfg, dom);
+        LoopInfo info;
+        find_loops(cfg, dom, info);
+        BitSet escaped;
+        escaped_slots(func, escaped);
+        for (size_t l = 0; l < info.loops.size() && !changed; l++) {
+            CountedLoop loop;
+            if (!match_counted_loop(func, cfg, info, l, escaped, loop)) continue;
+            if (done.count(func.body[loop.header].opcode.label)) continue;
+            size_t body_ops = loop.latch - loop.test - 1;
+            if (body_ops == 0 || body_ops > UNROLL_MAX_BODY_OPS) continue;
+            std::vector<OpWithLocation> out;
+            long long init;
+            unsigned long long trips = 0;
+            if (counted_loop_start(func, loop, init) && trip_count(loop, init, trips) &&
+                trips <= FULL_UNROLL_MAX_TRIPS && trips * body_ops <= UNROLL_MAX_OPS) {
+                copy_body(func, loop, static_cast<size_t>(trips), 1, out);
+                size_t exit = func.body[loop.test].opcode.label;
+                bool at_exit = loop.latch + 1 < func.body.size() &&
+                               func.body[loop.latch + 1].opcode.type == OpType::Label &&
+                               func.body[loop.latch + 1].opcode.label == exit;
+                if (!at_exit) {
+                    Op jmp;
+                    jmp.type = OpType::JmpLabel;
+                    jmp.label = exit;
+                    out.push_back(make_op(jmp, func.body[loop.test]));
+                }
+                full++;
+            } else {
+                size_t factor = options.costs.unroll;
+                while (factor > 1 && factor * body_ops > UNROLL_MAX_OPS) factor--;
+                bool up = loop.cmp == Binop::Less || loop.cmp == Binop::LessEqual;
+                bool counted = up ? loop.step > 0 : (loop.cmp == Binop::Greater || loop.cmp == Binop::GreaterEqual) &&
+                                                        loop.step < 0;
+                if (factor < 2 || !counted || !profile_allows(func, cfg, info, l, factor)) {
+                    done.insert(func.body[loop.header].opcode.label);
+                    continue;
+                }
+                unroll_partially(func, loop, factor, out, done);
+                partial++;
+                out.insert(out.end(), func.body.begin() + loop.header, func.body.begin() + loop.latch + 1);
+            }
+            std::vector<OpWithLocation> body(func.body.begin(), func.body.begin() + loop.header);
+            body.insert(body.end(), out.begin(), out.end());
+            body.insert(body.end(), func.body.begin() + loop.latch + 1, func.body.end());
+            func.body.swap(body);
+            changed = true;
+        }
+    }
+    if (options.report) {
+        printf("INFO: %s: fully unrolled %zu loops, partially unrolled %zu\n", func.name.c_str(), full, partial);
+    }
+    return full + partial > 0;
+}
@@ -0,0 +1,149 @@
+#include "opt.h"
+#include "analysis.h"
+#include <cstdio>
+static size_t find_root(std::vector<size_t>& parent, size_t x) {
+    while (parent[x] != x) {
+        parent[x] = parent[parent[x]];
+        x = parent[x];
+    }
+    return x;
+}
+static void unite(std::vector<size_t>& parent, size_t a, size_t b) {
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a != b) {
+        parent[a < b ? b : a] = a < b ? a : b;
+    }
+}
+bool split_slot_webs(Func& func, const OptOptions& options) {
+    if (has_asm_barrier(func)) return false;
+    size_t slots = func.auto_vars_count + 1;
+    Cfg cfg;
+    build_cfg(func, cfg);
+    BitSet escaped;
+    escaped_slots(func, escaped);
+    const size_t NONE = static_cast<size_t>(-1);
+    std::vector<size_t> def_slot;
+    std::vector<size_t> def_of_op(func.body.size(), NONE);
+    std::vector<std::vector<size_t>> defs_of_slot(slots);
+    for (size_t s = 0; s < slots; s++) {
+        def_slot.push_back(s);
+        defs_of_slot[s].push_back(s);
+    }
+    for (size_t i = 0; i < func.body.size(); i++) {
+        size_t def;
+        if (op_defined_slot(func.body[i].opcode, def) && !escaped.test(def)) {
+            def_of_op[i] = def_slot.size();
+            defs_of_slot[def].push_back(def_slot.size());
+            def_slot.push_back(def);
+        }
+    }
+    size_t defs = def_slot.size();
+    DataflowProblem problem;
+    problem.direction = DataflowDirection::Forward;
+    problem.meet = DataflowMeet::Union;
+    problem.bits = defs;
+    problem.boundary.resize(defs);
+    for (size_t s = 0; s < slots; s++) {
+        problem.boundary.set(s);
+    }
+    problem.gen.assign(cfg.blocks.size(), BitSet(defs));
+    problem.kill.assign(cfg.blocks.size(), BitSet(defs));
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+            size_t d = def_of_op[i];
+            if (d == NONE) continue;
+            for (size_t other : defs_of_slot[def_slot[d]]) {
+                problem.gen[b].reset(other);
+                problem.kill[b].set(other);
+            }
+            problem.gen[b].set(d);
+        }
+    }
+    DataflowResult reaching;
+    solve_dataflow(cfg, problem, reaching);
+    std::vector<size_t> parent(defs);
+    for (size_t d = 0; d < defs; d++) {
+        parent[d] = d;
+    }
+    std::vector<bool> entry_used(slots, false);
+    std::vector<size_t> uses;
+    for (int pass = 0; pass < 2; pass++) {
+        std::vector<size_t> web_slot;
+        if (pass == 1) {
+            web_slot.assign(defs, NONE);
+            std::vector<bool> taken(slots, false);
+            for (size_t s = 1; s < slots; s++) {
+                if (entry_used[s] || s <= func.params_count || escaped.test(s)) {
+                    web_slot[find_root(parent, s)] = s;
+                    taken[s] = true;
+                }
+            }
+            size_t next = slots;
+            for (size_t d = slots; d < defs; d++) {
+                size_t root = find_root(parent, d);
+                if (web_slot[root] != NONE) continue;
+                size_t s = def_slot[d];
+                if (!taken[s]) {
+                    taken[s] = true;
+                    web_slot[root] = s;
+                } else {
+                    web_slot[root] = next++;
+                }
+            }
+            func.auto_vars_count = next - 1;
+        }
+        for (size_t b = 0; b < cfg.blocks.size(); b++) {
+            BitSet cur = reaching.in[b];
+            for (size_t i = cfg.blocks[b].begin; i < cfg.blocks[b].end; i++) {
+                Op& op = func.body[i].opcode;
+                op_used_slots(op, uses);
+                std::vector<size_t> use_map;
+                for (size_t u : uses) {
+                    if (escaped.test(u)) continue;
+                    size_t first = NONE;
+                    for (size_t d : defs_of_slot[u]) {
+                        if (!cur.test(d)) continue;
+                        if (first == NONE) {
+                            first = d;
+                        } else if (pass == 0) {
+                            unite(parent, first, d);
+                        }
+                    }
+                    if (first == NONE) first = u;
+                    if (first == u && pass == 0) entry_used[u] = true;
+                    if (pass == 1) {
+                        if (use_map.empty()) {
+                            use_map.resize(slots);
+                            for (size_t s = 0; s < slots; s++) use_map[s] = s;
+                        }
+                        use_map[u] = web_slot[find_root(parent, first)];
+                    }
+                }
+                size_t d = def_of_op[i];
+                if (d != NONE) {
+                    for (size_t other : defs_of_slot[def_slot[d]]) {
+                        cur.reset(other);
+                    }
+                    cur.set(d);
+                }
+                if (pass == 1) {
+                    if (!use_map.empty()) {
+                        size_t def = 0;
+                        bool has_def = op_defined_slot(op, def);
+                        remap_op_slots(op, use_map);
+                        if (has_def) set_op_defined_slot(op, def);
+                    }
+                    if (d != NONE) {
+                        set_op_defined_slot(op, web_slot[find_root(parent, d)]);
+                    }
+                }
+            }
+        }
+    }
+    if (options.report) {
+        printf("INFO: %s: split %zu slots into %zu webs\n",
+               func.name.c_str(), slots - 1, func.auto_vars_count);
+    }
+    return func.auto_vars_count != slots - 1;
+}
@@ -0,0 +1,914 @@
+#include "x86_64.h"
+#include "analysis.h"
+#include <cstdio>
+#include <map>
+const char* const X86_DATA_SYMBOL = "bong_data";
+const Reg X86_ARG_REGS[6] = {Reg::Rdi, Reg::Rsi, Reg::Rdx, Reg::Rcx, Reg::R8, Reg::R9};
+static const RegisterDesc X86_ALLOCATABLE[] = {
+    {static_cast<int>(Reg::R10), false},
+    {static_cast<int>(Reg::Rsi), false},
+    {static_cast<int>(Reg::Rdi), false},
+    {static_cast<int>(Reg::R8),  false},
+    {static_cast<int>(Reg::R9),  false},
+    {static_cast<int>(Reg::Rbx), true},
+    {static_cast<int>(Reg::R12), true},
+    {static_cast<int>(Reg::R13), true},
+    {static_cast<int>(Reg::R14), true},
+    {static_cast<int>(Reg::R15), true},
+};
+const RegisterFile X86_REGISTER_FILE = {
+    X86_ALLOCATABLE, sizeof(X86_ALLOCATABLE) / sizeof(X86_ALLOCATABLE[0])
+};
+static const RegMask X86_C_PRESERVED =
+    reg_bit(static_cast<int>(Reg::Rbx)) | reg_bit(static_cast<int>(Reg::Rsp)) |
+    reg_bit(static_cast<int>(Reg::Rbp)) | reg_bit(static_cast<int>(Reg::R12)) |
+    reg_bit(static_cast<int>(Reg::R13)) | reg_bit(static_cast<int>(Reg::R14)) |
+    reg_bit(static_cast<int>(Reg::R15));
+static const RegMask X86_C_CLOBBERS = 0xFFFF & ~X86_C_PRESERVED;
+std::string x86_symbol(const std::string& name) {
+    return "_" + name;
+}
+class X86Lowering {
+public:
+    X86Lowering(X86Func& f, const X86Selection& s, const RegAllocation& a, const std::vector<RegMask>& cc,
+                const std::vector<bool>& internal, bool sibling)
+        : out(f), sel(s), alloc(a), call_clobbers(cc), internal_calls(internal), sibling_calls(sibling),
+          written(0) {}
+    void lower_function();
+    RegMask clobbers() const;
+
+private:
+    X86Func& out;
+    const X86Selection& sel;
+    const RegAllocation& alloc;
+    const std::vector<RegMask>& call_clobbers;
+    const std::vector<bool>& internal_calls;
+    bool sibling_calls;
+    RegMask written;
+
+    void emit(X86Opcode opcode, const Operand& dst = Operand(), const Operand& src = Operand());
+    void emit_cond(X86Opcode opcode, Cond cond, const Operand& dst, const Operand& src = Operand());
+    Operand frame(size_t word) const;
+    Operand slot(size_t index) const;
+    Reg dest_reg(size_t index) const;
+    bool arg_reg(const Arg& arg, Reg& r) const;
+    bool simple_arg(const Arg& arg, Operand& operand) const;
+    void load_arg(Reg reg, const Arg& arg);
+    Reg value_reg(const Arg& arg, Reg scratch);
+    void store_slot(size_t index, Reg reg);
+    bool find_folded(size_t at, size_t slot, size_t& def) const;
+    Operand memory_operand(size_t at, size_t slot, X86Pattern tile);
+    void lower_lea(size_t at, const Op& op);
+    void lower_compare(size_t at, const Op& op);
+    void lower_binop(size_t at, const Op& op);
+    Operand select_operand(const Arg& arg, Reg scratch);
+    void lower_select(const Op& op);
+    void lower_jump_table(const Op& op);
+    Operand byte_operand(const Arg& base, const Arg& index);
+    void lower_popcount(Reg r);
+    void lower_intrinsic(const Op& op);
+    bool is_sibling_call(size_t at) const;
+    void lower_funcall(const Op& op, RegMask clobbered, bool internal, bool tail);
+    void lower_return(size_t at, const Op& op);
+    void lower_params(const Func& func);
+    Operand saved_reg(size_t k) const;
+};
+static Operand reg(Reg r) {
+    return Operand::make_reg(r);
+}
+static Operand imm(long long value) {
+    return Operand::make_imm(value);
+}
+static bool fits_imm32(unsigned long long value) {
+    long long v = static_cast<long long>(value);
+    return v >= -2147483648LL && v <= 2147483647LL;
+}
+void X86Lowering::emit(X86Opcode opcode, const Operand& dst, const Operand& src) {
+    X86Inst inst;
+    inst.opcode = opcode;
+    inst.dst = dst;
+    inst.src = src;
+    out.code.push_back(inst);
+    switch (opcode) {
+        case X86Opcode::Cmp:
+        case X86Opcode::Test:
+        case X86Opcode::Push:
+        case X86Opcode::Jmp:
+        case X86Opcode::Call:
+        case X86Opcode::Ret:
+        case X86Opcode::Leave:
+            break;
+        case X86Opcode::Cqo:
+        case X86Opcode::Idiv:
+            written |= reg_bit(static_cast<int>(Reg::Rax)) | reg_bit(static_cast<int>(Reg::Rdx));
+            break;
+        case X86Opcode::MovByte:
+            break;
+        case X86Opcode::RepMovsb:
+            written |= reg_bit(static_cast<int>(Reg::Rsi));
+            written |= reg_bit(static_cast<int>(Reg::Rdi)) | reg_bit(static_cast<int>(Reg::Rcx));
+            break;
+        case X86Opcode::RepStosb:
+            written |= reg_bit(static_cast<int>(Reg::Rdi)) | reg_bit(static_cast<int>(Reg::Rcx));
+            break;
+        default:
+            if (dst.kind == OperandKind::Reg) written |= reg_bit(static_cast<int>(dst.reg));
+            break;
+    }
+}
+void X86Lowering::emit_cond(X86Opcode opcode, Cond cond, const Operand& dst, const Operand& src) {
+    X86Inst inst;
+    inst.opcode = opcode;
+    inst.cond = cond;
+    inst.dst = dst;
+    inst.src = src;
+    out.code.push_back(inst);
+    if (opcode != X86Opcode::Jcc) written |= reg_bit(static_cast<int>(dst.reg));
+}
+static bool comparison_cond(Binop binop, Cond& cond) {
+    switch (binop) {
+        case Binop::Less:         cond = Cond::L; return true;
+        case Binop::Greater:      cond = Cond::G; return true;
+        case Binop::LessEqual:    cond = Cond::LE; return true;
+        case Binop::GreaterEqual: cond = Cond::GE; return true;
+        case Binop::Equal:        cond = Cond::E; return true;
+        case Binop::NotEqual:     cond = Cond::NE; return true;
+        default:                  return false;
+    }
+}
+static Cond negated(Cond cond) {
+    return static_cast<Cond>(static_cast<int>(cond) ^ 1);
+}
+Operand X86Lowering::frame(size_t word) const {
+    return Operand::make_mem(Reg::Rbp, -8 * static_cast<long long>(word));
+}
+Operand X86Lowering::slot(size_t index) const {
+    if (alloc.reg[index] != NO_REG) return reg(static_cast<Reg>(alloc.reg[index]));
+    return frame(alloc.frame_word[index]);
+}
+Reg X86Lowering::dest_reg(size_t index) const {
+    if (alloc.reg[index] != NO_REG) return static_cast<Reg>(alloc.reg[index]);
+    return Reg::Rax;
+}
+bool X86Lowering::arg_reg(const Arg& arg, Reg& r) const {
+    if ((arg.type != ArgType::AutoVar && arg.type != ArgType::Deref) || alloc.reg[arg.index] == NO_REG) {
+        return false;
+    }
+    r = static_cast<Reg>(alloc.reg[arg.index]);
+    return true;
+}
+bool X86Lowering::simple_arg(const Arg& arg, Operand& operand) const {
+    switch (arg.type) {
+        case ArgType::AutoVar:
+            operand = slot(arg.index);
+            return true;
+        case ArgType::External:
+            operand = Operand::make_symbol_mem(x86_symbol(arg.name), 0);
+            return true;
+        case ArgType::Literal:
+            if (!fits_imm32(arg.value)) return false;
+            operand = imm(static_cast<long long>(arg.value));
+            return true;
+        default:
+            return false;
+    }
+}
+void X86Lowering::load_arg(Reg r, const Arg& arg) {
+    Operand home;
+    switch (arg.type) {
+        case ArgType::AutoVar:
+            home = slot(arg.index);
+            if (home.kind == OperandKind::Reg && home.reg == r) break;
+            emit(X86Opcode::Mov, reg(r), home);
+            break;
+        case ArgType::Deref:
+            home = slot(arg.index);
+            if (home.kind == OperandKind::Reg) {
+                emit(X86Opcode::Mov, reg(r), Operand::make_mem(home.reg, 0));
+            } else {
+                emit(X86Opcode::Mov, reg(r), home);
+                emit(X86Opcode::Mov, reg(r), Operand::make_mem(r, 0));
+            }
+            break;
+        case ArgType::RefAutoVar:
+            emit(X86Opcode::Lea, reg(r), frame(alloc.frame_word[arg.index]));
+            break;
+        case ArgType::RefExternal:
+            emit(X86Opcode::Lea, reg(r), Operand::make_symbol_mem(x86_symbol(arg.name), 0));
+            break;
+        case ArgType::External:
+            emit(X86Opcode::Mov, reg(r), Operand::make_symbol_mem(x86_symbol(arg.name), 0));
+            break;
+        case ArgType::Literal:
+            emit(X86Opcode::Mov, reg(r), imm(static_cast<long long>(arg.value)));
+            break;
+        case ArgType::DataOffset:
+            emit(X86Opcode::Lea, reg(r),
+                 Operand::make_symbol_mem(X86_DATA_SYMBOL, static_cast<long long>(arg.offset)));
+            break;
+        case ArgType::Bogus:
+            break;
+    }
+}
+Reg X86Lowering::value_reg(const Arg& arg, Reg scratch) {
+    Reg r;
+    if (arg.type == ArgType::AutoVar && arg_reg(arg, r)) return r;
+    load_arg(scratch, arg);
+    return scratch;
+}
+void X86Lowering::store_slot(size_t index, Reg r) {
+    Operand home = slot(index);
+    if (home.kind == OperandKind::Reg && home.reg == r) return;
+    emit(X86Opcode::Mov, home, reg(r));
+}
+bool X86Lowering::find_folded(size_t at, size_t slot, size_t& def) const {
+    for (size_t j = at; j > 0 && sel.folded[j - 1]; j--) {
+        if (sel.func.body[j - 1].opcode.index == slot) {
+            def = j - 1;
+            return true;
+        }
+    }
+    return false;
+}
+Operand X86Lowering::memory_operand(size_t at, size_t slot, X86Pattern tile) {
+    if (tile == X86Pattern::AddrSlot) {
+        Arg pointer = Arg::make_auto_var(slot);
+        return Operand::make_mem(value_reg(pointer, Reg::R11), 0);
+    }
+    size_t at_def = at;
+    find_folded(at, slot, at_def);
+    const Op& def = sel.func.body[at_def].opcode;
+    const Arg* base = &def.arg;
+    const Arg* other = &def.arg2;
+    size_t at_shift = at_def;
+    long long disp = 0;
+    switch (tile) {
+        case X86Pattern::AddrScaled:
+            if (other->type != ArgType::AutoVar || !find_folded(at_def, other->index, at_shift)) {
+                std::swap(base, other);
+                find_folded(at_def, other->index, at_shift);
+            }
+            return Operand::make_mem_index(value_reg(*base, Reg::R11),
+                                           value_reg(sel.func.body[at_shift].opcode.arg, Reg::Rcx),
+                                           1u << sel.func.body[at_shift].opcode.arg2.value, 0);
+        case X86Pattern::AddrIndex:
+            return Operand::make_mem_index(value_reg(*base, Reg::R11), value_reg(*other, Reg::Rcx), 1, 0);
+        case X86Pattern::AddrDisp:
+            if (base->type == ArgType::Literal) std::swap(base, other);
+            return Operand::make_mem(value_reg(*base, Reg::R11), static_cast<long long>(other->value));
+        default:
+            break;
+    }
+    if (def.type == OpType::Binop) {
+        if (base->type == ArgType::Literal) std::swap(base, other);
+        disp = static_cast<long long>(other->value);
+    }
+    switch (base->type) {
+        case ArgType::RefAutoVar:
+            return Operand::make_mem(Reg::Rbp, -8 * static_cast<long long>(alloc.frame_word[base->index]) + disp);
+        case ArgType::RefExternal:
+            return Operand::make_symbol_mem(x86_symbol(base->name), disp);
+        default:
+            return Operand::make_symbol_mem(X86_DATA_SYMBOL, static_cast<long long>(base->offset) + disp);
+    }
+}
+void X86Lowering::lower_lea(size_t at, const Op& op) {
+    Reg dst = dest_reg(op.index);
+    const Arg* a = &op.arg;
+    const Arg* b = &op.arg2;
+    size_t at_shift = at;
+    Reg ra;
+    Reg rb;
+    Operand addr;
+    switch (sel.pattern[at]) {
+        case X86Pattern::LeaScaled:
+            if (!find_folded(at, b->index, at_shift)) {
+                std::swap(a, b);
+                find_folded(at, b->index, at_shift);
+            }
+            addr = Operand::make_mem_index(value_reg(*a, Reg::R11),
+                                           value_reg(sel.func.body[at_shift].opcode.arg, Reg::Rcx),
+                                           1u << sel.func.body[at_shift].opcode.arg2.value, 0);
+            break;
+        case X86Pattern::LeaIndex:
+            ra = value_reg(*a, Reg::R11);
+            rb = value_reg(*b, Reg::Rcx);
+            if (rb == dst) std::swap(ra, rb);
+            if (ra == dst) {
+                emit(X86Opcode::Add, reg(dst), reg(rb));
+                store_slot(op.index, dst);
+                return;
+            }
+            addr = Operand::make_mem_index(ra, rb, 1, 0);
+            break;
+        case X86Pattern::LeaDisp:
+            if (a->type != ArgType::AutoVar) std::swap(a, b);
+            ra = value_reg(*a, Reg::R11);
+            if (ra == dst) {
+                emit(X86Opcode::Add, reg(dst), imm(static_cast<long long>(b->value)));
+                store_slot(op.index, dst);
+                return;
+            }
+            addr = Operand::make_mem(ra, static_cast<long long>(b->value));
+            break;
+        default:
+            ra = value_reg(*a, Reg::R11);
+            addr = Operand::make_mem_index(ra, ra, static_cast<unsigned>(b->value - 1), 0);
+            break;
+    }
+    emit(X86Opcode::Lea, reg(dst), addr);
+    store_slot(op.index, dst);
+}
+void X86Lowering::lower_compare(size_t at, const Op& op) {
+    Operand rhs;
+    if (op.arg2.type == ArgType::Deref) {
+        rhs = memory_operand(at, op.arg2.index, sel.address[at]);
+    } else if (!simple_arg(op.arg2, rhs)) {
+        load_arg(Reg::Rcx, op.arg2);
+        rhs = reg(Reg::Rcx);
+    }
+    Reg lhs = value_reg(op.arg, Reg::Rax);
+    emit(X86Opcode::Cmp, reg(lhs), rhs);
+}
+void X86Lowering::lower_binop(size_t at, const Op& op) {
+    if (sel.pattern[at] != X86Pattern::BinopAlu) {
+        lower_lea(at, op);
+        return;
+    }
+    Reg dst = dest_reg(op.index);
+    Cond cond;
+    if (comparison_cond(op.binop, cond)) {
+        lower_compare(at, op);
+        emit_cond(X86Opcode::Setcc, cond, reg(Reg::Rax));
+        emit(X86Opcode::Movzx, reg(dst), reg(Reg::Rax));
+        store_slot(op.index, dst);
+        return;
+    }
+    Operand rhs;
+    bool rhs_mem = op.arg2.type == ArgType::Deref && x86_binop_reads_memory(op.binop);
+    bool rhs_simple;
+    if (rhs_mem) {
+        rhs = memory_operand(at, op.arg2.index, sel.address[at]);
+        if (rhs.symbol.empty() && (rhs.reg == dst || (rhs.scale != 0 && rhs.index == dst))) dst = Reg::Rax;
+        rhs_simple = true;
+    } else {
+        rhs_simple = simple_arg(op.arg2, rhs) && !(rhs.kind == OperandKind::Reg && rhs.reg == dst);
+    }
+    switch (op.binop) {
+        case Binop::Plus:
+        case Binop::Minus:
+        case Binop::Mult:
+        case Binop::BitOr:
+        case Binop::BitAnd:
+            if (!rhs_simple) {
+                load_arg(Reg::Rcx, op.arg2);
+                rhs = reg(Reg::Rcx);
+            }
+            load_arg(dst, op.arg);
+            switch (op.binop) {
+                case Binop::Plus:   emit(X86Opcode::Add, reg(dst), rhs); break;
+                case Binop::Minus:  emit(X86Opcode::Sub, reg(dst), rhs); break;
+                case Binop::Mult:   emit(X86Opcode::Imul, reg(dst), rhs); break;
+                case Binop::BitOr:  emit(X86Opcode::Or, reg(dst), rhs); break;
+                default:            emit(X86Opcode::And, reg(dst), rhs); break;
+            }
+            break;
+        case Binop::BitShl:
+        case Binop::BitShr:
+        case Binop::BitSar:
+            if (op.arg2.type == ArgType::Literal) {
+                rhs = imm(static_cast<long long>(op.arg2.value & 63));
+            } else {
+                load_arg(Reg::Rcx, op.arg2);
+                rhs = reg(Reg::Rcx);
+            }
+            load_arg(dst, op.arg);
+            if (op.binop == Binop::BitShl) {
+                emit(X86Opcode::Shl, reg(dst), rhs);
+            } else if (op.binop == Binop::BitShr) {
+                emit(X86Opcode::Shr, reg(dst), rhs);
+            } else {
+                emit(X86Opcode::Sar, reg(dst), rhs);
+            }
+            break;
+        case Binop::Div:
+        case Binop::Mod:
+            if (!rhs_simple || rhs.kind == OperandKind::Imm) {
+                load_arg(Reg::Rcx, op.arg2);
+                rhs = reg(Reg::Rcx);
+            }
+            load_arg(Reg::Rax, op.arg);
+            emit(X86Opcode::Cqo);
+            emit(X86Opcode::Idiv, rhs);
+            store_slot(op.index, op.binop == Binop::Mod ? Reg::Rdx : Reg::Rax);
+            return;
+        default:
+            break;
+    }
+    store_slot(op.index, dst);
+}
+Operand X86Lowering::select_operand(const Arg& arg, Reg scratch) {
+    Operand src;
+    if (simple_arg(arg, src) && src.kind != OperandKind::Imm) return src;
+    load_arg(scratch, arg);
+    return reg(scratch);
+}
+void X86Lowering::lower_select(const Op& op) {
+    Reg dst = dest_reg(op.index);
+    Operand if_true = select_operand(op.arg2, Reg::Rcx);
+    Operand if_false = select_operand(op.arg3, Reg::Rdx);
+    Reg cond = value_reg(op.arg, Reg::Rax);
+    emit(X86Opcode::Test, reg(cond), reg(cond));
+    if (if_true.kind == OperandKind::Reg && if_true.reg == dst) {
+        emit_cond(X86Opcode::Cmovcc, Cond::E, reg(dst), if_false);
+    } else {
+        if (if_false.kind != OperandKind::Reg || if_false.reg != dst) emit(X86Opcode::Mov, reg(dst), if_false);
+        emit_cond(X86Opcode::Cmovcc, Cond::NE, reg(dst), if_true);
+    }
+    store_slot(op.index, dst);
+}
+void X86Lowering::lower_jump_table(const Op& op) {
+    X86JumpTable table;
+    table.symbol = x86_symbol(out.name) + ".T" + std::to_string(out.tables.size());
+    table.labels = op.labels;
+    Reg index = value_reg(op.arg, Reg::Rax);
+    emit(X86Opcode::Cmp, reg(index), imm(static_cast<long long>(op.labels.size())));
+    emit_cond(X86Opcode::Jcc, Cond::AE, Operand::make_label(op.label));
+    emit(X86Opcode::Lea, reg(Reg::Rcx), Operand::make_symbol_mem(table.symbol, 0));
+    emit(X86Opcode::Jmp, Operand::make_mem_index(Reg::Rcx, index, 8, 0));
+    out.tables.push_back(table);
+}
+Operand X86Lowering::byte_operand(const Arg& base, const Arg& index) {
+    Reg r = value_reg(base, Reg::R11);
+    if (index.type == ArgType::Literal && fits_imm32(index.value)) {
+        return Operand::make_mem(r, static_cast<long long>(index.value));
+    }
+    return Operand::make_mem_index(r, value_reg(index, Reg::Rcx), 1, 0);
+}
+// Bit count of r by summing ever wider fields, in rax. Needs no popcnt
+void X86Lowering::lower_popcount(Reg r) {
+    static const unsigned long long MASKS[3] = {0x5555555555555555ULL, 0x3333333333333333ULL,
+                                                0x0F0F0F0F0F0F0F0FULL};
+    if (r != Reg::Rax) emit(X86Opcode::Mov, reg(Reg::Rax), reg(r));
+    emit(X86Opcode::Mov, reg(Reg::Rcx), reg(Reg::Rax));
+    emit(X86Opcode::Shr, reg(Reg::Rcx), imm(1));
+    emit(X86Opcode::Mov, reg(Reg::Rdx), imm(static_cast<long long>(MASKS[0])));
+    emit(X86Opcode::And, reg(Reg::Rcx), reg(Reg::Rdx));
+    emit(X86Opcode::Sub, reg(Reg::Rax), reg(Reg::Rcx));
+    emit(X86Opcode::Mov, reg(Reg::Rcx), reg(Reg::Rax));
+    emit(X86Opcode::Shr, reg(Reg::Rcx), imm(2));
+    emit(X86Opcode::Mov, reg(Reg::Rdx), imm(static_cast<long long>(MASKS[1])));
+    emit(X86Opcode::And, reg(Reg::Rax), reg(Reg::Rdx));
+    emit(X86Opcode::And, reg(Reg::Rcx), reg(Reg::Rdx));
+    emit(X86Opcode::Add, reg(Reg::Rax), reg(Reg::Rcx));
+    emit(X86Opcode::Mov, reg(Reg::Rcx), reg(Reg::Rax));
+    emit(X86Opcode::Shr, reg(Reg::Rcx), imm(4));
+    emit(X86Opcode::Add, reg(Reg::Rax), reg(Reg::Rcx));
+    emit(X86Opcode::Mov, reg(Reg::Rdx), imm(static_cast<long long>(MASKS[2])));
+    emit(X86Opcode::And, reg(Reg::Rax), reg(Reg::Rdx));
+    emit(X86Opcode::Mov, reg(Reg::Rdx), imm(0x0101010101010101LL));
+    emit(X86Opcode::Imul, reg(Reg::Rax), reg(Reg::Rdx));
+    emit(X86Opcode::Shr, reg(Reg::Rax), imm(56));
+}
+// Memory intrinsics stage their arguments in scratch registers before
+// moving them into the fixed registers of the string instructions
+void X86Lowering::lower_intrinsic(const Op& op) {
+    const std::vector<Arg>& args = op.funcall_args;
+    Reg dst = dest_reg(op.result);
+    Operand count;
+    switch (op.intrinsic) {
+        case Intrinsic::Char:
+            emit(X86Opcode::Movzx, reg(dst), byte_operand(args[0], args[1]));
+            break;
+        case Intrinsic::Lchar:
+            load_arg(Reg::Rax, args[2]);
+            emit(X86Opcode::MovByte, byte_operand(args[0], args[1]), reg(Reg::Rax));
+            dst = Reg::Rax;
+            break;
+        case Intrinsic::Memcpy:
+            load_arg(Reg::Rax, args[0]);
+            load_arg(Reg::Rdx, args[1]);
+            load_arg(Reg::Rcx, args[2]);
+            emit(X86Opcode::Mov, reg(Reg::Rdi), reg(Reg::Rax));
+            emit(X86Opcode::Mov, reg(Reg::Rsi), reg(Reg::Rdx));
+            emit(X86Opcode::RepMovsb);
+            dst = Reg::Rax;
+            break;
+        case Intrinsic::Memset:
+            load_arg(Reg::Rdx, args[0]);
+            load_arg(Reg::Rax, args[1]);
+            load_arg(Reg::Rcx, args[2]);
+            emit(X86Opcode::Mov, reg(Reg::Rdi), reg(Reg::Rdx));
+            emit(X86Opcode::RepStosb);
+            dst = Reg::Rdx;
+            break;
+        case Intrinsic::Popcount:
+            lower_popcount(value_reg(args[0], Reg::Rax));
+            dst = Reg::Rax;
+            break;
+        case Intrinsic::Clz:
+            emit(X86Opcode::Bsr, reg(dst), reg(value_reg(args[0], Reg::Rax)));
+            emit(X86Opcode::Mov, reg(Reg::Rcx), imm(-1));
+            emit_cond(X86Opcode::Cmovcc, Cond::E, reg(dst), reg(Reg::Rcx));
+            emit(X86Opcode::Neg, reg(dst));
+            emit(X86Opcode::Add, reg(dst), imm(63));
+            break;
+        case Intrinsic::Ctz:
+            emit(X86Opcode::Bsf, reg(dst), reg(value_reg(args[0], Reg::Rax)));
+            emit(X86Opcode::Mov, reg(Reg::Rcx), imm(64));
+            emit_cond(X86Opcode::Cmovcc, Cond::E, reg(dst), reg(Reg::Rcx));
+            break;
+        case Intrinsic::Bswap:
+            load_arg(dst, args[0]);
+            emit(X86Opcode::Bswap, reg(dst));
+            break;
+        case Intrinsic::Rotl:
+        case Intrinsic::Rotr:
+            if (args[1].type == ArgType::Literal) {
+                count = imm(static_cast<long long>(args[1].value & 63));
+            } else {
+                load_arg(Reg::Rcx, args[1]);
+                count = reg(Reg::Rcx);
+            }
+            load_arg(dst, args[0]);
+            emit(op.intrinsic == Intrinsic::Rotl ? X86Opcode::Rol : X86Opcode::Ror, reg(dst), count);
+            break;
+    }
+    store_slot(op.result, dst);
+}
+// A call whose result is returned right away may leave through a jump once
+// the frame is torn down, as long as no argument goes on the stack and no
+// pointer into the frame may have been passed on
+bool X86Lowering::is_sibling_call(size_t at) const {
+    const Func& func = sel.func;
+    const Op& op = func.body[at].opcode;
+    if (!sibling_calls || at + 1 >= func.body.size() || op.funcall_args.size() > 6) return false;
+    const Op& ret = func.body[at + 1].opcode;
+    if (ret.type != OpType::Return || !ret.has_return_arg || ret.arg.type != ArgType::AutoVar ||
+        ret.arg.index != op.result) {
+        return false;
+    }
+    return true;
+}
+void X86Lowering::lower_funcall(const Op& op, RegMask clobbered, bool internal, bool tail) {
+    size_t count = op.funcall_args.size();
+    size_t stack_args = count > 6 ? count - 6 : 0;
+    long long stack_bytes = 8 * static_cast<long long>(stack_args);
+    if (stack_args % 2 == 1) {
+        emit(X86Opcode::Sub, reg(Reg::Rsp), imm(8));
+        stack_bytes += 8;
+    }
+    for (size_t i = count; i > 6; i--) {
+        load_arg(Reg::Rax, op.funcall_args[i - 1]);
+        emit(X86Opcode::Push, reg(Reg::Rax));
+    }
+    bool direct = op.arg.type == ArgType::External || op.arg.type == ArgType::RefExternal;
+    if (!direct) load_arg(Reg::R11, op.arg);
+    size_t reg_args = count < 6 ? count : 6;
+    bool clobbers = false;
+    for (size_t j = 1; j < reg_args; j++) {
+        Reg r;
+        if (!arg_reg(op.funcall_args[j], r)) continue;
+        for (size_t i = 0; i < j; i++) {
+            if (X86_ARG_REGS[i] == r) clobbers = true;
+        }
+    }
+    if (clobbers) {
+        for (size_t i = 0; i < reg_args; i++) {
+            load_arg(Reg::Rax, op.funcall_args[i]);
+            emit(X86Opcode::Push, reg(Reg::Rax));
+        }
+        for (size_t i = reg_args; i > 0; i--) {
+            emit(X86Opcode::Pop, reg(X86_ARG_REGS[i - 1]));
+        }
+    } else {
+        for (size_t i = 0; i < reg_args; i++) {
+            load_arg(X86_ARG_REGS[i], op.funcall_args[i]);
+        }
+    }
+    if (!internal) emit(X86Opcode::Mov, reg(Reg::Rax), imm(0));
+    written |= clobbered;
+    if (tail) {
+        for (size_t k = 0; k < alloc.callee_saved.size(); k++) {
+            emit(X86Opcode::Mov, reg(static_cast<Reg>(alloc.callee_saved[k])), saved_reg(k));
+        }
+        emit(X86Opcode::Leave);
+        if (direct) {
+            emit(X86Opcode::Jmp, Operand::make_symbol(x86_symbol(op.arg.name)));
+        } else {
+            emit(X86Opcode::Jmp, reg(Reg::R11));
+        }
+        return;
+    }
+    if (direct) {
+        emit(X86Opcode::Call, Operand::make_symbol(x86_symbol(op.arg.name)));
+    } else {
+        emit(X86Opcode::Call, reg(Reg::R11));
+    }
+    if (stack_bytes > 0) emit(X86Opcode::Add, reg(Reg::Rsp), imm(stack_bytes));
+    store_slot(op.result, Reg::Rax);
+}
+Operand X86Lowering::saved_reg(size_t k) const {
+    return frame(alloc.frame_words + k + 1);
+}
+void X86Lowering::lower_return(size_t at, const Op& op) {
+    if (op.has_return_arg && op.arg.type == ArgType::Deref) {
+        emit(X86Opcode::Mov, reg(Reg::Rax), memory_operand(at, op.arg.index, sel.address[at]));
+    } else if (op.has_return_arg) {
+        load_arg(Reg::Rax, op.arg);
+    } else {
+        emit(X86Opcode::Mov, reg(Reg::Rax), imm(0));
+    }
+    for (size_t k = 0; k < alloc.callee_saved.size(); k++) {
+        emit(X86Opcode::Mov, reg(static_cast<Reg>(alloc.callee_saved[k])), saved_reg(k));
+    }
+    emit(X86Opcode::Leave);
+    emit(X86Opcode::Ret);
+}
+void X86Lowering::lower_params(const Func& func) {
+    size_t reg_params = func.params_count < 6 ? func.params_count : 6;
+    bool clobbers = false;
+    for (size_t i = 0; i < reg_params; i++) {
+        Operand home = slot(i + 1);
+        if (home.kind != OperandKind::Reg) continue;
+        for (size_t j = i + 1; j < reg_params; j++) {
+            if (X86_ARG_REGS[j] == home.reg) clobbers = true;
+        }
+    }
+    if (clobbers) {
+        for (size_t i = 0; i < reg_params; i++) {
+            emit(X86Opcode::Push, reg(X86_ARG_REGS[i]));
+        }
+        for (size_t i = reg_params; i > 0; i--) {
+            emit(X86Opcode::Pop, reg(Reg::Rax));
+            if (alloc.reg[i] != NO_REG || alloc.frame_word[i] != 0) store_slot(i, Reg::Rax);
+        }
+    } else {
+        for (size_t i = 0; i < reg_params; i++) {
+            if (alloc.reg[i + 1] != NO_REG || alloc.frame_word[i + 1] != 0) {
+                store_slot(i + 1, X86_ARG_REGS[i]);
+            }
+        }
+    }
+    for (size_t i = 6; i < func.params_count; i++) {
+        if (alloc.reg[i + 1] == NO_REG && alloc.frame_word[i + 1] == 0) continue;
+        long long disp = 16 + 8 * static_cast<long long>(i - 6);
+        Reg r = dest_reg(i + 1);
+        emit(X86Opcode::Mov, reg(r), Operand::make_mem(Reg::Rbp, disp));
+        store_slot(i + 1, r);
+    }
+}
+void X86Lowering::lower_function() {
+    const Func& func = sel.func;
+    out.name = func.name;
+    out.local = func.local;
+    long long frame_bytes = 8 * static_cast<long long>(alloc.frame_words + alloc.callee_saved.size());
+    frame_bytes = (frame_bytes + 15) & ~15LL;
+    emit(X86Opcode::Push, reg(Reg::Rbp));
+    emit(X86Opcode::Mov, reg(Reg::Rbp), reg(Reg::Rsp));
+    if (frame_bytes > 0) emit(X86Opcode::Sub, reg(Reg::Rsp), imm(frame_bytes));
+    for (size_t k = 0; k < alloc.callee_saved.size(); k++) {
+        emit(X86Opcode::Mov, saved_reg(k), reg(static_cast<Reg>(alloc.callee_saved[k])));
+    }
+    lower_params(func);
+    if (sibling_calls) {
+        BitSet escaped;
+        escaped_slots(func, escaped);
+        sibling_calls = escaped.empty();
+    }
+    out.cold_begin = 0;
+    for (size_t i = 0; i < func.body.size(); i++) {
+        const Op& op = func.body[i].opcode;
+        if (func.cold_ops > 0 && i == func.body.size() - func.cold_ops) out.cold_begin = out.code.size();
+        if (sel.folded[i]) continue;
+        Operand src;
+        Cond cond = Cond::E;
+        Reg r;
+        switch (op.type) {
+            case OpType::Bogus:
+                break;
+            case OpType::UnaryNot:
+                r = value_reg(op.arg, Reg::Rax);
+                emit(X86Opcode::Test, reg(r), reg(r));
+                emit_cond(X86Opcode::Setcc, Cond::E, reg(Reg::Rax));
+                emit(X86Opcode::Movzx, reg(dest_reg(op.result)), reg(Reg::Rax));
+                store_slot(op.result, dest_reg(op.result));
+                break;
+            case OpType::Negate:
+                r = dest_reg(op.result);
+                load_arg(r, op.arg);
+                emit(X86Opcode::Neg, reg(r));
+                store_slot(op.result, r);
+                break;
+            case OpType::Asm:
+                for (size_t j = 0; j < op.asm_args.size(); j++) {
+                    X86Inst inst;
+                    inst.opcode = X86Opcode::Raw;
+                    inst.text = op.asm_args[j];
+                    out.code.push_back(inst);
+                }
+                written |= call_clobbers[i];
+                break;
+            case OpType::Binop:
+                lower_binop(i, op);
+                break;
+            case OpType::AutoAssign:
+                if (op.arg.type == ArgType::Deref) {
+                    src = memory_operand(i, op.arg.index, sel.address[i]);
+                    r = dest_reg(op.index);
+                    emit(X86Opcode::Mov, reg(r), src);
+                    store_slot(op.index, r);
+                    break;
+                }
+                if (alloc.reg[op.index] == NO_REG && simple_arg(op.arg, src) &&
+                    src.kind != OperandKind::Mem) {
+                    emit(X86Opcode::Mov, slot(op.index), src);
+                    break;
+                }
+                r = dest_reg(op.index);
+                load_arg(r, op.arg);
+                store_slot(op.index, r);
+                break;
+            case OpType::ExternalAssign:
+                r = value_reg(op.arg, Reg::Rax);
+                emit(X86Opcode::Mov, Operand::make_symbol_mem(x86_symbol(op.name), 0), reg(r));
+                break;
+            case OpType::Store:
+                if (op.arg.type == ArgType::Literal && fits_imm32(op.arg.value)) {
+                    src = imm(static_cast<long long>(op.arg.value));
+                } else {
+                    src = reg(value_reg(op.arg, Reg::Rax));
+                }
+                emit(X86Opcode::Mov, memory_operand(i, op.index, sel.address[i]), src);
+                break;
+            case OpType::Funcall:
+                if (is_sibling_call(i)) {
+                    lower_funcall(op, call_clobbers[i], internal_calls[i], true);
+                    i++;
+                } else {
+                    lower_funcall(op, call_clobbers[i], internal_calls[i], false);
+                }
+                break;
+            case OpType::Label:
+                emit(X86Opcode::Label, Operand::make_label(op.label));
+                break;
+            case OpType::JmpLabel:
+                emit(X86Opcode::Jmp, Operand::make_label(op.label));
+                break;
+            case OpType::JmpIfNotLabel:
+                if (op.arg.type == ArgType::Deref) {
+                    emit(X86Opcode::Cmp, memory_operand(i, op.arg.index, sel.address[i]), imm(0));
+                } else {
+                    r = value_reg(op.arg, Reg::Rax);
+                    emit(X86Opcode::Test, reg(r), reg(r));
+                }
+                emit_cond(X86Opcode::Jcc, Cond::E, Operand::make_label(op.label));
+                break;
+            case OpType::CmpJmpIfNotLabel:
+                lower_compare(i, op);
+                comparison_cond(op.binop, cond);
+                emit_cond(X86Opcode::Jcc, negated(cond), Operand::make_label(op.label));
+                break;
+            case OpType::Select:
+                lower_select(op);
+                break;
+            case OpType::JmpTable:
+                lower_jump_table(op);
+                break;
+            case OpType::Intrinsic:
+                lower_intrinsic(op);
+                break;
+            case OpType::Return:
+                lower_return(i, op);
+                break;
+        }
+    }
+    if (func.body.empty() || op_falls_through(func.body.back().opcode)) {
+        Op fallthrough;
+        fallthrough.type = OpType::Return;
+        lower_return(func.body.size(), fallthrough);
+    }
+    if (func.cold_ops == 0) out.cold_begin = out.code.size();
+}
+RegMask X86Lowering::clobbers() const {
+    RegMask saved = reg_bit(static_cast<int>(Reg::Rsp)) | reg_bit(static_cast<int>(Reg::Rbp));
+    for (int r : alloc.callee_saved) {
+        saved |= reg_bit(r);
+    }
+    return written & ~saved;
+}
+// Registers the string instructions of the memory intrinsics overwrite
+static RegMask intrinsic_clobbers(const Op& op) {
+    RegMask mask = reg_bit(static_cast<int>(Reg::Rdi)) | reg_bit(static_cast<int>(Reg::Rcx));
+    if (op.intrinsic == Intrinsic::Memcpy) return mask | reg_bit(static_cast<int>(Reg::Rsi));
+    if (op.intrinsic == Intrinsic::Memset) return mask;
+    return 0;
+}
+static const char* const X86_REG_NAMES[4][16] = {
+    {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+     "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"},
+    {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+     "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+    {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+     "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"},
+    {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+     "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"},
+};
+static const char* const X86_HIGH_BYTE_NAMES[4] = {"ah", "ch", "dh", "bh"};
+// The general purpose register a clobber names, in any width, or -1
+static int clobbered_register(const std::string& name) {
+    for (size_t w = 0; w < 4; w++) {
+        for (int r = 0; r < 16; r++) {
+            if (name == X86_REG_NAMES[w][r]) return r;
+        }
+    }
+    for (int r = 0; r < 4; r++) {
+        if (name == X86_HIGH_BYTE_NAMES[r]) return r;
+    }
+    return -1;
+}
+// Registers an inline assembly block may overwrite. Without a clobber list
+// that is any register a call may overwrite. Flags, memory and the vector
+// registers hold nothing of ours, and a name we do not know counts as the
+// whole list of a call. rsp and rbp have to come back unchanged
+static RegMask asm_clobbers(const Op& op) {
+    if (!op.asm_declared) return X86_C_CLOBBERS;
+    RegMask mask = 0;
+    for (const std::string& name : op.asm_clobbers) {
+        int r = clobbered_register(name);
+        if (r >= 0) {
+            mask |= reg_bit(r);
+        } else if (name != "memory" && name != "cc" && name.compare(0, 3, "xmm") != 0 &&
+                   name.compare(0, 3, "ymm") != 0 && name.compare(0, 3, "zmm") != 0) {
+            mask |= X86_C_CLOBBERS;
+        }
+    }
+    return mask & ~(reg_bit(static_cast<int>(Reg::Rsp)) | reg_bit(static_cast<int>(Reg::Rbp)));
+}
+// Callee-saved registers that inline assembly overwrites are saved in the
+// prologue along with the ones the allocator handed out
+static void save_asm_clobbered(const Func& func, const std::vector<RegMask>& call_clobbers,
+                               RegAllocation& alloc) {
+    RegMask saved = 0;
+    for (int r : alloc.callee_saved) {
+        saved |= reg_bit(r);
+    }
+    for (size_t i = 0; i < func.body.size(); i++) {
+        if (func.body[i].opcode.type != OpType::Asm) continue;
+        RegMask extra = call_clobbers[i] & X86_C_PRESERVED & ~saved;
+        for (int r = 0; r < 16; r++) {
+            if (!(extra & reg_bit(r))) continue;
+            alloc.callee_saved.push_back(r);
+            saved |= reg_bit(r);
+        }
+    }
+}
+void lower_x86_64(const Compiler& c, X86Program& program, bool allocate, bool report) {
+    program.funcs.clear();
+    program.funcs.resize(c.funcs.size());
+    std::map<std::string, size_t> index;
+    for (size_t i = 0; i < c.funcs.size(); i++) {
+        index[c.funcs[i].name] = i;
+    }
+    std::vector<bool> visited(c.funcs.size(), false);
+    std::vector<size_t> order;
+    for (size_t i = 0; i < c.funcs.size(); i++) {
+        if (!visited[i]) callees_first(c, index, i, visited, order);
+    }
+    std::vector<bool> lowered(c.funcs.size(), false);
+    std::vector<RegMask> func_clobbers(c.funcs.size(), X86_C_CLOBBERS);
+    for (size_t f : order) {
+        X86Selection sel;
+        select_x86_64(c.funcs[f], allocate, sel);
+        const Func& func = sel.func;
+        std::vector<RegMask> call_clobbers(func.body.size(), 0);
+        std::vector<bool> internal(func.body.size(), false);
+        for (size_t i = 0; i < func.body.size(); i++) {
+            const Op& op = func.body[i].opcode;
+            if (op.type == OpType::Intrinsic) call_clobbers[i] = intrinsic_clobbers(op);
+            if (op.type == OpType::Asm) call_clobbers[i] = asm_clobbers(op);
+            if (op.type != OpType::Funcall) continue;
+            size_t callee = 0;
+            internal[i] = direct_callee(op, index, callee);
+            call_clobbers[i] = internal[i] && lowered[callee] ? func_clobbers[callee] : X86_C_CLOBBERS;
+            for (size_t a = 0; a < op.funcall_args.size() && a < 6; a++) {
+                call_clobbers[i] |= reg_bit(static_cast<int>(X86_ARG_REGS[a]));
+            }
+        }
+        RegAllocation alloc;
+        if (allocate) {
+            allocate_registers(func, X86_REGISTER_FILE, call_clobbers, alloc);
+        } else {
+            assign_stack_slots(func, alloc);
+        }
+        save_asm_clobbered(func, call_clobbers, alloc);
+        if (report) {
+            printf("INFO: %s: %zu slots promoted to registers, %zu spilled, %zu kept in memory\n",
+                   func.name.c_str(), alloc.in_registers, alloc.spilled, alloc.in_memory);
+        }
+        X86Lowering lowering(program.funcs[f], sel, alloc, call_clobbers, internal, allocate);
+        lowering.lower_function();
+        func_clobbers[f] = lowering.clobbers();
+        lowered[f] = true;
+    }
+}
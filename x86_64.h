@@ -0,0 +1,227 @@
+#ifndef X86_64_H
+#define X86_64_H
+
+#include "compiler.h"
+#include "elf64.h"
+#include "regalloc.h"
+#include <string>
+#include <vector>
+
+// General purpose registers, in hardware encoding order
+enum class Reg {
+    Rax, Rcx, Rdx, Rbx, Rsp, Rbp, Rsi, Rdi,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Condition codes, valued by their encoding in Jcc/SETcc/CMOVcc. Flipping
+// the low bit negates a condition
+enum class Cond {
+    B = 2,   // Unsigned below
+    AE = 3,  // Unsigned above or equal
+    E = 4,
+    NE = 5,
+    L = 12,
+    GE = 13,
+    LE = 14,
+    G = 15
+};
+
+enum class OperandKind {
+    None,
+    Reg,
+    Imm,
+    Mem,     // qword [reg + index*scale + value], or RIP-relative [symbol + value]
+    Label,   // Function-local label
+    Symbol
+};
+
+struct Operand {
+    OperandKind kind;
+    Reg reg;
+    Reg index;
+    unsigned scale;  // 1, 2, 4 or 8; 0 without an index register
+    long long value;
+    std::string symbol;
+    size_t label;
+
+    Operand() : kind(OperandKind::None), reg(Reg::Rax), index(Reg::Rax), scale(0), value(0), label(0) {}
+
+    static Operand make_reg(Reg r) {
+        Operand o;
+        o.kind = OperandKind::Reg;
+        o.reg = r;
+        return o;
+    }
+
+    static Operand make_imm(long long v) {
+        Operand o;
+        o.kind = OperandKind::Imm;
+        o.value = v;
+        return o;
+    }
+
+    static Operand make_mem(Reg base, long long disp) {
+        Operand o;
+        o.kind = OperandKind::Mem;
+        o.reg = base;
+        o.value = disp;
+        return o;
+    }
+
+    static Operand make_mem_index(Reg base, Reg idx, unsigned scale, long long disp) {
+        Operand o = make_mem(base, disp);
+        o.index = idx;
+        o.scale = scale;
+        return o;
+    }
+
+    static Operand make_symbol_mem(const std::string& sym, long long disp) {
+        Operand o;
+        o.kind = OperandKind::Mem;
+        o.symbol = sym;
+        o.value = disp;
+        return o;
+    }
+
+    static Operand make_label(size_t l) {
+        Operand o;
+        o.kind = OperandKind::Label;
+        o.label = l;
+        return o;
+    }
+
+    static Operand make_symbol(const std::string& sym) {
+        Operand o;
+        o.kind = OperandKind::Symbol;
+        o.symbol = sym;
+        return o;
+    }
+};
+
+enum class X86Opcode {
+    Label,
+    Mov,
+    Lea,
+    Add,
+    Sub,
+    Imul,
+    And,
+    Or,
+    Shl,    // Count in cl or an immediate
+    Shr,
+    Sar,
+    Neg,
+    Cmp,
+    Test,
+    Cqo,
+    Idiv,
+    Setcc,  // Writes the low byte of dst
+    Movzx,  // dst = zero-extended low byte of src, a register or the byte at a Mem
+    MovByte, // Stores the low byte of register src to the byte at Mem dst
+    Bsf,    // Bit scans, ZF set and dst undefined for a zero src
+    Bsr,
+    Bswap,
+    Rol,    // Count in cl or an immediate
+    Ror,
+    Cmovcc, // dst = src if cond holds
+    Jmp,    // To a label, a symbol (sibling call) or indirect through a register or memory
+    Jcc,
+    Call,
+    Ret,
+    Push,
+    Pop,
+    Leave,
+    RepMovsb, // Copies rcx bytes from [rsi] to [rdi]
+    RepStosb, // Fills rcx bytes at [rdi] with al
+    Raw     // Verbatim assembly line
+};
+
+struct X86Inst {
+    X86Opcode opcode;
+    Cond cond;
+    Operand dst;
+    Operand src;
+    std::string text;
+
+    X86Inst() : opcode(X86Opcode::Raw), cond(Cond::E) {}
+};
+
+// Targets of a jump table, one code address per entry in the data section
+struct X86JumpTable {
+    std::string symbol;
+    std::vector<size_t> labels;
+};
+
+// code[cold_begin, end) is the rarely run tail, placed apart from the hot
+// code of all functions
+struct X86Func {
+    std::string name;
+    std::vector<X86Inst> code;
+    size_t cold_begin;
+    std::vector<X86JumpTable> tables;
+    bool local;  // Not exported, see Func::local
+
+    X86Func() : cold_begin(0), local(false) {}
+};
+
+// Instruction selection patterns, see x86_64_patterns.def
+enum class X86Pattern {
+#define X86_PATTERN(name, root, cost) name,
+#include "x86_64_patterns.def"
+#undef X86_PATTERN
+};
+
+// A function prepared for lowering. Ops folded into a pattern are moved
+// right in front of the op that consumes them and emit no code of their own
+struct X86Selection {
+    Func func;
+    std::vector<bool> folded;
+    std::vector<X86Pattern> pattern;  // Pattern of each binop that is not folded
+    std::vector<X86Pattern> address;  // Pattern of the memory operand an op reads or writes
+};
+
+// Binops that take their second operand from memory
+bool x86_binop_reads_memory(Binop binop);
+
+// Picks, greedily at each memory operand and binop of func, the matching
+// pattern of lowest net cost. Without fold no op is folded and every
+// memory operand is a plain slot load
+void select_x86_64(const Func& func, bool fold, X86Selection& sel);
+
+// Program lowered to machine instructions, shared by the assembly printer
+// and the object writer
+struct X86Program {
+    std::vector<X86Func> funcs;
+};
+
+// Assembly-level name of a B symbol, kept apart from register and
+// instruction names
+std::string x86_symbol(const std::string& name);
+
+// Label of the string literal data
+extern const char* const X86_DATA_SYMBOL;
+
+// Registers carrying the first integer arguments (System V)
+extern const Reg X86_ARG_REGS[6];
+
+// Registers handed to the allocator. rax, rcx, rdx and r11 stay free as
+// scratch for division, shift counts and indirect calls
+extern const RegisterFile X86_REGISTER_FILE;
+
+// Without allocate every auto slot keeps its own stack word. Functions are
+// lowered callees first: a direct call to a B function of the program skips
+// the varargs setup of al and clobbers only the registers that function
+// writes, so callers may keep values in caller-saved registers across it.
+// Arguments use the System V registers, so exported and address-taken
+// entry points need no shim. With allocate, a call whose result is returned
+// at once becomes a jump after the epilogue. With report, prints where the
+// slots of each function ended up
+void lower_x86_64(const Compiler& c, X86Program& program, bool allocate, bool report);
+
+// Encodes the lowered program to machine code. The cold code of every
+// function follows all hot code at the end of .text. String data comes first
+// in .data, then the globals and the jump tables; globals without
+// initializers get their storage in .bss
+bool encode_x86_64(const Compiler& c, const X86Program& program, ObjectFile& obj);
+
+#endif // X86_64_H
@@ -0,0 +1,493 @@
+#include "x86_64.h"
+#include <cstdio>
+#include <map>
+static bool fits_i8(long long v) {
+    return v >= -128 && v <= 127;
+}
+static bool fits_i32(long long v) {
+    return v >= -2147483648LL && v <= 2147483647LL;
+}
+static int reg_num(Reg r) {
+    return static_cast<int>(r);
+}
+static bool is_reg(const Operand& o) {
+    return o.kind == OperandKind::Reg;
+}
+static bool is_rm(const Operand& o) {
+    return o.kind == OperandKind::Reg || o.kind == OperandKind::Mem;
+}
+static bool is_imm(const Operand& o) {
+    return o.kind == OperandKind::Imm;
+}
+struct LabelFixup {
+    size_t at;
+    size_t label;
+};
+// Label addresses and pending rel32 references of one function, kept until
+// both its hot and cold code are placed
+struct EncodedFunc {
+    std::map<size_t, size_t> labels;
+    std::vector<LabelFixup> fixups;
+};
+class X86Encoder {
+public:
+    X86Encoder(ObjectFile& o, const std::map<std::string, size_t>& t)
+        : obj(o), code(o.text), table_offsets(t), ok(true) {}
+    void encode_hot(const X86Func& func, EncodedFunc& state);
+    void encode_cold(const X86Func& func, EncodedFunc& state);
+    void resolve(const X86Func& func, EncodedFunc& state);
+    bool succeeded() const { return ok; }
+
+private:
+    ObjectFile& obj;
+    std::vector<unsigned char>& code;
+    const std::map<std::string, size_t>& table_offsets;
+    const X86Func* current;
+    EncodedFunc* state;
+    bool ok;
+
+    void byte(unsigned int b);
+    void dword(long long v);
+    void imm(long long v, size_t size);
+    void reloc(ObjRelocType type, const std::string& sym, long long addend);
+    void rm_inst(unsigned int opcode, int reg_field, const Operand& rm, size_t imm_size,
+                 bool wide = true, bool byte_regs = false);
+    void alu(const X86Inst& inst, int ext);
+    void shift(const X86Inst& inst, int ext);
+    void label_ref(unsigned int opcode, size_t label);
+    void fill_jump_table(const X86JumpTable& table);
+    void unsupported(const X86Inst& inst);
+    void encode_inst(const X86Inst& inst);
+};
+void X86Encoder::byte(unsigned int b) {
+    code.push_back(static_cast<unsigned char>(b & 0xFF));
+}
+void X86Encoder::dword(long long v) {
+    for (int i = 0; i < 4; i++) byte(static_cast<unsigned int>(v >> (8 * i)));
+}
+void X86Encoder::imm(long long v, size_t size) {
+    for (size_t i = 0; i < size; i++) byte(static_cast<unsigned int>(v >> (8 * i)));
+}
+void X86Encoder::reloc(ObjRelocType type, const std::string& sym, long long addend) {
+    ObjReloc r;
+    r.section = ObjSection::Text;
+    r.offset = code.size();
+    r.type = type;
+    r.addend = addend;
+    r.target_section = ObjSection::Undefined;
+    auto table = table_offsets.find(sym);
+    if (sym == X86_DATA_SYMBOL) {
+        r.target_section = ObjSection::Data;
+    } else if (table != table_offsets.end()) {
+        r.target_section = ObjSection::Data;
+        r.addend += static_cast<long long>(table->second);
+    } else {
+        r.symbol = sym.substr(x86_symbol("").size());
+    }
+    obj.relocs.push_back(r);
+}
+void X86Encoder::rm_inst(unsigned int opcode, int reg_field, const Operand& rm, size_t imm_size,
+                         bool wide, bool byte_regs) {
+    bool mem = rm.kind == OperandKind::Mem;
+    bool rip = mem && !rm.symbol.empty();
+    int base = rip ? 0 : reg_num(rm.reg);
+    int rex = 0;
+    if (wide) rex |= 0x08;
+    if (reg_field >= 8) rex |= 0x04;
+    if (!rip && base >= 8) rex |= 0x01;
+    bool indexed = mem && !rip && rm.scale != 0;
+    int index = indexed ? reg_num(rm.index) : 0;
+    if (index >= 8) rex |= 0x02;
+    bool low_byte_reg = (!mem && base >= 4 && base < 8) || (reg_field >= 4 && reg_field < 8);
+    if (rex != 0 || (byte_regs && low_byte_reg)) byte(0x40 | rex);
+    if (opcode > 0xFF) byte(opcode >> 8);
+    byte(opcode);
+    int reg_bits = (reg_field & 7) << 3;
+    if (!mem) {
+        byte(0xC0 | reg_bits | (base & 7));
+        return;
+    }
+    if (rip) {
+        byte(0x05 | reg_bits);
+        reloc(ObjRelocType::Pc32, rm.symbol, rm.value - 4 - static_cast<long long>(imm_size));
+        dword(0);
+        return;
+    }
+    int mod = 2;
+    if (rm.value == 0 && (base & 7) != 5) {
+        mod = 0;
+    } else if (fits_i8(rm.value)) {
+        mod = 1;
+    }
+    if (indexed) {
+        int ss = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+        byte((mod << 6) | reg_bits | 4);
+        byte((ss << 6) | ((index & 7) << 3) | (base & 7));
+    } else {
+        byte((mod << 6) | reg_bits | (base & 7));
+        if ((base & 7) == 4) byte(0x24);
+    }
+    if (mod == 1) byte(static_cast<unsigned int>(rm.value));
+    if (mod == 2) dword(rm.value);
+}
+void X86Encoder::alu(const X86Inst& inst, int ext) {
+    const Operand& dst = inst.dst;
+    const Operand& src = inst.src;
+    if (is_rm(dst) && is_reg(src)) {
+        rm_inst(ext * 8 + 0x01, reg_num(src.reg), dst, 0);
+    } else if (is_reg(dst) && src.kind == OperandKind::Mem) {
+        rm_inst(ext * 8 + 0x03, reg_num(dst.reg), src, 0);
+    } else if (is_rm(dst) && is_imm(src) && fits_i8(src.value)) {
+        rm_inst(0x83, ext, dst, 1);
+        imm(src.value, 1);
+    } else if (is_rm(dst) && is_imm(src) && fits_i32(src.value)) {
+        rm_inst(0x81, ext, dst, 4);
+        imm(src.value, 4);
+    } else {
+        unsupported(inst);
+    }
+}
+void X86Encoder::shift(const X86Inst& inst, int ext) {
+    if (!is_rm(inst.dst)) {
+        unsupported(inst);
+    } else if (is_reg(inst.src) && inst.src.reg == Reg::Rcx) {
+        rm_inst(0xD3, ext, inst.dst, 0);
+    } else if (is_imm(inst.src) && inst.src.value == 1) {
+        rm_inst(0xD1, ext, inst.dst, 0);
+    } else if (is_imm(inst.src)) {
+        rm_inst(0xC1, ext, inst.dst, 1);
+        imm(inst.src.value & 63, 1);
+    } else {
+        unsupported(inst);
+    }
+}
+void X86Encoder::label_ref(unsigned int opcode, size_t label) {
+    if (opcode > 0xFF) byte(opcode >> 8);
+    byte(opcode);
+    state->fixups.push_back({code.size(), label});
+    dword(0);
+}
+void X86Encoder::fill_jump_table(const X86JumpTable& table) {
+    size_t offset = table_offsets.at(table.symbol);
+    for (size_t i = 0; i < table.labels.size(); i++) {
+        auto it = state->labels.find(table.labels[i]);
+        if (it == state->labels.end()) {
+            fprintf(stderr, "ERROR: %s: jump table entry to undefined label %zu\n", current->name.c_str(),
+                    table.labels[i]);
+            ok = false;
+            continue;
+        }
+        ObjReloc r;
+        r.section = ObjSection::Data;
+        r.offset = offset + 8 * i;
+        r.type = ObjRelocType::Abs64;
+        r.target_section = ObjSection::Text;
+        r.addend = static_cast<long long>(it->second);
+        obj.relocs.push_back(r);
+    }
+}
+void X86Encoder::unsupported(const X86Inst& inst) {
+    fprintf(stderr, "ERROR: %s: cannot encode x86-64 instruction %d with these operands\n",
+            current->name.c_str(), static_cast<int>(inst.opcode));
+    ok = false;
+}
+void X86Encoder::encode_inst(const X86Inst& inst) {
+    const Operand& dst = inst.dst;
+    const Operand& src = inst.src;
+    switch (inst.opcode) {
+        case X86Opcode::Label:
+            state->labels[dst.label] = code.size();
+            break;
+        case X86Opcode::Mov:
+            if (is_rm(dst) && is_reg(src)) {
+                rm_inst(0x89, reg_num(src.reg), dst, 0);
+            } else if (is_reg(dst) && src.kind == OperandKind::Mem) {
+                rm_inst(0x8B, reg_num(dst.reg), src, 0);
+            } else if (is_reg(dst) && is_imm(src) && src.value >= 0 && src.value <= 0xFFFFFFFFLL) {
+                if (reg_num(dst.reg) >= 8) byte(0x41);
+                byte(0xB8 + (reg_num(dst.reg) & 7));
+                imm(src.value, 4);
+            } else if (is_rm(dst) && is_imm(src) && fits_i32(src.value)) {
+                rm_inst(0xC7, 0, dst, 4);
+                imm(src.value, 4);
+            } else if (is_reg(dst) && is_imm(src)) {
+                byte(reg_num(dst.reg) >= 8 ? 0x49 : 0x48);
+                byte(0xB8 + (reg_num(dst.reg) & 7));
+                imm(src.value, 8);
+            } else {
+                unsupported(inst);
+            }
+            break;
+        case X86Opcode::Lea:
+            if (is_reg(dst) && src.kind == OperandKind::Mem) {
+                rm_inst(0x8D, reg_num(dst.reg), src, 0);
+            } else {
+                unsupported(inst);
+            }
+            break;
+        case X86Opcode::Add: alu(inst, 0); break;
+        case X86Opcode::Or:  alu(inst, 1); break;
+        case X86Opcode::And: alu(inst, 4); break;
+        case X86Opcode::Sub: alu(inst, 5); break;
+        case X86Opcode::Cmp: alu(inst, 7); break;
+        case X86Opcode::Imul:
+            if (is_reg(dst) && is_rm(src)) {
+                rm_inst(0x0FAF, reg_num(dst.reg), src, 0);
+            } else if (is_reg(dst) && is_imm(src) && fits_i8(src.value)) {
+                rm_inst(0x6B, reg_num(dst.reg), dst, 1);
+                imm(src.value, 1);
+            } else if (is_reg(dst) && is_imm(src) && fits_i32(src.value)) {
+                rm_inst(0x69, reg_num(dst.reg), dst, 4);
+                imm(src.value, 4);
+            } else {
+                unsupported(inst);
+            }
+            break;
+        case X86Opcode::Test:
+            if (is_rm(dst) && is_reg(src)) {
+                rm_inst(0x85, reg_num(src.reg), dst, 0);
+            } else if (is_rm(dst) && is_imm(src) && fits_i32(src.value)) {
+                rm_inst(0xF7, 0, dst, 4);
+                imm(src.value, 4);
+            } else {
+                unsupported(inst);
+            }
+            break;
+        case X86Opcode::Shl: shift(inst, 4); break;
+        case X86Opcode::Shr: shift(inst, 5); break;
+        case X86Opcode::Sar: shift(inst, 7); break;
+        case X86Opcode::Neg:
+            if (is_rm(dst)) rm_inst(0xF7, 3, dst, 0);
+            else unsupported(inst);
+            break;
+        case X86Opcode::Idiv:
+            if (is_rm(dst)) rm_inst(0xF7, 7, dst, 0);
+            else unsupported(inst);
+            break;
+        case X86Opcode::Cqo:
+            byte(0x48);
+            byte(0x99);
+            break;
+        case X86Opcode::Setcc:
+            if (is_reg(dst)) rm_inst(0x0F90 + static_cast<int>(inst.cond), 0, dst, 0, false, true);
+            else unsupported(inst);
+            break;
+        case X86Opcode::Cmovcc:
+            if (is_reg(dst) && is_rm(src)) rm_inst(0x0F40 + static_cast<int>(inst.cond), reg_num(dst.reg), src, 0);
+            else unsupported(inst);
+            break;
+        case X86Opcode::Movzx:
+            if (is_reg(dst) && is_rm(src)) rm_inst(0x0FB6, reg_num(dst.reg), src, 0, true, true);
+            else unsupported(inst);
+            break;
+        case X86Opcode::MovByte:
+            if (dst.kind == OperandKind::Mem && is_reg(src)) rm_inst(0x88, reg_num(src.reg), dst, 0, false, true);
+            else unsupported(inst);
+            break;
+        case X86Opcode::Bsf:
+        case X86Opcode::Bsr:
+            if (is_reg(dst) && is_rm(src)) {
+                rm_inst(inst.opcode == X86Opcode::Bsf ? 0x0FBC : 0x0FBD, reg_num(dst.reg), src, 0);
+            } else {
+                unsupported(inst);
+            }
+            break;
+        case X86Opcode::Bswap:
+            if (is_reg(dst)) {
+                byte(reg_num(dst.reg) >= 8 ? 0x49 : 0x48);
+                byte(0x0F);
+                byte(0xC8 + (reg_num(dst.reg) & 7));
+            } else {
+                unsupported(inst);
+            }
+            break;
+        case X86Opcode::Rol: shift(inst, 0); break;
+        case X86Opcode::Ror: shift(inst, 1); break;
+        case X86Opcode::Jmp:
+            if (dst.kind == OperandKind::Label) {
+                label_ref(0xE9, dst.label);
+            } else if (dst.kind == OperandKind::Symbol) {
+                byte(0xE9);
+                reloc(ObjRelocType::Plt32, dst.symbol, -4);
+                dword(0);
+            } else if (is_rm(dst)) {
+                rm_inst(0xFF, 4, dst, 0, false);
+            } else {
+                unsupported(inst);
+            }
+            break;
+        case X86Opcode::Jcc:
+            label_ref(0x0F80 + static_cast<int>(inst.cond), dst.label);
+            break;
+        case X86Opcode::Call:
+            if (dst.kind == OperandKind::Symbol) {
+                byte(0xE8);
+                reloc(ObjRelocType::Plt32, dst.symbol, -4);
+                dword(0);
+            } else if (is_rm(dst)) {
+                rm_inst(0xFF, 2, dst, 0, false);
+            } else {
+                unsupported(inst);
+            }
+            break;
+        case X86Opcode::Ret:
+            byte(0xC3);
+            break;
+        case X86Opcode::Push:
+        case X86Opcode::Pop:
+            if (is_reg(dst)) {
+                if (reg_num(dst.reg) >= 8) byte(0x41);
+                byte((inst.opcode == X86Opcode::Push ? 0x50 : 0x58) + (reg_num(dst.reg) & 7));
+            } else {
+                unsupported(inst);
+            }
+            break;
+        case X86Opcode::Leave:
+            byte(0xC9);
+            break;
+        case X86Opcode::RepMovsb:
+            byte(0xF3);
+            byte(0xA4);
+            break;
+        case X86Opcode::RepStosb:
+            byte(0xF3);
+            byte(0xAA);
+            break;
+        case X86Opcode::Raw:
+            fprintf(stderr, "ERROR: %s: inline assembly `%s` needs an assembler, use the fasm-x86_64-linux target\n",
+                    current->name.c_str(), inst.text.c_str());
+            ok = false;
+            break;
+    }
+}
+void X86Encoder::encode_hot(const X86Func& func, EncodedFunc& s) {
+    current = &func;
+    state = &s;
+    while (code.size() % 16 != 0) byte(0xCC);
+    ObjSymbol sym;
+    sym.name = func.name;
+    sym.section = ObjSection::Text;
+    sym.offset = code.size();
+    sym.is_func = true;
+    sym.is_local = func.local;
+    for (size_t i = 0; i < func.cold_begin; i++) {
+        encode_inst(func.code[i]);
+    }
+    sym.size = code.size() - sym.offset;
+    obj.symbols.push_back(sym);
+}
+void X86Encoder::encode_cold(const X86Func& func, EncodedFunc& s) {
+    current = &func;
+    state = &s;
+    for (size_t i = func.cold_begin; i < func.code.size(); i++) {
+        encode_inst(func.code[i]);
+    }
+}
+void X86Encoder::resolve(const X86Func& func, EncodedFunc& s) {
+    current = &func;
+    state = &s;
+    for (const LabelFixup& fixup : s.fixups) {
+        auto it = s.labels.find(fixup.label);
+        if (it == s.labels.end()) {
+            fprintf(stderr, "ERROR: %s: jump to undefined label %zu\n", func.name.c_str(), fixup.label);
+            ok = false;
+            continue;
+        }
+        long long rel = static_cast<long long>(it->second) - static_cast<long long>(fixup.at + 4);
+        for (int i = 0; i < 4; i++) code[fixup.at + i] = static_cast<unsigned char>(rel >> (8 * i));
+    }
+    for (const X86JumpTable& table : func.tables) {
+        fill_jump_table(table);
+    }
+}
+static void append_word(std::vector<unsigned char>& data, unsigned long long v) {
+    for (int i = 0; i < 8; i++) data.push_back(static_cast<unsigned char>(v >> (8 * i)));
+}
+static void add_data_reloc(ObjectFile& obj, const std::string& symbol, ObjSection target, long long addend) {
+    ObjReloc r;
+    r.section = ObjSection::Data;
+    r.offset = obj.data.size();
+    r.type = ObjRelocType::Abs64;
+    r.symbol = symbol;
+    r.target_section = target;
+    r.addend = addend;
+    obj.relocs.push_back(r);
+    append_word(obj.data, 0);
+}
+static void layout_globals(const Compiler& c, ObjectFile& obj) {
+    obj.data = c.data;
+    while (obj.data.size() % 8 != 0) obj.data.push_back(0);
+    for (size_t i = 0; i < c.globals.size(); i++) {
+        const Global& global = c.globals[i];
+        size_t wanted = global.is_vec ? global.minimum_size : 1;
+        size_t words = global.values.size() > wanted ? global.values.size() : wanted;
+        ObjSymbol sym;
+        sym.name = global.name;
+        sym.section = ObjSection::Data;
+        sym.offset = obj.data.size();
+        sym.is_func = false;
+        sym.is_local = false;
+        if (global.values.empty() && words > 0) {
+            if (global.is_vec) {
+                add_data_reloc(obj, "", ObjSection::Bss, static_cast<long long>(obj.bss_size));
+                sym.size = 8;
+            } else {
+                sym.section = ObjSection::Bss;
+                sym.offset = obj.bss_size;
+                sym.size = 8 * words;
+            }
+            obj.bss_size += 8 * words;
+            obj.symbols.push_back(sym);
+            continue;
+        }
+        if (global.is_vec) {
+            add_data_reloc(obj, "", ObjSection::Data, static_cast<long long>(sym.offset + 8));
+        }
+        for (size_t j = 0; j < global.values.size(); j++) {
+            const ImmediateValue& val = global.values[j];
+            switch (val.type) {
+                case ImmediateValueType::Literal:
+                    append_word(obj.data, static_cast<unsigned long long>(val.literal));
+                    break;
+                case ImmediateValueType::Name:
+                    add_data_reloc(obj, val.name, ObjSection::Undefined, 0);
+                    break;
+                case ImmediateValueType::DataOffset:
+                    add_data_reloc(obj, "", ObjSection::Data, static_cast<long long>(val.offset));
+                    break;
+            }
+        }
+        for (size_t j = global.values.size(); j < words; j++) {
+            append_word(obj.data, 0);
+        }
+        sym.size = obj.data.size() - sym.offset;
+        obj.symbols.push_back(sym);
+    }
+}
+static void layout_jump_tables(const X86Program& program, ObjectFile& obj,
+                               std::map<std::string, size_t>& offsets) {
+    for (const X86Func& func : program.funcs) {
+        for (const X86JumpTable& table : func.tables) {
+            offsets[table.symbol] = obj.data.size();
+            for (size_t i = 0; i < table.labels.size(); i++) append_word(obj.data, 0);
+        }
+    }
+}
+bool encode_x86_64(const Compiler& c, const X86Program& program, ObjectFile& obj) {
+    obj = ObjectFile();
+    layout_globals(c, obj);
+    std::map<std::string, size_t> table_offsets;
+    layout_jump_tables(program, obj, table_offsets);
+    X86Encoder encoder(obj, table_offsets);
+    std::vector<EncodedFunc> encoded(program.funcs.size());
+    for (size_t i = 0; i < program.funcs.size(); i++) {
+        encoder.encode_hot(program.funcs[i], encoded[i]);
+    }
+    for (size_t i = 0; i < program.funcs.size(); i++) {
+        encoder.encode_cold(program.funcs[i], encoded[i]);
+    }
+    for (size_t i = 0; i < program.funcs.size(); i++) {
+        encoder.resolve(program.funcs[i], encoded[i]);
+    }
+    return encoder.succeeded();
+}
@@ -0,0 +1,381 @@
+#include "x86_64.h"
+#include "analysis.h"
+#include <algorithm>
+enum class X86PatternRoot {
+    Address,
+    Binop
+};
+struct TileSite {
+    size_t use;
+    size_t slot;
+};
+class X86Selector;
+typedef bool (*X86Matcher)(const X86Selector& s, const TileSite& site, std::vector<size_t>& covered);
+struct X86PatternInfo {
+    X86Pattern pattern;
+    X86PatternRoot root;
+    unsigned cost;
+    X86Matcher match;
+};
+#define X86_PATTERN(name, root, cost) \
+    static bool match_##name(const X86Selector& s, const TileSite& site, std::vector<size_t>& covered);
+#include "x86_64_patterns.def"
+#undef X86_PATTERN
+static const X86PatternInfo PATTERNS[] = {
+#define X86_PATTERN(name, root, cost) \
+    {X86Pattern::name, X86PatternRoot::root, cost, match_##name},
+#include "x86_64_patterns.def"
+#undef X86_PATTERN
+};
+static const size_t NONE = static_cast<size_t>(-1);
+class X86Selector {
+public:
+    X86Selector(X86Selection& s) : sel(s) {}
+    void run();
+
+    const Op& op(size_t i) const { return sel.func.body[i].opcode; }
+    size_t foldable_def(size_t slot, size_t reader) const;
+
+private:
+    X86Selection& sel;
+    BitSet escaped;
+    std::vector<BitSet> live_after;
+    std::vector<size_t> last_def;
+    std::vector<std::vector<std::pair<size_t, size_t>>> reaching;  // (slot, def) pairs each op reads
+    size_t current;
+    std::vector<unsigned> own_cost;
+    std::vector<size_t> folded_into;
+    size_t block_begin;
+
+    unsigned choose(X86PatternRoot root, const TileSite& site, X86Pattern& chosen);
+    void rebuild();
+};
+bool x86_binop_reads_memory(Binop binop) {
+    switch (binop) {
+        case Binop::BitShl:
+        case Binop::BitShr:
+        case Binop::BitSar:
+            return false;
+        default:
+            return true;
+    }
+}
+static bool is_disp(const Arg& arg) {
+    long long v = static_cast<long long>(arg.value);
+    return arg.type == ArgType::Literal && v >= -2147483648LL && v <= 2147483647LL;
+}
+static bool is_address_constant(const Arg& arg) {
+    return arg.type == ArgType::RefAutoVar || arg.type == ArgType::RefExternal ||
+           arg.type == ArgType::DataOffset;
+}
+static bool is_scale_shift(const Op& op) {
+    return op.type == OpType::Binop && op.binop == Binop::BitShl && op.arg.type == ArgType::AutoVar &&
+           op.arg2.type == ArgType::Literal && op.arg2.value >= 1 && op.arg2.value <= 3;
+}
+static bool is_plus(const Op& op) {
+    return op.type == OpType::Binop && op.binop == Binop::Plus;
+}
+// Splits a + b into the operand matching first and the other one
+static bool split_plus(const Op& op, bool (*first)(const Arg&), const Arg*& a, const Arg*& b) {
+    if (!is_plus(op)) return false;
+    if (first(op.arg)) {
+        a = &op.arg;
+        b = &op.arg2;
+        return true;
+    }
+    if (first(op.arg2)) {
+        a = &op.arg2;
+        b = &op.arg;
+        return true;
+    }
+    return false;
+}
+static bool is_auto(const Arg& arg) {
+    return arg.type == ArgType::AutoVar;
+}
+static bool is_value(const Arg& arg) {
+    return arg.type == ArgType::AutoVar || arg.type == ArgType::External;
+}
+size_t X86Selector::foldable_def(size_t slot, size_t reader) const {
+    if (slot == 0 || slot >= last_def.size() || escaped.test(slot)) return NONE;
+    size_t d = reader == current ? last_def[slot] : NONE;
+    for (const std::pair<size_t, size_t>& r : reaching[reader]) {
+        if (r.first == slot && reader != current) d = r.second;
+    }
+    if (d == NONE) return NONE;
+    std::vector<size_t> used;
+    bool memory_written = false;
+    for (size_t j = d + 1; j < current; j++) {
+        op_used_slots(op(j), used);
+        if (j != reader && std::count(used.begin(), used.end(), slot) != 0) return NONE;
+        if (op_writes_memory(op(j))) memory_written = true;
+    }
+    size_t def_slot;
+    bool redefined = op_defined_slot(op(current), def_slot) && def_slot == slot;
+    if (live_after[current].test(slot) && !redefined) return NONE;
+    op_used_slots(op(reader), used);
+    if (std::count(used.begin(), used.end(), slot) != 1) return NONE;
+    const Op& def = op(d);
+    if (def.type == OpType::AutoAssign) {
+        return is_address_constant(def.arg) ? d : NONE;
+    }
+    if (def.type != OpType::Binop || (def.binop != Binop::Plus && def.binop != Binop::BitShl)) {
+        return NONE;
+    }
+    const Arg* args[2] = {&def.arg, &def.arg2};
+    for (const Arg* arg : args) {
+        if (arg->type == ArgType::AutoVar) {
+            if (last_def[arg->index] != NONE && last_def[arg->index] > d) return NONE;
+        } else if (arg->type == ArgType::External) {
+            if (memory_written) return NONE;
+        } else if (arg->type != ArgType::Literal && !is_address_constant(*arg)) {
+            return NONE;
+        }
+    }
+    return d;
+}
+static bool match_AddrScaled(const X86Selector& s, const TileSite& site, std::vector<size_t>& covered) {
+    size_t d = s.foldable_def(site.slot, site.use);
+    if (d == NONE) return false;
+    const Op& def = s.op(d);
+    if (!is_plus(def) || !is_value(def.arg) || !is_value(def.arg2)) return false;
+    for (int side = 0; side < 2; side++) {
+        const Arg& index = side == 0 ? def.arg2 : def.arg;
+        if (!is_auto(index)) continue;
+        size_t d2 = s.foldable_def(index.index, d);
+        if (d2 != NONE && is_scale_shift(s.op(d2))) {
+            covered.push_back(d2);
+            covered.push_back(d);
+            return true;
+        }
+    }
+    return false;
+}
+static bool match_AddrIndex(const X86Selector& s, const TileSite& site, std::vector<size_t>& covered) {
+    size_t d = s.foldable_def(site.slot, site.use);
+    if (d == NONE || !is_plus(s.op(d)) || !is_value(s.op(d).arg) || !is_value(s.op(d).arg2)) return false;
+    covered.push_back(d);
+    return true;
+}
+static bool match_AddrDisp(const X86Selector& s, const TileSite& site, std::vector<size_t>& covered) {
+    size_t d = s.foldable_def(site.slot, site.use);
+    const Arg* base;
+    const Arg* disp;
+    if (d == NONE || !split_plus(s.op(d), is_value, base, disp) || !is_disp(*disp)) return false;
+    covered.push_back(d);
+    return true;
+}
+static bool match_AddrFrame(const X86Selector& s, const TileSite& site, std::vector<size_t>& covered) {
+    size_t d = s.foldable_def(site.slot, site.use);
+    if (d == NONE) return false;
+    const Op& def = s.op(d);
+    const Arg* base;
+    const Arg* disp;
+    bool ok = (def.type == OpType::AutoAssign && def.arg.type == ArgType::RefAutoVar) ||
+              (split_plus(def, [](const Arg& a) { return a.type == ArgType::RefAutoVar; }, base, disp) &&
+               is_disp(*disp));
+    if (ok) covered.push_back(d);
+    return ok;
+}
+static bool is_symbol_address(const Arg& arg) {
+    return arg.type == ArgType::RefExternal || arg.type == ArgType::DataOffset;
+}
+static bool match_AddrSymbol(const X86Selector& s, const TileSite& site, std::vector<size_t>& covered) {
+    size_t d = s.foldable_def(site.slot, site.use);
+    if (d == NONE) return false;
+    const Op& def = s.op(d);
+    const Arg* base;
+    const Arg* disp;
+    bool ok = (def.type == OpType::AutoAssign && is_symbol_address(def.arg)) ||
+              (split_plus(def, is_symbol_address, base, disp) && is_disp(*disp));
+    if (ok) covered.push_back(d);
+    return ok;
+}
+static bool match_AddrSlot(const X86Selector&, const TileSite&, std::vector<size_t>&) {
+    return true;
+}
+static bool match_LeaScaled(const X86Selector& s, const TileSite& site, std::vector<size_t>& covered) {
+    const Op& op = s.op(site.use);
+    if (!is_plus(op) || !is_auto(op.arg) || !is_auto(op.arg2)) return false;
+    for (int side = 0; side < 2; side++) {
+        const Arg& index = side == 0 ? op.arg2 : op.arg;
+        size_t d = s.foldable_def(index.index, site.use);
+        if (d != NONE && is_scale_shift(s.op(d))) {
+            covered.push_back(d);
+            return true;
+        }
+    }
+    return false;
+}
+static bool match_LeaIndex(const X86Selector& s, const TileSite& site, std::vector<size_t>&) {
+    const Op& op = s.op(site.use);
+    return is_plus(op) && is_auto(op.arg) && is_auto(op.arg2);
+}
+static bool match_LeaDisp(const X86Selector& s, const TileSite& site, std::vector<size_t>&) {
+    const Arg* base;
+    const Arg* disp;
+    return split_plus(s.op(site.use), is_auto, base, disp) && is_disp(*disp);
+}
+static bool match_LeaMul(const X86Selector& s, const TileSite& site, std::vector<size_t>&) {
+    const Op& op = s.op(site.use);
+    return op.binop == Binop::Mult && is_auto(op.arg) && op.arg2.type == ArgType::Literal &&
+           (op.arg2.value == 3 || op.arg2.value == 5 || op.arg2.value == 9);
+}
+static bool match_BinopAlu(const X86Selector&, const TileSite&, std::vector<size_t>&) {
+    return true;
+}
+unsigned X86Selector::choose(X86PatternRoot root, const TileSite& site, X86Pattern& chosen) {
+    std::vector<size_t> covered;
+    std::vector<size_t> best_covered;
+    long long best_total = 0;
+    unsigned best_cost = 0;
+    bool found = false;
+    for (const X86PatternInfo& info : PATTERNS) {
+        if (info.root != root) continue;
+        covered.clear();
+        if (!info.match(*this, site, covered)) continue;
+        long long total = info.cost;
+        for (size_t c : covered) {
+            total -= own_cost[c];
+        }
+        for (size_t g = block_begin; g < site.use; g++) {
+            size_t into = folded_into[g];
+            if (into == NONE) continue;
+            bool inside = false;
+            for (size_t c : covered) {
+                if (c == g) inside = true;
+            }
+            for (size_t c : covered) {
+                if (into == c && !inside) total += own_cost[g];
+            }
+        }
+        if (!found || total < best_total) {
+            found = true;
+            best_total = total;
+            best_cost = info.cost;
+            best_covered = covered;
+            chosen = info.pattern;
+        }
+    }
+    for (size_t g = block_begin; g < site.use; g++) {
+        for (size_t c : best_covered) {
+            if (folded_into[g] == c) folded_into[g] = NONE;
+        }
+    }
+    for (size_t c : best_covered) {
+        folded_into[c] = site.use;
+    }
+    return best_cost;
+}
+void X86Selector::rebuild() {
+    std::vector<OpWithLocation> body;
+    std::vector<bool> folded;
+    std::vector<X86Pattern> pattern;
+    std::vector<X86Pattern> address;
+    for (size_t i = 0; i < sel.func.body.size(); i++) {
+        if (folded_into[i] != NONE) continue;
+        for (size_t j = 0; j < i; j++) {
+            if (folded_into[j] != i) continue;
+            body.push_back(sel.func.body[j]);
+            folded.push_back(true);
+            pattern.push_back(sel.pattern[j]);
+            address.push_back(sel.address[j]);
+        }
+        body.push_back(sel.func.body[i]);
+        folded.push_back(false);
+        pattern.push_back(sel.pattern[i]);
+        address.push_back(sel.address[i]);
+    }
+    sel.func.body.swap(body);
+    sel.folded.swap(folded);
+    sel.pattern.swap(pattern);
+    sel.address.swap(address);
+}
+void X86Selector::run() {
+    Func& func = sel.func;
+    size_t n = func.body.size();
+    size_t slots = func.auto_vars_count + 1;
+    for (OpWithLocation& owl : func.body) {
+        Op& op = owl.opcode;
+        bool commutative = op.type == OpType::Binop &&
+                           (op.binop == Binop::Plus || op.binop == Binop::Mult ||
+                            op.binop == Binop::BitAnd || op.binop == Binop::BitOr);
+        if (commutative && op.arg.type == ArgType::Deref && op.arg2.type != ArgType::Deref) {
+            std::swap(op.arg, op.arg2);
+        }
+    }
+    escaped_slots(func, escaped);
+    Cfg cfg;
+    build_cfg(func, cfg);
+    Liveness live;
+    compute_liveness(func, cfg, live);
+    live_after.resize(n);
+    std::vector<size_t> used;
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+        BitSet cur = live.live_out[b];
+        for (size_t i = cfg.blocks[b].end; i > cfg.blocks[b].begin; i--) {
+            live_after[i - 1] = cur;
+            size_t def;
+            if (op_defined_slot(op(i - 1), def)) cur.reset(def);
+            op_used_slots(op(i - 1), used);
+            for (size_t u : used) {
+                cur.set(u);
+            }
+        }
+    }
+    last_def.assign(slots, NONE);
+    reaching.assign(n, std::vector<std::pair<size_t, size_t>>());
+
+    own_cost.assign(n, 0);
+    folded_into.assign(n, NONE);
+    for (const BasicBlock& block : cfg.blocks) {
+        block_begin = block.begin;
+        for (size_t s = 0; s < slots; s++) {
+            last_def[s] = NONE;
+        }
+        for (size_t i = block.begin; i < block.end; i++) {
+            const Op& o = op(i);
+            TileSite site = {i, 0};
+            current = i;
+            op_used_slots(o, used);
+            for (size_t u : used) {
+                reaching[i].push_back(std::make_pair(u, last_def[u]));
+            }
+            if (o.type == OpType::Binop) {
+                if (o.arg2.type == ArgType::Deref && x86_binop_reads_memory(o.binop)) {
+                    site.slot = o.arg2.index;
+                    own_cost[i] = 2 + choose(X86PatternRoot::Address, site, sel.address[i]);
+                } else {
+                    own_cost[i] = choose(X86PatternRoot::Binop, site, sel.pattern[i]);
+                }
+            } else if (o.type == OpType::AutoAssign && o.arg.type == ArgType::Deref) {
+                site.slot = o.arg.index;
+                own_cost[i] = 1 + choose(X86PatternRoot::Address, site, sel.address[i]);
+            } else if ((o.type == OpType::JmpIfNotLabel || (o.type == OpType::Return && o.has_return_arg)) &&
+                       o.arg.type == ArgType::Deref) {
+                site.slot = o.arg.index;
+                own_cost[i] = 2 + choose(X86PatternRoot::Address, site, sel.address[i]);
+            } else if (o.type == OpType::CmpJmpIfNotLabel && o.arg2.type == ArgType::Deref) {
+                site.slot = o.arg2.index;
+                own_cost[i] = 2 + choose(X86PatternRoot::Address, site, sel.address[i]);
+            } else if (o.type == OpType::Store) {
+                site.slot = o.index;
+                own_cost[i] = 1 + choose(X86PatternRoot::Address, site, sel.address[i]);
+            } else {
+                own_cost[i] = 1;
+            }
+            size_t def;
+            if (op_defined_slot(o, def)) last_def[def] = i;
+        }
+    }
+    rebuild();
+}
+void select_x86_64(const Func& func, bool fold, X86Selection& sel) {
+    sel.func = func;
+    sel.folded.assign(func.body.size(), false);
+    sel.pattern.assign(func.body.size(), X86Pattern::BinopAlu);
+    sel.address.assign(func.body.size(), X86Pattern::AddrSlot);
+    if (!fold || func.body.empty()) return;
+    X86Selector selector(sel);
+    selector.run();
+}